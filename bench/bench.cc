@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include <hiredis/hiredis.h>
+#include "../redis_cluster.h"
+#include "../test/mock_cluster.h"
+
+/**
+ * Microbenchmarks of the client hot paths, no redis server needed:
+ * requests go to an in-process MockCluster.
+ */
+
+extern uint16_t crc16(const char *buf, int len);
+
+static const int POOL_SIZE = 64;
+
+static MockCluster              mock;
+static redis::cluster::Cluster *cluster = NULL;
+static redis::cluster::Node    *pool_node = NULL;
+
+static void setup() {
+    if( mock.start(3)!=0 ) {
+        fprintf(stderr, "mock cluster start fail\n");
+        exit(1);
+    }
+
+    cluster = new redis::cluster::Cluster();
+    if( cluster->setup(mock.startup().c_str(), false)!=0 ) {
+        fprintf(stderr, "cluster setup fail\n");
+        exit(1);
+    }
+
+    /* fill the pool, so get_conn() never connects while measured */
+
+    pool_node = new redis::cluster::Node("127.0.0.1", mock.port(0));
+    std::vector<void *> conns;
+    for(int i = 0; i < POOL_SIZE; i++) {
+        void *conn = pool_node->get_conn();
+        if( !conn ) {
+            fprintf(stderr, "connect to mock cluster fail\n");
+            exit(1);
+        }
+        conns.push_back(conn);
+    }
+    for(size_t i = 0; i < conns.size(); i++) {
+        pool_node->put_conn(conns[i]);
+    }
+}
+
+/* hashing */
+
+static void BM_Crc16(benchmark::State &state) {
+    std::string key(state.range(0), 'k');
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(crc16(key.data(), key.length()));
+    }
+    state.SetBytesProcessed(state.iterations() * key.length());
+}
+BENCHMARK(BM_Crc16)->Arg(8)->Arg(32)->Arg(256);
+
+static void BM_KeyHash(benchmark::State &state) {
+    std::string key = "user:1000:profile";
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(cluster->test_key_hash(key));
+    }
+}
+BENCHMARK(BM_KeyHash);
+
+static void BM_KeyHashTag(benchmark::State &state) {
+    std::string key = "session:{user:1000}:profile";
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(cluster->test_key_hash(key));
+    }
+}
+BENCHMARK(BM_KeyHashTag);
+
+static void BM_SlotLookup(benchmark::State &state) {
+    std::string key = "user:1000:profile";
+    for(auto _ : state) {
+        benchmark::DoNotOptimize(cluster->test_slot_node(key));
+    }
+}
+BENCHMARK(BM_SlotLookup)->ThreadRange(1, 64);
+
+/* connection pool */
+
+static void BM_GetPutConn(benchmark::State &state) {
+    for(auto _ : state) {
+        void *conn = pool_node->get_conn();
+        benchmark::DoNotOptimize(conn);
+        pool_node->put_conn(conn);
+    }
+}
+BENCHMARK(BM_GetPutConn)->ThreadRange(1, 64)->UseRealTime();
+
+/* run(), argument marshalling and one round trip to the mock cluster */
+
+static void BM_RunSet(benchmark::State &state) {
+    std::vector<std::string> cmd;
+    cmd.push_back("SET");
+    cmd.push_back("key");
+    cmd.push_back(std::string(state.range(0), 'v'));
+    for(auto _ : state) {
+        redisReply *reply = cluster->run(cmd);
+        if( !reply ) {
+            state.SkipWithError(cluster->strerr().c_str());
+            break;
+        }
+        freeReplyObject(reply);
+    }
+}
+BENCHMARK(BM_RunSet)->Arg(16)->Arg(1024)->ThreadRange(1, 8)->UseRealTime();
+
+static void BM_FormatCommandArgv(benchmark::State &state) {
+    std::vector<const char *> argv;
+    std::vector<size_t> argvlen;
+    std::string value(state.range(0), 'v');
+    argv.push_back("SET");
+    argvlen.push_back(3);
+    argv.push_back("key");
+    argvlen.push_back(3);
+    argv.push_back(value.data());
+    argvlen.push_back(value.length());
+    for(auto _ : state) {
+        char *out = NULL;
+        int len = redisFormatCommandArgv(&out, argv.size(), argv.data(), argvlen.data());
+        benchmark::DoNotOptimize(len);
+        free(out);
+    }
+}
+BENCHMARK(BM_FormatCommandArgv)->Arg(16)->Arg(1024);
+
+/* reply parsing */
+
+static void parse_reply(benchmark::State &state, const std::string &wire) {
+    for(auto _ : state) {
+        redisReader *reader = redisReaderCreate();
+        void *reply = NULL;
+        redisReaderFeed(reader, wire.data(), wire.length());
+        if( redisReaderGetReply(reader, &reply)!=REDIS_OK || !reply ) {
+            state.SkipWithError("parse fail");
+            redisReaderFree(reader);
+            break;
+        }
+        freeReplyObject(reply);
+        redisReaderFree(reader);
+    }
+    state.SetBytesProcessed(state.iterations() * wire.length());
+}
+
+static void BM_ParseBulk(benchmark::State &state) {
+    char header[32];
+    snprintf(header, sizeof(header), "$%ld\r\n", (long)state.range(0));
+    parse_reply(state, header + std::string(state.range(0), 'v') + "\r\n");
+}
+BENCHMARK(BM_ParseBulk)->Arg(16)->Arg(1024)->Arg(64 * 1024);
+
+static void BM_ParseArray(benchmark::State &state) {
+    char header[32];
+    snprintf(header, sizeof(header), "*%ld\r\n", (long)state.range(0));
+    std::string wire = header;
+    for(int i = 0; i < state.range(0); i++) {
+        wire += "$16\r\n" + std::string(16, 'v') + "\r\n";
+    }
+    parse_reply(state, wire);
+}
+BENCHMARK(BM_ParseArray)->Arg(10)->Arg(100);
+
+
+int main(int argc, char *argv[]) {
+    ::benchmark::Initialize(&argc, argv);
+    if( ::benchmark::ReportUnrecognizedArguments(argc, argv) ) {
+        return 1;
+    }
+    setup();
+    ::benchmark::RunSpecifiedBenchmarks();
+    delete cluster;
+    mock.stop();
+    return 0;
+}
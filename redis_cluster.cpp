@@ -2,12 +2,33 @@
 #include "deps/crc16.c"
 #include <time.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <ifaddrs.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <sys/socket.h>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <set>
+#include <deque>
 #include <iterator>
+#include <algorithm>
 #include <hiredis/hiredis.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
 
 #ifdef DEBUG
 #define DEBUGINFO(msg) std::cout << "[DEBUG] "<< msg << std::endl;
@@ -15,6 +36,12 @@
 #define DEBUGINFO(msg)
 #endif
 
+#ifdef NO_TRACE_HOOKS
+#define TRACING() false
+#else
+#define TRACING() __builtin_expect(tracing_, 0)
+#endif
+
 #define rcassert(b) \
     if(!(b)) {\
         abort();\
@@ -24,6 +51,11 @@ namespace redis {
 namespace cluster {
 
 static const char *UNSUPPORT = "#INFO#SHUTDOWN#MULTI#SLAVEOF#CONFIG#";
+static const char *READONLY_CMDS = "#GET#MGET#STRLEN#GETRANGE#EXISTS#TTL#PTTL#TYPE#"
+                                   "#HGET#HMGET#HGETALL#HEXISTS#HLEN#HKEYS#HVALS#HSTRLEN#"
+                                   "#LINDEX#LLEN#LRANGE#SCARD#SISMEMBER#SMEMBERS#SRANDMEMBER#"
+                                   "#ZCARD#ZCOUNT#ZRANGE#ZRANGEBYSCORE#ZRANK#ZREVRANGE#ZREVRANK#ZSCORE#"
+                                   "#BITCOUNT#GETBIT#PFCOUNT#";
 
 static inline std::string to_upper(const std::string& in) {
     std::string out;
@@ -34,536 +66,4991 @@ static inline std::string to_upper(const std::string& in) {
     return out;
 }
 
-void  free_specific_data(void * sdata) {
-    delete ((redis::cluster::Cluster::ThreadDataType *)sdata);
+static inline uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* wait at most us microseconds for fd to be readable, return true if readable */
+static bool wait_readable(int fd, uint64_t us) {
+    struct pollfd pfd;
+    struct timespec ts;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    ts.tv_sec = us / 1000000;
+    ts.tv_nsec = (us % 1000000) * 1000;
+    return ppoll(&pfd, 1, &ts, NULL)>0;
+}
+
+/* add to a counter which only the calling thread writes, readers may load it concurrently */
+static inline void bump(uint64_t &counter, uint64_t n = 1) {
+    __atomic_store_n(&counter, __atomic_load_n(&counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline size_t digits(uint64_t v) {
+    size_t n = 1;
+    while( v>=10 ) {
+        v /= 10;
+        n++;
+    }
+    return n;
+}
+
+/* bytes of the RESP encoding of a request */
+static size_t request_size(int argc, const size_t *argvlen) {
+    size_t size = 3 + digits(argc);                         // *<argc>\r\n
+    for(int i = 0; i < argc; i++) {
+        size += 5 + digits(argvlen[i]) + argvlen[i];        // $<len>\r\n<arg>\r\n
+    }
+    return size;
+}
+
+/* bytes of the RESP encoding of a reply */
+static size_t reply_size(const redisReply *reply) {
+    switch( reply->type ) {
+    case REDIS_REPLY_STRING:
+        return 5 + digits(reply->len) + reply->len;
+    case REDIS_REPLY_STATUS:
+    case REDIS_REPLY_ERROR:
+        return 3 + reply->len;
+    case REDIS_REPLY_INTEGER: {
+        /* in unsigned arithmetic, LLONG_MIN has no positive counterpart */
+        unsigned long long v = (unsigned long long)reply->integer;
+        bool negative = reply->integer<0;
+        return 3 + digits(negative? 0ULL - v: v) + negative;
+    }
+    case REDIS_REPLY_NIL:
+        return 5;
+    case REDIS_REPLY_ARRAY: {
+        size_t size = 3 + digits(reply->elements);
+        for(size_t i = 0; i < reply->elements; i++) {
+            size += reply_size(reply->element[i]);
+        }
+        return size;
+    }
+    default:
+        return 0;
+    }
+}
+
+static bool write_all(int fd, const char *buf, size_t len) {
+    while( len>0 ) {
+        ssize_t n = write(fd, buf, len);
+        if( n<0 ) {
+            if( errno==EINTR )
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static int flush_output(redisContext *c) {
+    int done = 0;
+    do {
+        if( redisBufferWrite(c, &done)!=REDIS_OK ) {
+            return -1;
+        }
+    } while( !done );
+    return 0;
+}
+
+static const char ASKING_CMD[] = "*1\r\n$6\r\nASKING\r\n";
+
+static void set_context_error(redisContext *c, int type, const char *str) {
+    c->err = type;
+    snprintf(c->errstr, sizeof(c->errstr), "%s", str);
 }
 
 /**
- * class Node
+ * Reader of replies straight off a socket, for the values which should not go through
+ * the hiredis reader. Only the bytes read along with a header are buffered, payloads
+ * are read into the destination. One request must be in flight at a time.
  */
-Node::Node(const std::string& host, unsigned int port, unsigned int timeout) {
-    host_ = host;
-    port_ = port;
-    timeout_ = timeout;
+typedef struct {
+    int     fd;
+    char    buf[512];
+    size_t  pos;
+    size_t  len;
+    size_t  bytes;      // read from the socket
+    bool    eof;
+} RawReaderType;
 
-    conn_get_count_ = 0;
-    conn_reuse_count_ = 0;
-    conn_put_count_ = 0;
+static void raw_init(RawReaderType &r, int fd) {
+    r.fd = fd;
+    r.pos = 0;
+    r.len = 0;
+    r.bytes = 0;
+    r.eof = false;
+}
 
-    int ret = pthread_spin_init(&lock_,PTHREAD_PROCESS_PRIVATE);
-    rcassert(ret == 0);
+static ssize_t raw_recv(RawReaderType &r, char *dst, size_t n) {
+    ssize_t ret;
+    do {
+        ret = read(r.fd, dst, n);
+    } while( ret<0 && errno==EINTR );
+    if( ret>0 ) {
+        r.bytes += ret;
+    } else if( ret==0 ) {
+        r.eof = true;
+    }
+    return ret;
 }
 
-Node::~Node() {
+/* a line without CRLF, false on error or EOF */
+static bool raw_line(RawReaderType &r, std::string &line) {
+    line.clear();
+    for(;;) {
+        char *p = (char *)memchr(r.buf + r.pos, '\n', r.len - r.pos);
+        if( p ) {
+            line.append(r.buf + r.pos, p - (r.buf + r.pos));
+            r.pos = p + 1 - r.buf;
+            if( !line.empty() && line[line.length() - 1]=='\r' ) {
+                line.erase(line.length() - 1);
+            }
+            return true;
+        }
+        line.append(r.buf + r.pos, r.len - r.pos);
+        r.pos = r.len = 0;
+        ssize_t n = raw_recv(r, r.buf, sizeof(r.buf));
+        if( n<=0 ) {
+            return false;
+        }
+        r.len = n;
+    }
+}
 
-    std::list<void *>::iterator iter = connections_.begin();
-    for(; iter!=connections_.end(); iter++) {
-        redisContext *conn = (redisContext *)*iter;
-        redisFree( conn );
+/* n bytes into dst, NULL dst to drop them */
+static bool raw_read(RawReaderType &r, char *dst, size_t n) {
+    size_t buffered = std::min(n, r.len - r.pos);
+    if( dst ) {
+        memcpy(dst, r.buf + r.pos, buffered);
+        dst += buffered;
+    }
+    r.pos += buffered;
+    n -= buffered;
+    while( n>0 ) {
+        ssize_t got = dst? raw_recv(r, dst, n): raw_recv(r, r.buf, std::min(n, sizeof(r.buf)));
+        if( got<=0 ) {
+            return false;
+        }
+        if( dst ) {
+            dst += got;
+        }
+        n -= got;
     }
+    return true;
+}
 
+/* a failed read of a raw exchange, the connection is dropped by the next Node::get_conn() */
+static void raw_io_error(redisContext *c, const RawReaderType &r) {
+    if( r.eof ) {
+        set_context_error(c, REDIS_ERR_EOF, "Server closed the connection");
+    } else {
+        set_context_error(c, REDIS_ERR_IO, strerror(errno));
+    }
 }
 
-void *Node::get_conn() {
+#ifdef HAVE_LIBURING
+/**
+ * io_uring transport. A ring has one registered buffer, replies are received into it
+ * with READ_FIXED and fed to the hiredis reader of the connection. Requests are
+ * formatted by the caller and never go through the hiredis output buffer.
+ */
+static const unsigned int URING_DEPTH = 64;
+static const size_t URING_BUF = 64 * 1024;
+static const unsigned int URING_WAIT_SLICE = 1;     // seconds a receive waits without a timeout set, then it is submitted again
 
-    redisContext *conn = NULL;
+enum {
+    URING_SEND = 1,
+    URING_READ = 2,
+    URING_TIMEOUT = 3
+};
 
-    {
-        LockGuard lg(lock_);
-        conn_get_count_++;
-        for(; connections_.size()>0;) {
-            conn = (redisContext *)connections_.back();
-            connections_.pop_back();
+struct UringType {
+    struct io_uring ring;
+    char           *buf;
+};
 
-            if( conn->err==REDIS_OK ) {
-                conn_reuse_count_++;
+static UringType *uring_create() {
+    UringType *u = new UringType;
+    if( io_uring_queue_init(URING_DEPTH, &u->ring, 0)<0 ) {
+        delete u;
+        return NULL;
+    }
+    u->buf = (char *)malloc(URING_BUF);
+    rcassert( u->buf );
+    struct iovec iov;
+    iov.iov_base = u->buf;
+    iov.iov_len = URING_BUF;
+    if( io_uring_register_buffers(&u->ring, &iov, 1)<0 ) {
+        io_uring_queue_exit(&u->ring);
+        free(u->buf);
+        delete u;
+        return NULL;
+    }
+    return u;
+}
+
+static void uring_destroy(UringType *u) {
+    io_uring_queue_exit(&u->ring);
+    free(u->buf);
+    delete u;
+}
+
+/* NULL and errno set if the ring failed */
+static struct io_uring_cqe *uring_wait(UringType *u) {
+    struct io_uring_cqe *cqe = NULL;
+    int ret;
+    do {
+        ret = io_uring_wait_cqe(&u->ring, &cqe);
+    } while( ret==-EINTR );
+    if( ret<0 ) {
+        errno = -ret;
+        return NULL;
+    }
+    return cqe;
+}
+
+/**
+ * Send the rest of out (if any) and read until replies replies are parsed, the last one
+ * is returned in reply. The send and the receive are linked in one submission. The send
+ * is MSG_WAITALL, so a short one breaks the link and cancels the receive, and the receive
+ * always has a linked timeout. A kernel that ignores MSG_WAITALL on a send completes it
+ * short without breaking the link; the receive then times out and the rest of the request
+ * is sent alone, the receive submitted only once it is complete. Without a timeout set the
+ * receive waits in slices and is submitted again. Errors are set on c like hiredis does.
+ */
+static int uring_exchange(UringType *u, redisContext *c, const char *out, size_t len, int replies,
+                          unsigned int timeout, void **reply) {
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout>0? timeout: URING_WAIT_SLICE;
+    ts.tv_nsec = 0;
+    *reply = NULL;
+    bool send_alone = false;
+
+    while( replies>0 ) {
+        if( c->err ) {
+            break;
+        }
+        void *r = NULL;
+        if( redisGetReplyFromReader(c, &r)!=REDIS_OK ) {
+            break;
+        }
+        if( r ) {
+            if( *reply ) {
+                freeReplyObject(*reply);
+            }
+            *reply = r;
+            replies--;
+            continue;
+        }
+
+        struct io_uring_sqe *sqe;
+        unsigned int wait = 0;
+        if( len>0 ) {
+            sqe = io_uring_get_sqe(&u->ring);
+            io_uring_prep_send(sqe, c->fd, out, len, MSG_NOSIGNAL | MSG_WAITALL);
+            sqe->user_data = URING_SEND;
+            wait++;
+        }
+        if( len==0 || !send_alone ) {
+            if( len>0 ) {
+                sqe->flags |= IOSQE_IO_LINK;
+            }
+            sqe = io_uring_get_sqe(&u->ring);
+            io_uring_prep_read_fixed(sqe, c->fd, u->buf, URING_BUF, 0, 0);
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe->user_data = URING_READ;
+            wait++;
+            sqe = io_uring_get_sqe(&u->ring);
+            io_uring_prep_link_timeout(sqe, &ts, 0);
+            sqe->user_data = URING_TIMEOUT;
+            wait++;
+        }
+
+        int ret = io_uring_submit_and_wait(&u->ring, wait);
+        if( ret<0 ) {
+            set_context_error(c, REDIS_ERR_IO, strerror(-ret));
+            break;
+        }
+
+        int nread = 0;
+        int err = 0;
+        bool timed_out = false;
+        for(unsigned int i = 0; i < wait; i++) {
+            struct io_uring_cqe *cqe = uring_wait(u);
+            if( !cqe ) {
+                err = errno;
+                break;
+            }
+            int res = cqe->res;
+            switch( cqe->user_data ) {
+            case URING_SEND:
+                if( res<0 ) {
+                    err = -res;
+                } else {
+                    out += res;
+                    len -= res;
+                    send_alone = (len>0);
+                }
+                break;
+            case URING_READ:
+                if( res>0 ) {
+                    nread = res;
+                } else if( res==0 ) {
+                    err = -1;
+                } else if( res!=-ECANCELED && res!=-EINTR && res!=-EAGAIN ) {
+                    err = -res;
+                }
+                break;
+            case URING_TIMEOUT:
+                timed_out = (res==-ETIME);
                 break;
             }
+            io_uring_cqe_seen(&u->ring, cqe);
+        }
 
-            redisFree( conn );
-            conn = NULL;
+        if( err<0 ) {
+            set_context_error(c, REDIS_ERR_EOF, "Server closed the connection");
+        } else if( err>0 ) {
+            set_context_error(c, REDIS_ERR_IO, strerror(err));
+        } else if( timed_out && nread==0 ) {
+            /* a partly sent request or no timeout set: send the rest and receive again */
+            if( timeout>0 && !send_alone ) {
+                set_context_error(c, REDIS_ERR_IO, strerror(EAGAIN));
+            }
+        } else if( nread>0 && redisReaderFeed(c->reader, u->buf, nread)!=REDIS_OK ) {
+            set_context_error(c, c->reader->err, c->reader->errstr);
         }
+    }
 
+    if( replies>0 && *reply ) {
+        freeReplyObject(*reply);
+        *reply = NULL;
     }
-    if( !conn ) {
-        if (timeout_ > 0) {
-            struct timeval tv;
-            tv.tv_sec = timeout_;
-            tv.tv_usec = 0;
+    return replies>0? REDIS_ERR: REDIS_OK;
+}
 
-            conn = redisConnectWithTimeout(host_.c_str(), port_, tv);
-            if (conn && (conn->err != REDIS_OK)) {
-                redisFree( conn );
-                conn = NULL;
+/* send outs[k] on conns[k], up to URING_DEPTH sends per submission, a failed connection gets its error set */
+static void uring_send_all(UringType *u, const std::vector<redisContext *> &conns, const std::vector<std::string> &outs) {
+    std::vector<size_t> sent(conns.size(), 0);
+    bool pending = true;
+    while( pending ) {
+        unsigned int wait = 0;
+        for(size_t k = 0; k < conns.size() && wait<URING_DEPTH; k++) {
+            if( conns[k] && !conns[k]->err && sent[k]<outs[k].size() ) {
+                struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+                io_uring_prep_send(sqe, conns[k]->fd, outs[k].data() + sent[k], outs[k].size() - sent[k], MSG_NOSIGNAL);
+                sqe->user_data = k;
+                wait++;
             }
-
-            if (conn && (redisSetTimeout(conn, tv) != REDIS_OK)) {
-                redisFree( conn );
-                conn = NULL;
+        }
+        if( wait==0 ) {
+            break;
+        }
+        int ret = io_uring_submit_and_wait(&u->ring, wait);
+        if( ret<0 ) {
+            for(size_t k = 0; k < conns.size(); k++) {
+                if( conns[k] && !conns[k]->err && sent[k]<outs[k].size() ) {
+                    set_context_error(conns[k], REDIS_ERR_IO, strerror(-ret));
+                }
             }
-        } else {
-            conn = redisConnect(host_.c_str(), port_);
-            if (conn && (conn->err != REDIS_OK)) {
-                redisFree( conn );
-                conn = NULL;
+            break;
+        }
+        for(unsigned int i = 0; i < wait; i++) {
+            struct io_uring_cqe *cqe = uring_wait(u);
+            if( !cqe ) {
+                int err = errno;
+                for(size_t k = 0; k < conns.size(); k++) {
+                    if( conns[k] && !conns[k]->err && sent[k]<outs[k].size() ) {
+                        set_context_error(conns[k], REDIS_ERR_IO, strerror(err));
+                    }
+                }
+                return;
+            }
+            size_t k = cqe->user_data;
+            if( cqe->res<0 ) {
+                set_context_error(conns[k], REDIS_ERR_IO, strerror(-cqe->res));
+            } else {
+                sent[k] += cqe->res;
+            }
+            io_uring_cqe_seen(&u->ring, cqe);
+        }
+        pending = false;
+        for(size_t k = 0; k < conns.size(); k++) {
+            if( conns[k] && !conns[k]->err && sent[k]<outs[k].size() ) {
+                pending = true;
             }
         }
     }
-    return conn;
 }
+#else
+struct UringType;
 
-void Node::put_conn(void *conn) {
-    LockGuard lg(lock_);
-    conn_put_count_++;
-    connections_.push_front( conn );
+static UringType *uring_create() {
+    return NULL;
 }
 
-std::string Node::simple_dump() const {
-    std::ostringstream ss;
-    ss<<"Node{"<< host_ << ":" << port_<<"}";
-    return ss.str();
+static void uring_destroy(UringType *) {
 }
 
-std::string Node::stat_dump() {
-    std::ostringstream ss;
-    LockGuard lg(lock_);
-    ss<<"Node{"<< host_ << ":" << port_ << " pool_size(free conn): "<<connections_.size()
-      <<" conn_create: "<< conn_get_count_ - conn_reuse_count_
-      <<" conn_get: "<< conn_get_count_
-      <<" conn_reuse: "<< conn_reuse_count_
-      <<" conn_put: "<< conn_put_count_<<"}";
-    return ss.str();
+static int uring_exchange(UringType *, redisContext *c, const char *, size_t, int, unsigned int, void **reply) {
+    *reply = NULL;
+    set_context_error(c, REDIS_ERR_OTHER, "io_uring not available");
+    return REDIS_ERR;
+}
+
+static void uring_send_all(UringType *, const std::vector<redisContext *> &, const std::vector<std::string> &) {
+}
+#endif
+
+/* deep copy, the copy can be freed with freeReplyObject */
+static redisReply *dup_reply(const redisReply *r) {
+    redisReply *d = (redisReply *)malloc(sizeof(redisReply));
+    rcassert( d );
+    *d = *r;
+    if( r->str ) {
+        d->str = (char *)malloc(r->len + 1);
+        rcassert( d->str );
+        memcpy(d->str, r->str, r->len);
+        d->str[r->len] = '\0';
+    }
+    if( r->element ) {
+        d->element = (redisReply **)malloc(r->elements * sizeof(redisReply *));
+        rcassert( d->element );
+        for(size_t i = 0; i < r->elements; i++) {
+            d->element[i] = r->element[i]? dup_reply(r->element[i]): NULL;
+        }
+    }
+    return d;
 }
 
 /**
- * class Cluster
+ * Compressed value: 3 bytes magic, 1 byte codec, 4 bytes original length (little endian), payload.
  */
-Cluster::Cluster(unsigned int timeout)
-    :load_slots_asap_(false),
-     timeout_(timeout) {
+#define CODEC_HEADER_LEN 8
+#define CODEC_LZ4 1
+static const char CODEC_MAGIC[3] = {'\xff', 'R', 'Z'};
+static const size_t CODEC_MAX_ORIG = 512 << 20;        // the largest redis string
+static const size_t CODEC_MAX_RATIO = 255;             // LZ4 expands one byte to at most 255
+
+static bool compress_value(const char *src, size_t len, std::string &out) {
+#ifdef HAVE_LZ4
+    if( len>(size_t)LZ4_MAX_INPUT_SIZE ) {
+        return false;
+    }
+    int bound = LZ4_compressBound((int)len);
+    out.resize(CODEC_HEADER_LEN + bound);
+    char *p = &out[0];
+    memcpy(p, CODEC_MAGIC, sizeof(CODEC_MAGIC));
+    p[3] = CODEC_LZ4;
+    for(int i = 0; i < 4; i++) {
+        p[4 + i] = (char)((len >> (8 * i)) & 0xff);
+    }
+    int n = LZ4_compress_default(src, p + CODEC_HEADER_LEN, (int)len, bound);
+    if( n<=0 || CODEC_HEADER_LEN + (size_t)n>=len ) {
+        return false;   // not worth it
+    }
+    out.resize(CODEC_HEADER_LEN + n);
+    return true;
+#else
+    (void)src;
+    (void)len;
+    (void)out;
+    return false;
+#endif
 }
 
-Cluster::~Cluster() {
+static bool decompress_value(const char *src, size_t len, std::string &out) {
+    if( len<CODEC_HEADER_LEN || memcmp(src, CODEC_MAGIC, sizeof(CODEC_MAGIC))!=0 ) {
+        return false;   // legacy value
+    }
+    size_t orig = 0;
+    for(int i = 0; i < 4; i++) {
+        orig |= (size_t)(unsigned char)src[4 + i] << (8 * i);
+    }
+#ifdef HAVE_LZ4
+    if( src[3]==CODEC_LZ4 ) {
+        /* a legacy value may start with the magic too, don't trust its length before LZ4 does */
+        if( orig>CODEC_MAX_ORIG || orig>CODEC_MAX_RATIO * (len - CODEC_HEADER_LEN) ) {
+            return false;
+        }
+        out.resize(orig);
+        int n = LZ4_decompress_safe(src + CODEC_HEADER_LEN, orig? &out[0]: NULL, (int)(len - CODEC_HEADER_LEN), (int)orig);
+        return n>=0 && (size_t)n==orig;
+    }
+#endif
+    (void)orig;
+    (void)out;
+    return false;
+}
 
-    // release node pool
-    NodePoolType::iterator iter = node_pool_.begin();
-    for(; iter!=node_pool_.end(); iter++) {
-        Node *node = *iter;
-        delete node;
+/* decompress tagged string replies in place */
+static void decompress_reply(redisReply *r) {
+    if( r->type==REDIS_REPLY_STRING ) {
+        std::string out;
+        if( decompress_value(r->str, r->len, out) ) {
+            char *str = (char *)malloc(out.size() + 1);
+            rcassert( str );
+            memcpy(str, out.data(), out.size());
+            str[out.size()] = '\0';
+            free(r->str);
+            r->str = str;
+            r->len = out.size();
+        }
+    } else if( r->type==REDIS_REPLY_ARRAY ) {
+        for(size_t i = 0; i < r->elements; i++) {
+            if( r->element[i] ) {
+                decompress_reply(r->element[i]);
+            }
+        }
     }
-    node_pool_.clear();
+}
 
+/**
+ * Parse redirection error 'MOVED 3999 127.0.0.1:6381' or 'ASK 3999 127.0.0.1:6381'.
+ * @return false if it is not a redirection
+ */
+static bool parse_redirect(const char *str, bool &ask, int &slot, std::string &host, int &port) {
+    if( !strncmp(str, "MOVED ", 6) ) {
+        ask = false;
+    } else if( !strncmp(str, "ASK ", 4) ) {
+        ask = true;
+    } else {
+        return false;
+    }
+    const char *s = strchr(str, ' ');
+    const char *p = strchr(s + 1, ' ');
+    if( !p ) {
+        return false;
+    }
+    const char *c = strrchr(p + 1, ':');
+    if( !c ) {
+        return false;
+    }
+    slot = atoi(s + 1);
+    host.assign(p + 1, c - (p + 1));
+    port = atoi(c + 1);
+    return true;
 }
 
-int Cluster::setup(const char *startup, bool lazy) {
+enum {
+    RAW_DONE = 0,       // reply consumed
+    RAW_REDIRECT = 1,   // MOVED or ASK, the error line is in redirect
+    RAW_IO_ERROR = 2,   // error set on the connection
+    RAW_ABORT = 3       // like RAW_IO_ERROR, but the request must not be retried
+};
 
-    int ret = pthread_key_create(&key_, free_specific_data);
-    rcassert(ret == 0);
+static void append_bulk_header(std::string &out, char type, size_t len) {
+    char head[32];
+    int n = snprintf(head, sizeof(head), "%c%lu\r\n", type, (unsigned long)len);
+    out.append(head, n);
+}
 
-    ret = pthread_spin_init(&np_lock_, PTHREAD_PROCESS_PRIVATE);
-    if(ret != 0) {
-        return -1;
+static void append_get(std::string &out, const std::string &key) {
+    out.append("*2\r\n$3\r\nGET\r\n", 13);
+    append_bulk_header(out, '$', key.length());
+    out.append(key);
+    out.append("\r\n", 2);
+}
+
+/**
+ * Read a reply header line. A MOVED/ASK error gives RAW_REDIRECT with the line (without '-'),
+ * other errors give RAW_DONE with error set and the message in line, anything else RAW_DONE
+ * with the line as is.
+ */
+static int raw_reply_line(redisContext *c, RawReaderType &r, std::string &line, bool &error) {
+    error = false;
+    if( !raw_line(r, line) ) {
+        raw_io_error(c, r);
+        return RAW_IO_ERROR;
+    }
+    if( line.empty() ) {
+        set_context_error(c, REDIS_ERR_PROTOCOL, "empty reply line");
+        return RAW_IO_ERROR;
+    }
+    if( line[0]=='-' ) {
+        line.erase(0, 1);
+        if( !strncmp(line.c_str(), "MOVED ", 6) || !strncmp(line.c_str(), "ASK ", 4) ) {
+            return RAW_REDIRECT;
+        }
+        error = true;
     }
+    return RAW_DONE;
+}
 
-    ret = pthread_spin_init(&load_slots_lock_, PTHREAD_PROCESS_PRIVATE);
-    if(ret != 0) {
-        return -1;
+/* the length of a bulk string reply from its header line, -1 for nil, false if it is not one */
+static bool raw_bulk_len(redisContext *c, const std::string &line, long long &n) {
+    if( line[0]!='$' ) {
+        set_context_error(c, REDIS_ERR_PROTOCOL, "bulk string reply expected");
+        return false;
     }
+    n = strtoll(line.c_str() + 1, NULL, 10);
+    return true;
+}
 
-    if( parse_startup(startup)<0 ) {
-        return -1;
+/* the CRLF after a bulk payload */
+static int raw_bulk_end(redisContext *c, RawReaderType &r) {
+    char crlf[2];
+    if( !raw_read(r, crlf, 2) ) {
+        raw_io_error(c, r);
+        return RAW_IO_ERROR;
+    }
+    if( crlf[0]!='\r' || crlf[1]!='\n' ) {
+        set_context_error(c, REDIS_ERR_PROTOCOL, "bad bulk string terminator");
+        return RAW_IO_ERROR;
     }
+    return RAW_DONE;
+}
 
-    slots_.resize( HASH_SLOTS );
-    for(size_t i = 0; i<slots_.size(); i++) {
-        slots_[i] = NULL;
+/**
+ * Read the reply of a GET into value: the payload goes to value.buf if it fits and is dropped
+ * otherwise. line is left with the MOVED/ASK line for RAW_REDIRECT, or the error reply
+ * (value.ret -1).
+ */
+static int raw_get_reply(redisContext *c, RawReaderType &r, bool decompress, Cluster::GetIntoType &value, std::string &line) {
+    bool error;
+    int ret = raw_reply_line(c, r, line, error);
+    if( ret!=RAW_DONE || error ) {
+        value.ret = -1;
+        return ret;
+    }
+    long long n;
+    if( !raw_bulk_len(c, line, n) ) {
+        return RAW_IO_ERROR;
+    }
+    if( n<0 ) {
+        value.ret = 0;
+        value.len = 0;
+        return RAW_DONE;
+    }
+    bool fits = (size_t)n<=value.cap;
+    if( !raw_read(r, fits? value.buf: NULL, n) ) {
+        raw_io_error(c, r);
+        return RAW_IO_ERROR;
+    }
+    if( (ret = raw_bulk_end(c, r))!=RAW_DONE ) {
+        return ret;
     }
 
-    if( !lazy && load_slots_cache()<0 ) {
-        return -1;
+    value.len = n;
+    value.ret = fits? 1: -2;
+    std::string plain;
+    if( fits && decompress && decompress_value(value.buf, n, plain) ) {
+        value.len = plain.length();
+        if( plain.length()<=value.cap ) {
+            memcpy(value.buf, plain.data(), plain.length());
+        } else {
+            value.ret = -2;
+        }
     }
+    return RAW_DONE;
+}
 
-    if( lazy ) {
-        load_slots_asap_ = true;
+static inline uint64_t fnv1a64(const char *p, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)p[i];
+        h *= 1099511628211ULL;
     }
+    return h;
+}
 
-    return 0;
+static __thread unsigned int tls_hot_tick = 0;
 
-}
+static __thread Cluster::ErrorStateType tls_error;
 
-redisReply* Cluster::run(const std::vector<std::string> &commands) {
-    std::vector<const char *> argv;
-    std::vector<size_t> argvlen;
+static __thread uint64_t tls_connect_us = 0;       // set by Node::get_conn() when it connected
+static __thread uint64_t tls_stat_owner = 0;       // Cluster::seq_ of tls_stat
+static __thread void    *tls_stat = NULL;
+static uint64_t cluster_seq = 0;
 
-    if( commands.size()<2 ) {
-        set_error(E_COMMANDS) << "none-key commands are not supported";
-        return NULL;
-    }
+enum { STAT_LIVE = 0, STAT_DEAD = 1, STAT_CLAIMED = 2 };   // ThreadStatType::dead
 
-    std::string cmd = to_upper(commands[0]);
+/* statistic blocks a thread owns, by Cluster::seq_, marked dead when it exits */
+typedef std::vector<std::pair<uint64_t, int *> > OwnedStatsType;
+static pthread_once_t stat_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stat_key;
+static pthread_mutex_t live_clusters_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::set<uint64_t> *live_clusters = NULL;   // never freed, exiting threads may still look
 
-    do {
-        std::ostringstream ss;
-        ss << "#" << cmd << "#";
-        if( strstr(UNSUPPORT, ss.str().c_str()) ) {
-            set_error(E_COMMANDS) << "command [" << cmd << "] not supported";
-            return NULL;
+static void release_stats(void *arg) {
+    OwnedStatsType *owned = (OwnedStatsType *)arg;
+    pthread_mutex_lock(&live_clusters_lock);
+    for(size_t i = 0; i < owned->size(); i++) {
+        /* the cluster may be gone, and its blocks with it */
+        if( live_clusters->count((*owned)[i].first) ) {
+            __atomic_store_n((*owned)[i].second, STAT_DEAD, __ATOMIC_RELEASE);
         }
-    } while(0);
-
-    for( size_t i=0; i<commands.size(); i++ ) {
-        argv.push_back(commands[i].c_str());
-        argvlen.push_back(commands[i].length());
     }
-
-    return redis_command_argv(commands[1], argv.size(), argv.data(), argvlen.data());
+    pthread_mutex_unlock(&live_clusters_lock);
+    delete owned;
 }
 
-bool Cluster::add_node(const std::string &host, int port, Node *&rpnode) {
-    Node *node = new Node(host, port, timeout_);
-    rcassert( node );
-
-    LockGuard lg(np_lock_);
-
-    std::pair<NodePoolType::iterator, bool> reti = node_pool_.insert(node);
-    rpnode = *(reti.first);
+static void make_stat_key() {
+    int ret = pthread_key_create(&stat_key, release_stats);
+    rcassert(ret == 0);
+    live_clusters = new std::set<uint64_t>;
+}
 
-    if(reti.second) {
-        return true;
-    } else {
-        delete node;
-        return false;
+static void own_stat(uint64_t seq, int *dead) {
+    OwnedStatsType *owned = (OwnedStatsType *)pthread_getspecific(stat_key);
+    if( !owned ) {
+        owned = new OwnedStatsType;
+        pthread_setspecific(stat_key, owned);
+    }
+    /* drop blocks of destroyed clusters, a long-lived thread may see many */
+    pthread_mutex_lock(&live_clusters_lock);
+    size_t n = 0;
+    for(size_t i = 0; i < owned->size(); i++) {
+        if( live_clusters->count((*owned)[i].first) ) {
+            (*owned)[n++] = (*owned)[i];
+        }
     }
+    pthread_mutex_unlock(&live_clusters_lock);
+    owned->resize(n);
+    owned->push_back(std::make_pair(seq, dead));
 }
 
-int Cluster::parse_startup(const char *startup) {
+/* phases of the current request, summed over its attempts, for the slow log */
+typedef struct {
+    uint64_t    connect_us;
+    uint64_t    queue_us;
+    uint64_t    rtt_us;
+    const Node *node;
+} PhaseType;
+static __thread PhaseType tls_phase;
+
+/**
+ * class LatencyHistogram
+ */
+uint64_t LatencyHistogram::count() const {
+    uint64_t total = 0;
+    for(int i = 0; i < BUCKETS; i++) {
+        total += __atomic_load_n(&counts_[i], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const {
+    uint64_t total = count();
+    if( total==0 ) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(p * total);
+    if( rank>=total ) {
+        rank = total - 1;
+    }
+    uint64_t seen = 0;
+    for(int i = 0; i < BUCKETS; i++) {
+        seen += __atomic_load_n(&counts_[i], __ATOMIC_RELAXED);
+        if( seen>rank ) {
+            return bucket_upper(i);
+        }
+    }
+    return bucket_upper(BUCKETS - 1);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other) {
+    for(int i = 0; i < BUCKETS; i++) {
+        counts_[i] += __atomic_load_n(&other.counts_[i], __ATOMIC_RELAXED);
+    }
+}
+
+void LatencyHistogram::reset() {
+    memset(counts_, 0, sizeof(counts_));
+}
+
+uint64_t LatencyHistogram::bucket_upper(int bucket) {
+    if( bucket<16 )
+        return bucket;
+    int e = (bucket - 16) / (1 << SUB_BUCKET_BITS) + 4;
+    int sub = (bucket - 16) % (1 << SUB_BUCKET_BITS);
+    return ((uint64_t)((1 << SUB_BUCKET_BITS) + sub + 1) << (e - SUB_BUCKET_BITS)) - 1;
+}
+
+/**
+ * class Node
+ */
+Node::Node(const std::string& host, unsigned int port, unsigned int timeout) {
+    host_ = host;
+    port_ = port;
+    timeout_ = timeout;
+    readonly_ = false;
+    id_ = NULL;
+    index_ = 0;
+    memset(&conn_options_, 0, sizeof(conn_options_));
+
+    max_inflight_ = 0;
+    max_waiting_ = 0;
+    inflight_ = 0;
+    waiting_ = 0;
+    overload_count_ = 0;
+    wait_count_ = 0;
+
+    conn_get_count_ = 0;
+    conn_reuse_count_ = 0;
+    conn_put_count_ = 0;
+
+    int ret = pthread_spin_init(&lock_,PTHREAD_PROCESS_PRIVATE);
+    rcassert(ret == 0);
+
+    ret = pthread_mutex_init(&limit_lock_, NULL);
+    rcassert(ret == 0);
+    ret = pthread_cond_init(&limit_cond_, NULL);
+    rcassert(ret == 0);
+}
+
+Node::~Node() {
+
+    std::list<void *>::iterator iter = connections_.begin();
+    for(; iter!=connections_.end(); iter++) {
+        redisContext *conn = (redisContext *)*iter;
+        redisFree( conn );
+    }
+
+    pthread_cond_destroy(&limit_cond_);
+    pthread_mutex_destroy(&limit_lock_);
+    delete id_;
+}
+
+static const std::string empty_id;
+
+const std::string &Node::id() const {
+    const std::string *id = __atomic_load_n(&id_, __ATOMIC_ACQUIRE);
+    return id? *id: empty_id;
+}
+
+void *Node::get_conn() {
+
+    redisContext *conn = NULL;
+    bool readonly = __atomic_load_n(&readonly_, __ATOMIC_ACQUIRE);
+    bool need_readonly = false;
+
+    {
+        LockGuard lg(lock_);
+        conn_get_count_++;
+        for(; connections_.size()>0;) {
+            conn = (redisContext *)connections_.back();
+            connections_.pop_back();
+
+            if( conn->err==REDIS_OK ) {
+                conn_reuse_count_++;
+                if( conn_options_.quickack ) {
+                    int on = 1;
+                    setsockopt(conn->fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+                }
+                /* pooled before the node was known as a replica */
+                need_readonly = readonly && ((size_t)conn->fd>=readonly_fds_.size() || !readonly_fds_[conn->fd]);
+                break;
+            }
+
+            redisFree( conn );
+            conn = NULL;
+        }
+
+    }
+    if( conn && need_readonly && !send_readonly(conn) ) {
+        redisFree( conn );
+        conn = NULL;
+    }
+    if( !conn ) {
+        uint64_t start = now_us();
+        if( !unix_socket_.empty() ) {
+            conn = (redisContext *)connect(true);
+        }
+        if( !conn ) {
+            conn = (redisContext *)connect(false);
+        }
+
+        if( conn ) {
+            /* the fd may be one of a closed connection, forget what was sent on it */
+            LockGuard lg(lock_);
+            if( readonly_fds_.size()<=(size_t)conn->fd ) {
+                readonly_fds_.resize(conn->fd + 1, 0);
+            }
+            readonly_fds_[conn->fd] = 0;
+        }
+        if( conn && readonly && !send_readonly(conn) ) {
+            redisFree( conn );
+            conn = NULL;
+        }
+        if( conn ) {
+            tls_connect_us = now_us() - start;
+        }
+    }
+    return conn;
+}
+
+bool Node::send_readonly(void *conn) {
+    redisContext *c = (redisContext *)conn;
+    redisReply *reply = (redisReply *)redisCommand(c, "READONLY");
+    if( !reply ) {
+        return false;
+    }
+    freeReplyObject( reply );
+    LockGuard lg(lock_);
+    if( readonly_fds_.size()<=(size_t)c->fd ) {
+        readonly_fds_.resize(c->fd + 1, 0);
+    }
+    readonly_fds_[c->fd] = 1;
+    return true;
+}
+
+void *Node::connect(bool unix_socket) {
+    redisContext *conn = NULL;
+    struct timeval tv;
+    tv.tv_sec = timeout_;
+    tv.tv_usec = 0;
+
+    if( unix_socket ) {
+        conn = timeout_>0? redisConnectUnixWithTimeout(unix_socket_.c_str(), tv): redisConnectUnix(unix_socket_.c_str());
+    } else if( conn_options_.rcvbuf>0 || conn_options_.sndbuf>0 || conn_options_.source_addr[0] ) {
+        int fd = open_socket();
+        if( fd>=0 ) {
+            conn = redisConnectFd(fd);
+        }
+    } else {
+        conn = timeout_>0? redisConnectWithTimeout(host_.c_str(), port_, tv): redisConnect(host_.c_str(), port_);
+    }
+
+    if( conn && conn->err!=REDIS_OK ) {
+        DEBUGINFO("connect " << (unix_socket? unix_socket_: simple_dump()) << " fail. " << conn->errstr);
+        redisFree( conn );
+        conn = NULL;
+    }
+    if( conn && timeout_>0 && redisSetTimeout(conn, tv)!=REDIS_OK ) {
+        redisFree( conn );
+        conn = NULL;
+    }
+    if( !conn ) {
+        if( unix_socket ) {
+            DEBUGINFO("connect " << unix_socket_ << " fail, fall back to tcp");
+        }
+        return NULL;
+    }
+
+    set_socket_options(conn->fd, !unix_socket);
+    if( conn_options_.reader_maxbuf>0 ) {
+        conn->reader->maxbuf = conn_options_.reader_maxbuf==(size_t)-1? 0: conn_options_.reader_maxbuf;
+    }
+    return conn;
+}
+
+/* a tcp socket with the options which must be set before connecting, connected within timeout_ */
+int Node::open_socket() {
+    struct addrinfo hints, *res;
+    char port[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port, sizeof(port), "%u", port_);
+    if( getaddrinfo(host_.c_str(), port, &hints, &res)!=0 ) {
+        return -1;
+    }
+
+    int fd = -1;
+    for(struct addrinfo *ai = res; ai && fd<0; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if( fd<0 ) {
+            continue;
+        }
+        if( conn_options_.rcvbuf>0 ) {
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &conn_options_.rcvbuf, sizeof(conn_options_.rcvbuf));
+        }
+        if( conn_options_.sndbuf>0 ) {
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &conn_options_.sndbuf, sizeof(conn_options_.sndbuf));
+        }
+
+        bool ok = true;
+        if( conn_options_.source_addr[0] ) {
+            struct sockaddr_storage src;
+            socklen_t src_len;
+            memset(&src, 0, sizeof(src));
+            if( ai->ai_family==AF_INET ) {
+                struct sockaddr_in *sin = (struct sockaddr_in *)&src;
+                sin->sin_family = AF_INET;
+                ok = inet_pton(AF_INET, conn_options_.source_addr, &sin->sin_addr)==1;
+                src_len = sizeof(*sin);
+            } else {
+                struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&src;
+                sin6->sin6_family = AF_INET6;
+                ok = inet_pton(AF_INET6, conn_options_.source_addr, &sin6->sin6_addr)==1;
+                src_len = sizeof(*sin6);
+            }
+            ok = ok && bind(fd, (struct sockaddr *)&src, src_len)==0;
+        }
+
+        /* connect without blocking longer than timeout_ */
+        int flags = fcntl(fd, F_GETFL);
+        if( ok && fcntl(fd, F_SETFL, flags | O_NONBLOCK)==0 ) {
+            if( ::connect(fd, ai->ai_addr, ai->ai_addrlen)!=0 ) {
+                struct pollfd pfd;
+                int err = 0;
+                socklen_t err_len = sizeof(err);
+                pfd.fd = fd;
+                pfd.events = POLLOUT;
+                pfd.revents = 0;
+                ok = errno==EINPROGRESS
+                     && poll(&pfd, 1, timeout_>0? (int)timeout_ * 1000: -1)==1
+                     && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len)==0 && err==0;
+            }
+            ok = fcntl(fd, F_SETFL, flags)==0 && ok;
+        } else {
+            ok = false;
+        }
+
+        if( !ok ) {
+            DEBUGINFO("connect " << simple_dump() << " fail. " << strerror(errno));
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/* options set once connected, failures are ignored (e.g. SO_BUSY_POLL may need CAP_NET_ADMIN) */
+void Node::set_socket_options(int fd, bool tcp) {
+    const ConnOptionsType &o = conn_options_;
+    int on = 1;
+
+    if( !tcp ) {
+        if( o.rcvbuf>0 )
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &o.rcvbuf, sizeof(o.rcvbuf));
+        if( o.sndbuf>0 )
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &o.sndbuf, sizeof(o.sndbuf));
+        return;
+    }
+
+    if( o.keepalive_s>0 ) {
+        int interval = o.keepalive_s/3>0? o.keepalive_s/3: 1;
+        int count = 3;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &o.keepalive_s, sizeof(o.keepalive_s));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+    }
+#ifdef SO_BUSY_POLL
+    if( o.busy_poll_us>0 && setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &o.busy_poll_us, sizeof(o.busy_poll_us))!=0 ) {
+        DEBUGINFO("set SO_BUSY_POLL fail. " << strerror(errno));
+    }
+#endif
+    int nodelay = o.delay? 0: 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    if( o.quickack ) {
+        setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+    }
+}
+
+void Node::put_conn(void *conn) {
+    LockGuard lg(lock_);
+    conn_put_count_++;
+    connections_.push_front( conn );
+}
+
+void Node::set_limits(unsigned int max_inflight, unsigned int max_waiting) {
+    pthread_mutex_lock(&limit_lock_);
+    max_inflight_ = max_inflight;
+    max_waiting_ = max_waiting;
+    pthread_cond_broadcast(&limit_cond_);
+    pthread_mutex_unlock(&limit_lock_);
+}
+
+int Node::acquire() {
+    if( __atomic_load_n(&max_inflight_, __ATOMIC_RELAXED)==0 ) {
+        return 0;
+    }
+
+    int ret = 1;
+    pthread_mutex_lock(&limit_lock_);
+    if( max_inflight_==0 ) {
+        ret = 0;
+    } else if( inflight_<max_inflight_ ) {
+        inflight_++;
+    } else if( waiting_>=max_waiting_ ) {
+        overload_count_++;
+        ret = -1;
+    } else {
+        struct timespec deadline;
+        if( timeout_>0 ) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += timeout_;
+        }
+
+        waiting_++;
+        wait_count_++;
+        while( max_inflight_>0 && inflight_>=max_inflight_ ) {
+            if( timeout_>0 ) {
+                if( pthread_cond_timedwait(&limit_cond_, &limit_lock_, &deadline)==ETIMEDOUT ) {
+                    break;
+                }
+            } else {
+                pthread_cond_wait(&limit_cond_, &limit_lock_);
+            }
+        }
+        waiting_--;
+
+        if( max_inflight_==0 ) {
+            ret = 0;
+        } else if( inflight_<max_inflight_ ) {
+            inflight_++;
+        } else {
+            overload_count_++;   // waited too long
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&limit_lock_);
+    return ret;
+}
+
+void Node::release() {
+    pthread_mutex_lock(&limit_lock_);
+    inflight_--;
+    if( waiting_>0 ) {
+        pthread_cond_signal(&limit_cond_);
+    }
+    pthread_mutex_unlock(&limit_lock_);
+}
+
+void Node::queue_stat(unsigned int &inflight, unsigned int &waiting, uint64_t &overload) {
+    pthread_mutex_lock(&limit_lock_);
+    inflight = inflight_;
+    waiting = waiting_;
+    overload = overload_count_;
+    pthread_mutex_unlock(&limit_lock_);
+}
+
+std::string Node::simple_dump() const {
+    std::ostringstream ss;
+    ss<<"Node{"<< host_ << ":" << port_<<"}";
+    return ss.str();
+}
+
+std::string Node::stat_dump() {
+    /* the queue first, limit_lock_ is a mutex and must not be taken under the spinlock */
+    unsigned int inflight, waiting, max_inflight, max_waiting;
+    uint64_t overload, waited;
+    pthread_mutex_lock(&limit_lock_);
+    inflight = inflight_;
+    waiting = waiting_;
+    max_inflight = max_inflight_;
+    max_waiting = max_waiting_;
+    overload = overload_count_;
+    waited = wait_count_;
+    pthread_mutex_unlock(&limit_lock_);
+
+    std::ostringstream ss;
+    LockGuard lg(lock_);
+    ss<<"Node{"<< host_ << ":" << port_ << " pool_size(free conn): "<<connections_.size()
+      <<" conn_create: "<< conn_get_count_ - conn_reuse_count_
+      <<" conn_get: "<< conn_get_count_
+      <<" conn_reuse: "<< conn_reuse_count_
+      <<" conn_put: "<< conn_put_count_;
+    if( max_inflight>0 ) {
+        ss<<" inflight: "<< inflight << "/" << max_inflight
+          <<" waiting: "<< waiting << "/" << max_waiting
+          <<" waited: "<< waited
+          <<" overload: "<< overload;
+    }
+    ss<<"}";
+    return ss.str();
+}
+
+/**
+ * class NodeRegistry
+ */
+static inline uint64_t addr_hash(const char *host, size_t host_len, unsigned int port) {
+    return fnv1a64(host, host_len) ^ ((uint64_t)port * 0x9E3779B97F4A7C15ULL);
+}
+
+NodeRegistry::NodeRegistry() {
+    snapshot_ = new SnapshotType;
+    rebuild_index(snapshot_);
+    batch_ = NULL;
+    batch_dirty_ = false;
+    int ret = pthread_spin_init(&lock_, PTHREAD_PROCESS_PRIVATE);
+    rcassert(ret == 0);
+}
+
+NodeRegistry::~NodeRegistry() {
+    for(size_t i = 0; i < snapshot_->nodes.size(); i++) {
+        delete snapshot_->nodes[i];
+    }
+    delete snapshot_;
+    for(size_t i = 0; i < retired_.size(); i++) {
+        delete retired_[i];
+    }
+    pthread_spin_destroy(&lock_);
+}
+
+Node *NodeRegistry::find(const char *host, size_t host_len, unsigned int port) const {
+    return lookup(load(), host, host_len, port);
+}
+
+Node *NodeRegistry::lookup(const SnapshotType *snap, const char *host, size_t host_len, unsigned int port) {
+    size_t mask = snap->by_addr.size() - 1;
+    for(size_t i = addr_hash(host, host_len, port) & mask; ; i = (i + 1) & mask) {
+        Node *node = snap->by_addr[i];
+        if( !node ) {
+            return NULL;
+        }
+        if( node->port_==port
+            && node->host_.length()==host_len
+            && !memcmp(node->host_.data(), host, host_len) ) {
+            return node;
+        }
+    }
+}
+
+Node *NodeRegistry::find_id(const char *id, size_t id_len) const {
+    const SnapshotType *snap = load();
+    size_t mask = snap->by_id.size() - 1;
+    for(size_t i = fnv1a64(id, id_len) & mask; ; i = (i + 1) & mask) {
+        Node *node = snap->by_id[i];
+        if( !node ) {
+            return NULL;
+        }
+        const std::string &node_id = node->id();
+        if( node_id.length()==id_len && !memcmp(node_id.data(), id, id_len) ) {
+            return node;
+        }
+    }
+}
+
+bool NodeRegistry::add(const char *host, size_t host_len, unsigned int port, unsigned int timeout, Node *&rpnode) {
+    if( in_batch() ) {
+        rpnode = lookup(batch_, host, host_len, port);
+        if( rpnode ) {
+            return false;
+        }
+        rpnode = new Node(std::string(host, host_len), port, timeout);
+        rcassert( rpnode );
+        insert(batch_, rpnode);
+        batch_dirty_ = true;
+        return true;
+    }
+
+    rpnode = find(host, host_len, port);
+    if( rpnode ) {
+        return false;
+    }
+
+    LockGuard lg(lock_);
+
+    rpnode = find(host, host_len, port);   // added by another thread meanwhile
+    if( rpnode ) {
+        return false;
+    }
+
+    rpnode = new Node(std::string(host, host_len), port, timeout);
+    rcassert( rpnode );
+
+    SnapshotType *snap = new SnapshotType(*load());
+    insert(snap, rpnode);
+    publish(snap);
+    return true;
+}
+
+void NodeRegistry::set_id(Node *node, const char *id, size_t id_len) {
+    if( id_len==0 || !node->id().empty() ) {
+        return;
+    }
+
+    if( in_batch() ) {
+        if( node->id_ ) {
+            return;
+        }
+        __atomic_store_n(&node->id_, new std::string(id, id_len), __ATOMIC_RELEASE);
+        index_id(batch_, node);
+        batch_dirty_ = true;
+        return;
+    }
+
+    LockGuard lg(lock_);
+
+    if( node->id_ ) {
+        return;
+    }
+    /* not visible through by_id before publish, readers of id() see the whole string */
+    __atomic_store_n(&node->id_, new std::string(id, id_len), __ATOMIC_RELEASE);
+
+    SnapshotType *snap = new SnapshotType(*load());
+    index_id(snap, node);
+    publish(snap);
+}
+
+void NodeRegistry::begin() {
+    pthread_spin_lock(&lock_);
+    batch_owner_ = pthread_self();
+    batch_dirty_ = false;
+    __atomic_store_n(&batch_, new SnapshotType(*load()), __ATOMIC_RELEASE);
+}
+
+void NodeRegistry::commit() {
+    rcassert( in_batch() );
+    SnapshotType *snap = batch_;
+    __atomic_store_n(&batch_, (SnapshotType *)NULL, __ATOMIC_RELAXED);
+    if( batch_dirty_ ) {
+        publish(snap);
+    } else {
+        delete snap;
+    }
+    pthread_spin_unlock(&lock_);
+}
+
+/* the batch of another thread is not ours, its writers wait on the lock */
+bool NodeRegistry::in_batch() const {
+    return __atomic_load_n(&batch_, __ATOMIC_ACQUIRE) && pthread_equal(batch_owner_, pthread_self());
+}
+
+size_t NodeRegistry::size() const {
+    return load()->nodes.size();
+}
+
+Node *NodeRegistry::random(const Node *exclude) const {
+    const SnapshotType *snap = load();
+    size_t len = snap->nodes.size();
+    if( len==0 ) {
+        return NULL;
+    }
+    size_t idx = now_us() % len;
+    if( snap->nodes[idx]==exclude ) {
+        if( len==1 ) {
+            return NULL;
+        }
+        idx = (idx + 1) % len;
+    }
+    return snap->nodes[idx];
+}
+
+void NodeRegistry::nodes(std::vector<Node *> &out) const {
+    out = load()->nodes;
+}
+
+void NodeRegistry::publish(SnapshotType *snapshot) {
+    retired_.push_back(snapshot_);     // readers may still be on it
+    __atomic_store_n(&snapshot_, snapshot, __ATOMIC_RELEASE);
+}
+
+/* add node, the index is rebuilt only when it grows past half full */
+void NodeRegistry::insert(SnapshotType *snapshot, Node *node) {
+    node->index_ = snapshot->nodes.size();
+    snapshot->nodes.push_back(node);
+    size_t cap = snapshot->by_addr.size();
+    if( snapshot->nodes.size() * 2>cap ) {
+        rebuild_index(snapshot);
+        return;
+    }
+    size_t i = addr_hash(node->host_.data(), node->host_.length(), node->port_) & (cap - 1);
+    while( snapshot->by_addr[i] ) {
+        i = (i + 1) & (cap - 1);
+    }
+    snapshot->by_addr[i] = node;
+    index_id(snapshot, node);
+}
+
+void NodeRegistry::index_id(SnapshotType *snapshot, Node *node) {
+    if( !node->id_ ) {
+        return;
+    }
+    size_t cap = snapshot->by_id.size();
+    size_t i = fnv1a64(node->id_->data(), node->id_->length()) & (cap - 1);
+    while( snapshot->by_id[i] ) {
+        if( snapshot->by_id[i]==node ) {
+            return;
+        }
+        i = (i + 1) & (cap - 1);
+    }
+    snapshot->by_id[i] = node;
+}
+
+void NodeRegistry::rebuild_index(SnapshotType *snapshot) {
+    size_t cap = 8;
+    while( cap<snapshot->nodes.size() * 2 ) {
+        cap <<= 1;
+    }
+    snapshot->by_addr.assign(cap, (Node *)NULL);
+    snapshot->by_id.assign(cap, (Node *)NULL);
+
+    for(size_t n = 0; n < snapshot->nodes.size(); n++) {
+        Node *node = snapshot->nodes[n];
+        size_t i = addr_hash(node->host_.data(), node->host_.length(), node->port_) & (cap - 1);
+        while( snapshot->by_addr[i] ) {
+            i = (i + 1) & (cap - 1);
+        }
+        snapshot->by_addr[i] = node;
+
+        if( node->id_ ) {
+            i = fnv1a64(node->id_->data(), node->id_->length()) & (cap - 1);
+            while( snapshot->by_id[i] ) {
+                i = (i + 1) & (cap - 1);
+            }
+            snapshot->by_id[i] = node;
+        }
+    }
+}
+
+/* topology file: a header, the nodes, then the owner (and replica) of every slot
+ * as indexes into the nodes, fixed sized and in host byte order so it can be mapped
+ */
+static const char TOPOLOGY_MAGIC[8] = {'R', 'C', 'T', 'O', 'P', 'O', 'L', 'O'};
+static const uint32_t TOPOLOGY_VERSION = 1;
+static const uint16_t TOPOLOGY_NONE = 0xffff;
+
+typedef struct {
+    char        magic[8];
+    uint32_t    version;
+    uint32_t    nodes;
+    uint64_t    saved_us;           // wall clock
+} TopologyHeaderType;
+
+typedef struct {
+    char        host[64];           // NUL terminated
+    char        id[48];             // NUL terminated, empty if not known
+    uint32_t    port;
+    uint32_t    readonly;
+} TopologyNodeType;
+
+typedef struct {
+    uint16_t    master;
+    uint16_t    replica;
+} TopologySlotType;
+
+/* shared slot map: the topology file tables in a shared memory segment,
+ * the node table is append only so an index keeps naming the same node
+ */
+static const char SHARED_MAGIC[8] = {'R', 'C', 'S', 'H', 'A', 'R', 'E', 'D'};
+static const uint32_t SHARED_VERSION = 2;
+static const uint32_t SHARED_NODES = 1024;
+static const uint64_t SHARED_RELOAD_LEASE_US = 1000000;
+static const int SHARED_READ_TRIES = 1000;          // of a reader racing writers, before giving up this time
+static const int SHARED_INIT_WAIT_MS = 1000;
+
+enum {
+    SHARED_NEW = 0,
+    SHARED_INITIALIZING = 1,
+    SHARED_READY = 2
+};
+
+typedef struct {
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        nodes;          // used entries of the node table
+    uint32_t        init;           // SHARED_*, the segment is stamped by the first one to open it
+    uint32_t        torn;           // a writer died mid-write, the map is not used until the next full publish
+    uint64_t        seq;            // odd while written
+    uint64_t        epoch;          // bumped by every change, 0 until a map is published
+    uint64_t        reload_us;      // monotonic time the last reload was claimed at
+    pthread_mutex_t lock;           // of the writers, process shared and robust
+} SharedHeaderType;
+
+struct Cluster::SharedTopologyType {
+    SharedHeaderType    header;
+    TopologyNodeType    nodes[SHARED_NODES];
+    TopologySlotType    slots[HASH_SLOTS];
+};
+
+/**
+ * A writer died holding the lock: its change may be half done, so the map is flagged
+ * torn (readers keep their own and reload) and the seqlock is made even again.
+ * Call with the lock held.
+ */
+static void shared_repair(SharedHeaderType *h) {
+    uint64_t seq = __atomic_load_n(&h->seq, __ATOMIC_RELAXED);
+    if( seq & 1 ) {
+        __atomic_store_n(&h->torn, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->reload_us, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->epoch, h->epoch + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&h->seq, seq + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/* the writers' mutex, then the seqlock made odd for the readers */
+static uint64_t shared_lock(SharedHeaderType *h) {
+    int ret = pthread_mutex_lock(&h->lock);
+    if( ret==EOWNERDEAD ) {
+        pthread_mutex_consistent(&h->lock);
+        shared_repair(h);
+    } else {
+        rcassert(ret == 0);
+    }
+    uint64_t locked = __atomic_load_n(&h->seq, __ATOMIC_RELAXED) + 1;
+    __atomic_store_n(&h->seq, locked, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return locked;
+}
+
+static void shared_unlock(SharedHeaderType *h, uint64_t locked) {
+    __atomic_store_n(&h->seq, locked + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&h->lock);
+}
+
+/* a reader gave up: repair after a dead writer, if that is why */
+static void shared_try_repair(SharedHeaderType *h) {
+    int ret = pthread_mutex_trylock(&h->lock);
+    if( ret==EOWNERDEAD ) {
+        pthread_mutex_consistent(&h->lock);
+    } else if( ret!=0 ) {
+        return;     // a live writer, just slow
+    }
+    shared_repair(h);
+    pthread_mutex_unlock(&h->lock);
+}
+
+/* index of node in the shared node table, appended if missing; call with the lock held */
+static uint16_t shared_node_index(TopologyNodeType *nodes, uint32_t *count, const Node *node) {
+    for(uint32_t i = 0; i < *count; i++) {
+        if( nodes[i].port==node->port() && node->host()==nodes[i].host ) {
+            return i;
+        }
+    }
+    if( *count>=SHARED_NODES ) {
+        return TOPOLOGY_NONE;
+    }
+    TopologyNodeType &tn = nodes[*count];
+    snprintf(tn.host, sizeof(tn.host), "%s", node->host().c_str());
+    snprintf(tn.id, sizeof(tn.id), "%s", node->id().c_str());
+    tn.port = node->port();
+    tn.readonly = 0;
+    __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+    return *count - 1;
+}
+
+/**
+ * class Cluster
+ */
+Cluster::Cluster(unsigned int timeout)
+    :node_max_inflight_(0),
+     node_max_waiting_(0),
+     hot_rate_(0),
+     compress_threshold_(0),
+     coalescing_(false),
+     io_backend_(IO_BLOCKING),
+     load_slots_asap_(false),
+     timeout_(timeout) {
+    for(int i = 0; i < FLIGHT_STRIPES; i++) {
+        int ret = pthread_mutex_init(&flight_stripes_[i].lock, NULL);
+        rcassert(ret == 0);
+    }
+    seq_ = __atomic_add_fetch(&cluster_seq, 1, __ATOMIC_RELAXED);
+    pthread_once(&stat_key_once, make_stat_key);
+    pthread_mutex_lock(&live_clusters_lock);
+    live_clusters->insert(seq_);
+    pthread_mutex_unlock(&live_clusters_lock);
+    thread_stats_ = NULL;
+    thread_seq_ = 0;
+    tracing_ = false;
+    memset(&trace_hooks_, 0, sizeof(trace_hooks_));
+    slow_threshold_us_ = 0;
+    slow_ring_ = NULL;
+    slow_capacity_ = 0;
+    slow_next_ = 0;
+    capture_fd_ = -1;
+    capture_writers_ = 0;
+    capture_size_ = 0;
+    validating_ = false;
+    shared_ = NULL;
+    shared_epoch_ = 0;
+    int ret = pthread_spin_init(&shared_adopt_lock_, PTHREAD_PROCESS_PRIVATE);
+    rcassert(ret == 0);
+    memset(&hedge_policy_, 0, sizeof(hedge_policy_));
+    memset(&conn_options_, 0, sizeof(conn_options_));
+    memset(&hedge_stat_, 0, sizeof(hedge_stat_));
+}
+
+Cluster::~Cluster() {
+
+    if( validating_ ) {
+        pthread_join(validate_tid_, NULL);
+    }
+    stop_capture();
+    pthread_mutex_lock(&live_clusters_lock);
+    live_clusters->erase(seq_);
+    pthread_mutex_unlock(&live_clusters_lock);
+
+    if( shared_ ) {
+        munmap(shared_, sizeof(SharedTopologyType));
+    }
+    pthread_spin_destroy(&shared_adopt_lock_);
+
+    for(int i = 0; i < FLIGHT_STRIPES; i++) {
+        pthread_mutex_destroy(&flight_stripes_[i].lock);
+    }
+
+    delete [] slow_ring_;
+
+    while( thread_stats_ ) {
+        ThreadStatType *ts = thread_stats_;
+        thread_stats_ = ts->next;
+        for(size_t j = 0; j < ts->nodes.size(); j++) {
+            delete ts->nodes[j];
+        }
+        std::map<std::string, LatencyHistogram *>::iterator iter = ts->commands.begin();
+        for(; iter != ts->commands.end(); iter++) {
+            delete iter->second;
+        }
+        if( ts->uring ) {
+            uring_destroy((UringType *)ts->uring);
+        }
+        delete ts->hot;
+        pthread_spin_destroy(&ts->lock);
+        delete ts;
+    }
+}
+
+int Cluster::setup(const char *startup, bool lazy) {
+
+    int ret = pthread_spin_init(&load_slots_lock_, PTHREAD_PROCESS_PRIVATE);
+    if(ret != 0) {
+        return -1;
+    }
+
+    if( parse_startup(startup)<0 ) {
+        return -1;
+    }
+
+    slots_.resize( HASH_SLOTS );
+    replica_slots_.resize( HASH_SLOTS );
+    for(size_t i = 0; i<slots_.size(); i++) {
+        slots_[i] = NULL;
+        replica_slots_[i] = NULL;
+    }
+
+    if( shared_ && __atomic_load_n(&shared_->header.epoch, __ATOMIC_ACQUIRE)>0 && adopt_shared_map() ) {
+        return 0;
+    }
+
+    if( !topology_file_.empty() && load_topology_file()>0 ) {
+        if( pthread_create(&validate_tid_, NULL, validate_topology, this)==0 ) {
+            validating_ = true;
+        } else {
+            set_load_slots_asap();
+        }
+        return 0;
+    }
+
+    if( !lazy && load_slots_cache()<0 ) {
+        return -1;
+    }
+
+    if( lazy ) {
+        set_load_slots_asap();
+    }
+
+    return 0;
+
+}
+
+void Cluster::set_topology_file(const std::string &path) {
+    topology_file_ = path;
+}
+
+void *Cluster::validate_topology(void *arg) {
+    Cluster *cluster = (Cluster *)arg;
+    if( cluster->load_slots_cache()<=0 ) {
+        cluster->set_load_slots_asap();
+    }
+    return NULL;
+}
+
+redisReply* Cluster::run(const std::vector<std::string> &commands) {
+    uint64_t start = now_us();
+    MetricsType &metrics = thread_stat()->metrics;
+    bump(metrics.requests);
+    memset(&tls_phase, 0, sizeof(tls_phase));
+    std::vector<const char *> argv;
+    std::vector<size_t> argvlen;
+
+    if( commands.size()<2 ) {
+        set_error(E_COMMANDS, "none-key commands are not supported");
+        bump(metrics.errors[E_COMMANDS]);
+        return NULL;
+    }
+
+    std::string cmd = to_upper(commands[0]);
+
+    do {
+        std::ostringstream ss;
+        ss << "#" << cmd << "#";
+        if( strstr(UNSUPPORT, ss.str().c_str()) ) {
+            set_error(E_COMMANDS, "command not supported", NULL, -1, 0, cmd.data(), cmd.length());
+            bump(metrics.errors[E_COMMANDS]);
+            return NULL;
+        }
+    } while(0);
+
+    for( size_t i=0; i<commands.size(); i++ ) {
+        argv.push_back(commands[i].c_str());
+        argvlen.push_back(commands[i].length());
+    }
+
+    std::vector<std::string> compressed;
+    if( compress_threshold_>0 ) {
+        std::map<std::string, CompressRuleType>::iterator iter = compress_rules_.find(cmd);
+        if( iter!=compress_rules_.end() ) {
+            compressed.resize(commands.size());
+            for( size_t i = iter->second.first; i<commands.size(); i += iter->second.second ) {
+                if( commands[i].length()>=compress_threshold_
+                    && compress_value(commands[i].data(), commands[i].length(), compressed[i]) ) {
+                    argv[i] = compressed[i].data();
+                    argvlen[i] = compressed[i].length();
+                }
+                if( iter->second.second==0 )
+                    break;
+            }
+        }
+    }
+
+    bool readonly = false;
+    if( hedge_policy_.enabled || coalescing_ ) {
+        std::string pattern = "#" + cmd + "#";
+        readonly = (strstr(READONLY_CMDS, pattern.c_str()) != NULL);
+    }
+
+    /* only read-only commands may go to a replica */
+    bool hedge = readonly && hedge_policy_.enabled;
+
+    redisReply *reply;
+    if( coalescing_ && readonly ) {
+        reply = coalesced_command_argv(commands[1], argv.size(), argv.data(), argvlen.data(), hedge);
+    } else {
+        reply = redis_command_argv(commands[1], argv.size(), argv.data(), argvlen.data(), hedge);
+    }
+
+    if( reply && compress_threshold_>0 && decompress_rules_.count(cmd) ) {
+        decompress_reply(reply);
+    }
+    uint64_t total = record_request(cmd, commands, start, !reply);
+    if( __builtin_expect(__atomic_load_n(&capture_fd_, __ATOMIC_RELAXED)>=0, 0) ) {
+        capture(commands, total, reply);
+    }
+    return reply;
+}
+
+bool Cluster::add_node(const std::string &host, int port, Node *&rpnode) {
+    return add_node(host.data(), host.length(), port, rpnode);
+}
+
+bool Cluster::add_node(const char *host, size_t host_len, int port, Node *&rpnode) {
+    if( !nodes_.add(host, host_len, port, timeout_, rpnode) ) {
+        return false;
+    }
+    rpnode->set_limits(node_max_inflight_, node_max_waiting_);
+    rpnode->set_conn_options(conn_options_);
+    apply_unix_socket(rpnode);
+    return true;
+}
+
+void Cluster::set_conn_options(const Node::ConnOptionsType &options) {
+    conn_options_ = options;
+
+    std::vector<Node *> nodes;
+    nodes_.nodes(nodes);
+    for(size_t i = 0; i < nodes.size(); i++) {
+        nodes[i]->set_conn_options(options);
+    }
+}
+
+void Cluster::add_unix_socket(const std::string &host, int port, const std::string &path) {
+    std::ostringstream ss;
+    ss << host << ":" << port;
+    unix_sockets_[ss.str()] = path;
+
+    Node *node = nodes_.find(host.data(), host.length(), port);
+    if( node ) {
+        apply_unix_socket(node);
+    }
+}
+
+int Cluster::set_local_unix_socket(const std::string &pattern) {
+    struct ifaddrs *ifas;
+    if( getifaddrs(&ifas)!=0 ) {
+        return -1;
+    }
+    local_addrs_.clear();
+    local_addrs_.insert("localhost");
+    for(struct ifaddrs *ifa = ifas; ifa; ifa = ifa->ifa_next) {
+        char addr[INET6_ADDRSTRLEN];
+        if( !ifa->ifa_addr ) {
+            continue;
+        }
+        if( ifa->ifa_addr->sa_family==AF_INET ) {
+            inet_ntop(AF_INET, &((struct sockaddr_in *)ifa->ifa_addr)->sin_addr, addr, sizeof(addr));
+        } else if( ifa->ifa_addr->sa_family==AF_INET6 ) {
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr, addr, sizeof(addr));
+        } else {
+            continue;
+        }
+        local_addrs_.insert(addr);
+    }
+    freeifaddrs(ifas);
+    local_unix_pattern_ = pattern;
+
+    std::vector<Node *> nodes;
+    nodes_.nodes(nodes);
+    for(size_t i = 0; i < nodes.size(); i++) {
+        apply_unix_socket(nodes[i]);
+    }
+    return 0;
+}
+
+void Cluster::apply_unix_socket(Node *node) {
+    std::ostringstream ss;
+    ss << node->host() << ":" << node->port();
+    std::map<std::string, std::string>::iterator iter = unix_sockets_.find(ss.str());
+    if( iter!=unix_sockets_.end() ) {
+        node->set_unix_socket(iter->second);
+        return;
+    }
+    if( local_unix_pattern_.empty() || !local_addrs_.count(node->host()) ) {
+        return;
+    }
+
+    std::ostringstream port;
+    port << node->port();
+    std::string path = local_unix_pattern_;
+    size_t pos;
+    while( (pos = path.find("%d"))!=std::string::npos ) {
+        path.replace(pos, 2, port.str());
+    }
+    node->set_unix_socket(path);
+}
+
+int Cluster::parse_startup(const char *startup) {
     char *p1, *p2, *p3;
     char *tmp = (char *)malloc( strlen(startup)+1 );
     memcpy(tmp, startup, strlen(startup)+1);
     int  port;
     std::string host;
 
-    p1 = p2 = tmp;
+    p1 = p2 = tmp;
+    do {
+        p2 = strchr(p1, ',');
+        if( p2 ) {
+            *p2 = '\0';
+        }
+        p3 = strchr(p1, ':');
+        if( p3 ) {
+
+            *p3 = '\0';
+            port = atoi(p3+1); //get port
+
+            while(p1<p3 && *p1==' ')//trim left
+                p1++;
+
+            p3--;
+            while(p3>p1 && *p3==' ')//trim right
+                *(p3--) = '\0';
+
+            host = p1;   //get host
+
+            Node *node_in_pool;
+            bool ret = add_node(host, port, node_in_pool);
+            if(ret) {
+                DEBUGINFO("parse startup add " << node_in_pool->simple_dump());
+            } else {
+                DEBUGINFO("parse startup duplicate " << node_in_pool->simple_dump() << " ignored");
+            }
+        }
+        if( p2 )
+            p1 = p2+1;
+        else
+            break;
+    } while(1);
+
+    free( tmp );
+    return nodes_.size();
+}
+
+int Cluster::load_slots_cache() {
+
+    int start, end;
+    int count = 0;
+    redisReply *reply, *subr, *innr;
+    Node *node;
+    std::vector<Node *> node_seeds;
+
+    if(pthread_spin_trylock(&load_slots_lock_) != 0) {
+        return 0;   // only one thread is allowed to process loading
+    }
+    bump(thread_stat()->metrics.reloads);
+    uint64_t load_start = now_us();
+
+    DEBUGINFO("load_slots_cache loading start...");
+
+    nodes_.nodes(node_seeds);
+
+    for(size_t node_idx = 0; node_idx < node_seeds.size(); node_idx++) {
+        node = node_seeds[node_idx];
+
+        redisContext *c = (redisContext *)node->get_conn();
+        if( !c ) {
+            continue;
+        }
+
+        reply = (redisReply *)redisCommand(c, "cluster slots");
+        if( !reply ) {
+            node->put_conn(c);
+            continue;
+        } else if( reply->type==REDIS_REPLY_ERROR ) {
+            freeReplyObject(reply);
+            node->put_conn(c);
+            continue;
+        }
+
+        nodes_.begin();
+        for(size_t i=0; i<reply->elements; i++) {
+
+            subr = reply->element[i];
+            if( subr->elements<3
+                || subr->element[0]->type!=REDIS_REPLY_INTEGER
+                || subr->element[1]->type!=REDIS_REPLY_INTEGER
+                || subr->element[2]->type!=REDIS_REPLY_ARRAY )
+                continue;
+
+            start = subr->element[0]->integer;
+            end = subr->element[1]->integer;
+            innr = subr->element[2];
+
+            if( innr->elements<2
+                || innr->element[0]->type!=REDIS_REPLY_STRING
+                || innr->element[1]->type!=REDIS_REPLY_INTEGER )
+                continue;
+
+            Node *node_in_pool;
+            bool ret = add_node(innr->element[0]->str, innr->element[0]->len, innr->element[1]->integer, node_in_pool);
+            if( innr->elements>2 && innr->element[2]->type==REDIS_REPLY_STRING ) {
+                nodes_.set_id(node_in_pool, innr->element[2]->str, innr->element[2]->len);
+            }
+            if(ret) {
+                DEBUGINFO("insert new node "<< node_in_pool->simple_dump()<< " from cluster slots map" );
+            }
+
+            /* pick one of the replicas for hedged reads, spread by slot range */
+            Node *replica = NULL;
+            size_t replicas = subr->elements - 3;
+            for(size_t k = 0; k < replicas && !replica; k++) {
+                redisReply *rr = subr->element[3 + (start + k) % replicas];
+                if( rr->type!=REDIS_REPLY_ARRAY
+                    || rr->elements<2
+                    || rr->element[0]->type!=REDIS_REPLY_STRING
+                    || rr->element[1]->type!=REDIS_REPLY_INTEGER )
+                    continue;
+                add_node(rr->element[0]->str, rr->element[0]->len, rr->element[1]->integer, replica);
+                if( rr->elements>2 && rr->element[2]->type==REDIS_REPLY_STRING ) {
+                    nodes_.set_id(replica, rr->element[2]->str, rr->element[2]->len);
+                }
+                replica->set_readonly(true);
+            }
+
+            for(int jj=start; jj<=end; jj++) {
+                slots_[jj] = node_in_pool;
+                replica_slots_[jj] = replica;
+            }
+
+            count += (end-start+1);
+        }//for i
+        nodes_.commit();
+
+        freeReplyObject(reply);
+        node->put_conn(c);
+        break;
+
+    }//for citer
+
+    if( count>0 )  {
+        DEBUGINFO("load_slots_cache count " << count <<"("<< (count == HASH_SLOTS? "complete":"incomplete!")<<") from " << node->simple_dump());
+    } else {
+        DEBUGINFO("load_slots_cache fail from all startup node");
+    }
+
+    DEBUGINFO("load_slots_cache loading finished");
+
+    if( count>0 && !topology_file_.empty() ) {
+        save_topology_file();
+    }
+    if( count>0 && shared_ ) {
+        publish_shared_map();
+    }
+
+    if( TRACING() ) {
+        trace(trace_hooks_.on_topology_reload, count>0? node: NULL, -1, NULL, 0,
+              0, load_start, now_us() - load_start, NULL, count);
+    }
+
+    pthread_spin_unlock(&load_slots_lock_);
+    return count;
+}
+
+int Cluster::clear_slots_cache() {
+    slots_.clear();
+    slots_.resize(HASH_SLOTS);
+    replica_slots_.clear();
+    replica_slots_.resize(HASH_SLOTS);
+    for(size_t i = 0; i<slots_.size(); i++) {
+        slots_[i] = NULL;
+        replica_slots_[i] = NULL;
+    }
+    return 0;
+}
+
+void Cluster::save_topology_file() {
+    std::vector<Node *> nodes;
+    nodes_.nodes(nodes);
+    if( nodes.size()>=TOPOLOGY_NONE ) {
+        return;
+    }
+
+    std::string buf(sizeof(TopologyHeaderType) + nodes.size() * sizeof(TopologyNodeType)
+                    + HASH_SLOTS * sizeof(TopologySlotType), '\0');
+
+    TopologyHeaderType *header = (TopologyHeaderType *)&buf[0];
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    memcpy(header->magic, TOPOLOGY_MAGIC, sizeof(header->magic));
+    header->version = TOPOLOGY_VERSION;
+    header->nodes = nodes.size();
+    header->saved_us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+
+    TopologyNodeType *tn = (TopologyNodeType *)(header + 1);
+    for(size_t i = 0; i < nodes.size(); i++) {
+        snprintf(tn[i].host, sizeof(tn[i].host), "%s", nodes[i]->host().c_str());
+        snprintf(tn[i].id, sizeof(tn[i].id), "%s", nodes[i]->id().c_str());
+        tn[i].port = nodes[i]->port();
+    }
+
+    /* nodes added since the copy above are left out */
+    TopologySlotType *ts = (TopologySlotType *)(tn + nodes.size());
+    for(int i = 0; i < HASH_SLOTS; i++) {
+        Node *master = slots_[i];
+        Node *replica = replica_slots_[i];
+        ts[i].master = master && master->index()<nodes.size()? master->index(): TOPOLOGY_NONE;
+        ts[i].replica = replica && replica->index()<nodes.size()? replica->index(): TOPOLOGY_NONE;
+        if( ts[i].replica!=TOPOLOGY_NONE ) {
+            tn[ts[i].replica].readonly = 1;
+        }
+    }
+
+    /* readers never see a partial file */
+    std::ostringstream tmp;
+    tmp << topology_file_ << ".tmp." << getpid();
+    int fd = open(tmp.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if( fd<0 ) {
+        DEBUGINFO("create topology file fail. " << strerror(errno));
+        return;
+    }
+    bool ok = write_all(fd, buf.data(), buf.length());
+    close(fd);
+    if( !ok || rename(tmp.str().c_str(), topology_file_.c_str())!=0 ) {
+        DEBUGINFO("save topology file fail. " << strerror(errno));
+        unlink(tmp.str().c_str());
+    }
+}
+
+int Cluster::load_topology_file() {
+    int fd = open(topology_file_.c_str(), O_RDONLY);
+    if( fd<0 ) {
+        return 0;
+    }
+    struct stat st;
+    if( fstat(fd, &st)!=0 || (size_t)st.st_size<sizeof(TopologyHeaderType) ) {
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if( map==MAP_FAILED ) {
+        return 0;
+    }
+
+    int count = 0;
+    const TopologyHeaderType *header = (const TopologyHeaderType *)map;
+    const TopologyNodeType *tn = (const TopologyNodeType *)(header + 1);
+    const TopologySlotType *ts = (const TopologySlotType *)(tn + header->nodes);
+
+    if( memcmp(header->magic, TOPOLOGY_MAGIC, sizeof(header->magic))
+        || header->version!=TOPOLOGY_VERSION
+        || header->nodes>=TOPOLOGY_NONE
+        || (size_t)st.st_size!=sizeof(TopologyHeaderType) + header->nodes * sizeof(TopologyNodeType)
+                               + HASH_SLOTS * sizeof(TopologySlotType) ) {
+        DEBUGINFO("topology file " << topology_file_ << " is invalid");
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    std::vector<Node *> nodes(header->nodes);
+    nodes_.begin();
+    for(size_t i = 0; i < nodes.size(); i++) {
+        add_node(tn[i].host, strnlen(tn[i].host, sizeof(tn[i].host)), tn[i].port, nodes[i]);
+        nodes_.set_id(nodes[i], tn[i].id, strnlen(tn[i].id, sizeof(tn[i].id)));
+        if( tn[i].readonly ) {
+            nodes[i]->set_readonly(true);
+        }
+    }
+    nodes_.commit();
+    for(int i = 0; i < HASH_SLOTS; i++) {
+        if( ts[i].master<nodes.size() ) {
+            slots_[i] = nodes[ts[i].master];
+            count++;
+        }
+        if( ts[i].replica<nodes.size() ) {
+            replica_slots_[i] = nodes[ts[i].replica];
+        }
+    }
+    munmap(map, st.st_size);
+
+    DEBUGINFO("load_topology_file count " << count << " from " << topology_file_);
+    return count;
+}
+
+int Cluster::set_shared_topology(const std::string &name) {
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT, 0644);
+    if( fd<0 ) {
+        return -1;
+    }
+    struct stat st;
+    if( fstat(fd, &st)!=0
+        || (st.st_size!=0 && (size_t)st.st_size!=sizeof(SharedTopologyType))
+        || ftruncate(fd, sizeof(SharedTopologyType))!=0 ) {
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, sizeof(SharedTopologyType), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if( map==MAP_FAILED ) {
+        return -1;
+    }
+
+    /* a new segment is all zero, the first one here stamps it and sets up the writers' lock */
+    SharedTopologyType *shared = (SharedTopologyType *)map;
+    SharedHeaderType *h = &shared->header;
+    uint32_t init = SHARED_NEW;
+    if( __atomic_compare_exchange_n(&h->init, &init, SHARED_INITIALIZING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE) ) {
+        memcpy(h->magic, SHARED_MAGIC, sizeof(h->magic));
+        h->version = SHARED_VERSION;
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&h->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        __atomic_store_n(&h->init, SHARED_READY, __ATOMIC_RELEASE);
+    }
+    for(int i = 0; i < SHARED_INIT_WAIT_MS && __atomic_load_n(&h->init, __ATOMIC_ACQUIRE)!=SHARED_READY; i++) {
+        usleep(1000);
+    }
+    bool ok = __atomic_load_n(&h->init, __ATOMIC_ACQUIRE)==SHARED_READY
+              && !memcmp(h->magic, SHARED_MAGIC, sizeof(h->magic))
+              && h->version==SHARED_VERSION;
+    if( !ok ) {
+        munmap(map, sizeof(SharedTopologyType));
+        return -1;
+    }
+    shared_ = shared;
+    return 0;
+}
+
+void Cluster::publish_shared_map() {
+    std::map<const Node *, uint16_t> index;
+    index[NULL] = TOPOLOGY_NONE;
+
+    uint64_t locked = shared_lock(&shared_->header);
+    uint64_t epoch = shared_->header.epoch;
+    for(int i = 0; i < HASH_SLOTS; i++) {
+        const Node *nodes[2] = {slots_[i], replica_slots_[i]};
+        uint16_t idx[2];
+        for(int j = 0; j < 2; j++) {
+            std::map<const Node *, uint16_t>::iterator iter = index.find(nodes[j]);
+            if( iter==index.end() ) {
+                iter = index.insert(std::make_pair(nodes[j],
+                                    shared_node_index(shared_->nodes, &shared_->header.nodes, nodes[j]))).first;
+            }
+            idx[j] = iter->second;
+        }
+        shared_->slots[i].master = idx[0];
+        shared_->slots[i].replica = idx[1];
+        if( idx[1]!=TOPOLOGY_NONE ) {
+            shared_->nodes[idx[1]].readonly = 1;
+        }
+    }
+    __atomic_store_n(&shared_->header.torn, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&shared_->header.epoch, epoch + 1, __ATOMIC_RELAXED);
+    shared_unlock(&shared_->header, locked);
+
+    /* adopt it once anyway, to learn the indexes of the nodes just appended */
+    __atomic_store_n(&shared_epoch_, 0, __ATOMIC_RELAXED);
+}
+
+void Cluster::publish_shared_slot(int slot, Node *node) {
+    uint64_t locked = shared_lock(&shared_->header);
+    uint16_t idx = shared_node_index(shared_->nodes, &shared_->header.nodes, node);
+    if( idx!=TOPOLOGY_NONE && shared_->slots[slot].master!=idx ) {
+        shared_->slots[slot].master = idx;
+        __atomic_store_n(&shared_->header.epoch, shared_->header.epoch + 1, __ATOMIC_RELAXED);
+    }
+    shared_unlock(&shared_->header, locked);
+}
+
+bool Cluster::adopt_shared_map() {
+    if( pthread_spin_trylock(&shared_adopt_lock_)!=0 ) {
+        return false;   // another thread is adopting it
+    }
+
+    std::vector<TopologyNodeType> nodes;
+    std::vector<TopologySlotType> slots(HASH_SLOTS);
+    uint64_t epoch;
+    bool torn;
+    for(int tries = 0;; tries++) {
+        if( tries==SHARED_READ_TRIES ) {
+            /* keep the local map this time, the next request tries again */
+            shared_try_repair(&shared_->header);
+            pthread_spin_unlock(&shared_adopt_lock_);
+            return false;
+        }
+        uint64_t seq = __atomic_load_n(&shared_->header.seq, __ATOMIC_ACQUIRE);
+        if( seq & 1 ) {
+            sched_yield();
+            continue;
+        }
+        uint32_t count = __atomic_load_n(&shared_->header.nodes, __ATOMIC_RELAXED);
+        if( count>SHARED_NODES ) {
+            count = SHARED_NODES;
+        }
+        epoch = __atomic_load_n(&shared_->header.epoch, __ATOMIC_RELAXED);
+        torn = __atomic_load_n(&shared_->header.torn, __ATOMIC_RELAXED);
+        nodes.assign(shared_->nodes + (count>shared_nodes_.size()? shared_nodes_.size(): count), shared_->nodes + count);
+        memcpy(&slots[0], shared_->slots, sizeof(shared_->slots));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if( __atomic_load_n(&shared_->header.seq, __ATOMIC_RELAXED)==seq ) {
+            break;
+        }
+    }
+
+    if( torn ) {
+        /* one process reloads and publishes a whole map again, the others wait for it */
+        __atomic_store_n(&shared_epoch_, epoch, __ATOMIC_RELAXED);
+        set_load_slots_asap();
+        pthread_spin_unlock(&shared_adopt_lock_);
+        DEBUGINFO("shared slot map epoch " << epoch << " is torn");
+        return false;
+    }
+
+    nodes_.begin();
+    for(size_t i = 0; i < nodes.size(); i++) {
+        Node *node;
+        add_node(nodes[i].host, strnlen(nodes[i].host, sizeof(nodes[i].host)), nodes[i].port, node);
+        nodes_.set_id(node, nodes[i].id, strnlen(nodes[i].id, sizeof(nodes[i].id)));
+        shared_nodes_.push_back(node);
+    }
+    nodes_.commit();
+    for(int i = 0; i < HASH_SLOTS; i++) {
+        if( slots[i].master<shared_nodes_.size() ) {
+            slots_[i] = shared_nodes_[slots[i].master];
+        }
+        if( slots[i].replica<shared_nodes_.size() ) {
+            replica_slots_[i] = shared_nodes_[slots[i].replica];
+            replica_slots_[i]->set_readonly(true);
+        }
+    }
+    __atomic_store_n(&shared_epoch_, epoch, __ATOMIC_RELAXED);
+    DEBUGINFO("adopt shared slot map epoch " << epoch);
+
+    pthread_spin_unlock(&shared_adopt_lock_);
+    return true;
+}
+
+bool Cluster::claim_shared_reload() {
+    uint64_t now = now_us();
+    uint64_t last = __atomic_load_n(&shared_->header.reload_us, __ATOMIC_RELAXED);
+    if( last!=0 && now - last<SHARED_RELOAD_LEASE_US ) {
+        return false;   // another process reloaded just now, its map is adopted instead
+    }
+    return __atomic_compare_exchange_n(&shared_->header.reload_us, &last, now, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+Node *Cluster::get_random_node(const Node *last) {
+    Node *node = nodes_.random(last);
+    if( node ) {
+        DEBUGINFO("get_random_node try "<<node->simple_dump());
+    }
+    return node;
+}
+
+uint16_t Cluster::get_key_hash(const std::string &key) {
+    std::string::size_type pos1, pos2;
+    std::string hashing_key = key;
+
+    pos1 = key.find("{");
+    if( pos1!=std::string::npos ) {
+        pos2 = key.find("}", pos1+1);
+        if((pos2!=std::string::npos) && (pos2 != pos1+1)) {
+            hashing_key = key.substr(pos1+1, (pos2-pos1)-1);
+        }
+    }
+    return crc16(hashing_key.c_str(), hashing_key.length());
+}
+
+redisReply* Cluster::redis_command_argv(const std::string& key, int argc, const char **argv, const size_t *argvlen,
+                                        bool hedge) {
+
+#define MAX_TTL 5
+
+    int ttl = MAX_TTL;
+    Node *node = NULL;
+    redisContext *c = NULL;
+    redisReply *reply = NULL;
+    bool try_random_node = false;
+    Node *ask_node = NULL;      // ASK target, for the next attempt only
+    MetricsType &metrics = thread_stat()->metrics;
+
+    tls_error.err = E_OK;
+
+    if( take_load_slots_asap() ) {
+        if( !shared_ || claim_shared_reload() ) {
+            load_slots_cache();
+        }
+    }
+    if( shared_ && __atomic_load_n(&shared_->header.epoch, __ATOMIC_ACQUIRE)!=__atomic_load_n(&shared_epoch_, __ATOMIC_RELAXED) ) {
+        adopt_shared_map();
+    }
+
+    uint16_t hashing = get_key_hash(key);
+    const int slot = hashing % HASH_SLOTS;
+
+    unsigned int hot_rate = __atomic_load_n(&hot_rate_, __ATOMIC_RELAXED);
+    if( hot_rate>0 && (++tls_hot_tick % hot_rate)==0 ) {
+        sample_hot(key, slot);
+    }
+
+    while( ttl>0 ) {
+        ttl--;
+        tls_error.ttls = (MAX_TTL - ttl);
+        bump(metrics.attempts);
+        DEBUGINFO("ttl " << ttl);
+
+        bool asking = false;
+        if( ask_node ) {
+
+            node = ask_node;
+            ask_node = NULL;
+            asking = true;
+            DEBUGINFO("slot " << slot << " asking " << node->simple_dump());
+        } else if( try_random_node ) {
+
+            try_random_node = false;
+            DEBUGINFO("try random node");
+            node = get_random_node(node);
+            if( !node ) {
+                set_error(E_IO, "try random node: no avaliable node", NULL, slot);
+                return NULL;
+            }
+            DEBUGINFO("slot " << slot << " use random " << node->simple_dump());
+        } else {//find slot
+
+            node = slots_[slot];
+            if( !node ) { //not hit
+                DEBUGINFO("slot "<<slot<<" don't have node, try connection from random node.");
+                try_random_node = true;//try random next ttl
+                continue;
+            }
+            DEBUGINFO("slot " << slot << " hit at " << node->simple_dump());
+        }
+
+        uint64_t queue_start = now_us();
+        int limited = node->acquire();
+        uint64_t queue_us = limited ? now_us() - queue_start : NO_SAMPLE;
+        if( limited<0 ) {
+            DEBUGINFO("node overload " << node->simple_dump());
+            record_node_latency(node, NO_SAMPLE, queue_us, NO_SAMPLE);
+            set_error(E_OVERLOAD, "node overload", node, slot);
+            return NULL;
+        }
+
+        tls_connect_us = NO_SAMPLE;
+        c = (redisContext*)node->get_conn();
+        if( !c ) {
+            DEBUGINFO("get connection fail from " << node->simple_dump());
+            bump(metrics.connect_errors);
+            if( limited ) {
+                node->release();
+            }
+            try_random_node = true;//try random next ttl
+            continue;
+        }
+
+        if( tls_connect_us!=NO_SAMPLE ) {
+            bump(metrics.connections);
+            if( TRACING() ) {
+                uint64_t now = now_us();
+                trace(trace_hooks_.on_reconnect, node, slot, argv[0], argvlen[0],
+                      MAX_TTL - ttl, now - tls_connect_us, tls_connect_us, NULL);
+            }
+        }
+        bump(metrics.bytes_out, request_size(argc, argvlen));
+
+        if( TRACING() ) {
+            trace(trace_hooks_.before_send, node, slot, argv[0], argvlen[0], MAX_TTL - ttl, now_us(), 0, NULL);
+        }
+
+        uint64_t rtt_start = now_us();
+        if( !asking && hedge && replica_slots_[slot] && replica_slots_[slot]!=node ) {
+            void *conn = c;
+            reply = hedged_command_argv(slot, node, conn, argc, argv, argvlen);
+            c = (redisContext *)conn;   // NULL if the replica won
+        } else {
+            reply = command_argv(c, asking, argc, argv, argvlen);
+        }
+        uint64_t rtt = now_us() - rtt_start;
+        record_node_latency(node, tls_connect_us, queue_us, rtt);
+        if( reply ) {
+            bump(metrics.bytes_in, reply_size(reply));
+        }
+        if( TRACING() ) {
+            trace(trace_hooks_.after_reply, node, slot, argv[0], argvlen[0], MAX_TTL - ttl, rtt_start, rtt, reply,
+                  0, reply? E_OK: E_IO);
+        }
+        if( !reply ) {//next ttl
+
+            DEBUGINFO("redisCommandArgv error. " << c->errstr << "(" << c->err << ")");
+            set_error(E_IO, "redisCommandArgv error", node, slot, c->err, c->errstr);
+            node->put_conn(c);
+            if( limited ) {
+                node->release();
+            }
+            try_random_node = true;//try random next ttl
+            continue;
+
+        } else if( reply->type==REDIS_REPLY_ERROR
+                   &&(!strncmp(reply->str,"MOVED ",6) || !strncmp(reply->str,"ASK ",4)) ) { //next ttl
+
+            bool ask = (reply->str[0]=='A');
+            bump(ask? metrics.ask: metrics.moved);
+
+            char *p = reply->str, *s;
+            /*
+                     * [S] for pointer 's'
+                     * [P] for pointer 'p'
+                     */
+            s = strchr(p,' ');      /* MOVED[S]3999 127.0.0.1:6381 */
+            p = strchr(s+1,' ');    /* MOVED[S]3999[P]127.0.0.1:6381 */
+            *p = '\0';
+
+            rcassert( slot == atoi(s+1) );
+
+            s = strchr(p+1,':');    /* MOVED 3999[P]127.0.0.1[S]6381 */
+            *s = '\0';
+
+            Node *node_in_pool;
+            bool ret = add_node(p+1, s-(p+1), atoi(s+1), node_in_pool);
+            if(ret) {
+                DEBUGINFO("insert new node "<< node_in_pool->simple_dump()<< " from redirection" );
+            } else {
+                DEBUGINFO("redirect slot "<< slot <<" to " << node_in_pool->simple_dump());
+            }
+
+            if( TRACING() ) {
+                trace(trace_hooks_.on_redirect, node_in_pool, slot, argv[0], argvlen[0], MAX_TTL - ttl, now_us(), 0, NULL);
+            }
+
+            if( ask ) {
+                ask_node = node_in_pool;   // slot is migrating, the owner doesn't change yet
+            } else {
+                set_slot_owner(slot, node_in_pool);
+            }
+            freeReplyObject( reply );
+            if( c ) {
+                node->put_conn(c);
+            }
+            if( limited ) {
+                node->release();
+            }
+            continue;
+
+        }
+        if( c ) {
+            node->put_conn(c);
+        }
+        if( limited ) {
+            node->release();
+        }
+        return reply;
+    }
+
+    set_error(E_TTL, "max ttl fail", node, slot);
+    return NULL;
+
+#undef MAX_TTL
+}
+
+redisReply* Cluster::command_argv(void *conn, bool asking, int argc, const char **argv, const size_t *argvlen) {
+    redisContext *c = (redisContext *)conn;
+    UringType *uring = NULL;
+    if( io_backend_==IO_URING ) {
+        ThreadStatType *ts = thread_stat();
+        if( !ts->uring && !ts->uring_failed ) {
+            ts->uring = uring_create();
+            ts->uring_failed = !ts->uring;
+        }
+        uring = (UringType *)ts->uring;
+    }
+
+    if( !uring ) {
+        if( !asking ) {
+            return (redisReply *)redisCommandArgv(c, argc, argv, argvlen);
+        }
+        /* ASKING is valid for the very next command on the connection only */
+        redisAppendFormattedCommand(c, ASKING_CMD, sizeof(ASKING_CMD) - 1);
+        redisAppendCommandArgv(c, argc, argv, argvlen);
+        void *r = NULL;
+        if( redisGetReply(c, &r)==REDIS_OK ) {
+            freeReplyObject(r);
+            r = NULL;
+            redisGetReply(c, &r);
+        }
+        return (redisReply *)r;
+    }
+
+    char *cmd = NULL;
+    int len = redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+    if( len<0 ) {
+        set_context_error(c, REDIS_ERR_OOM, "Out of memory");
+        return NULL;
+    }
+    void *reply = NULL;
+    if( asking ) {
+        std::string out(ASKING_CMD, sizeof(ASKING_CMD) - 1);
+        out.append(cmd, len);
+        uring_exchange(uring, c, out.data(), out.length(), 2, timeout_, &reply);
+    } else {
+        uring_exchange(uring, c, cmd, len, 1, timeout_, &reply);
+    }
+    free(cmd);
+    return (redisReply *)reply;
+}
+
+typedef struct {
+    const std::string      *key;
+    bool                    decompress;
+    Cluster::GetIntoType   *value;
+    std::string             error;      // error reply
+} GetIntoArgType;
+
+/* the GETs of the pipelined get_into() sent to one node */
+typedef struct {
+    Node                   *node;
+    redisContext           *conn;
+    int                     limited;
+    uint64_t                queue_us;
+    uint64_t                connect_us;
+    uint64_t                start;
+    std::vector<size_t>    *idx;        // into keys
+} GetIntoBatchType;
+
+static int get_into_exchange(void *conn, bool asking, std::string &redirect, void *arg) {
+    redisContext *c = (redisContext *)conn;
+    GetIntoArgType *a = (GetIntoArgType *)arg;
+
+    std::string out;
+    if( asking ) {
+        out.assign(ASKING_CMD, sizeof(ASKING_CMD) - 1);
+    }
+    append_get(out, *a->key);
+    if( !write_all(c->fd, out.data(), out.length()) ) {
+        set_context_error(c, REDIS_ERR_IO, strerror(errno));
+        return RAW_IO_ERROR;
+    }
+
+    RawReaderType r;
+    raw_init(r, c->fd);
+    if( asking && !raw_line(r, redirect) ) {
+        raw_io_error(c, r);
+        return RAW_IO_ERROR;
+    }
+    int ret = raw_get_reply(c, r, a->decompress, *a->value, redirect);
+    if( ret==RAW_DONE && a->value->ret==-1 ) {
+        a->error = redirect;
+    }
+    return ret;
+}
+
+int Cluster::get_into(const std::string &key, char *buf, size_t cap, size_t &len) {
+    uint64_t start = now_us();
+    MetricsType &metrics = thread_stat()->metrics;
+    bump(metrics.requests);
+    memset(&tls_phase, 0, sizeof(tls_phase));
+
+    GetIntoType value;
+    value.buf = buf;
+    value.cap = cap;
+    value.len = 0;
+    value.ret = -1;
+    GetIntoArgType arg;
+    arg.key = &key;
+    arg.decompress = compress_threshold_>0 && decompress_rules_.count("GET")>0;
+    arg.value = &value;
+
+    int ret = raw_command(key, "GET", get_into_exchange, &arg);
+    std::vector<std::string> commands;
+    if( slow_threshold_us_>0 ) {
+        commands.push_back("GET");
+        commands.push_back(key);
+    }
+    record_request("GET", commands, start, ret<0);
+    if( ret<0 ) {
+        return -1;
+    }
+    if( value.ret==-1 ) {
+        set_error(E_OTHERS, "error reply", NULL, -1, 0, arg.error.data(), arg.error.length());
+    }
+    len = value.len;
+    return value.ret;
+}
+
+int Cluster::get_into(const std::vector<std::string> &keys, std::vector<GetIntoType> &values) {
+    uint64_t start = now_us();
+    MetricsType &metrics = thread_stat()->metrics;
+    bump(metrics.requests);
+    memset(&tls_phase, 0, sizeof(tls_phase));
+    tls_error.err = E_OK;
+
+    if( keys.size()!=values.size() ) {
+        set_error(E_COMMANDS, "keys and values differ in size");
+        bump(metrics.errors[E_COMMANDS]);
+        return keys.size();
+    }
+    if( take_load_slots_asap() ) {
+        if( !shared_ || claim_shared_reload() ) {
+            load_slots_cache();
+        }
+    }
+    if( shared_ && __atomic_load_n(&shared_->header.epoch, __ATOMIC_ACQUIRE)!=__atomic_load_n(&shared_epoch_, __ATOMIC_RELAXED) ) {
+        adopt_shared_map();
+    }
+
+    bool decompress = compress_threshold_>0 && decompress_rules_.count("GET")>0;
+    /* the error of the first key that failed for good, raw_command() resets tls_error */
+    ErrorStateType first;
+    first.err = E_OK;
+
+    /* keys by owner, the ones of unknown slots go one by one */
+
+    std::map<Node *, std::vector<size_t> > groups;
+    std::vector<size_t> single;
+    for(size_t i = 0; i < keys.size(); i++) {
+        values[i].len = 0;
+        values[i].ret = -1;
+        Node *node = slots_[get_key_hash(keys[i]) % HASH_SLOTS];
+        if( node ) {
+            groups[node].push_back(i);
+        } else {
+            single.push_back(i);
+        }
+    }
+
+    /* send the GETs of every node first, then read the replies node after node */
+
+    std::vector<GetIntoBatchType> batches;
+    std::map<Node *, std::vector<size_t> >::iterator iter = groups.begin();
+    for(; iter!=groups.end(); iter++) {
+        GetIntoBatchType batch;
+        batch.node = iter->first;
+        batch.idx = &iter->second;
+        uint64_t queue_start = now_us();
+        batch.limited = batch.node->acquire();
+        batch.queue_us = batch.limited? now_us() - queue_start: NO_SAMPLE;
+        tls_connect_us = NO_SAMPLE;
+        batch.conn = batch.limited<0? NULL: (redisContext *)batch.node->get_conn();
+        if( !batch.conn ) {
+            if( batch.limited>0 ) {
+                batch.node->release();
+            }
+            single.insert(single.end(), iter->second.begin(), iter->second.end());
+            continue;
+        }
+        batch.connect_us = tls_connect_us;
+        if( tls_connect_us!=NO_SAMPLE ) {
+            bump(metrics.connections);
+            if( TRACING() ) {
+                trace(trace_hooks_.on_reconnect, batch.node, -1, "GET", 3, 1, now_us() - tls_connect_us, tls_connect_us, NULL);
+            }
+        }
+
+        std::string out;
+        for(size_t j = 0; j < iter->second.size(); j++) {
+            append_get(out, keys[iter->second[j]]);
+        }
+        bump(metrics.bytes_out, out.length());
+        if( TRACING() ) {
+            trace(trace_hooks_.before_send, batch.node, -1, "GET", 3, 1, now_us(), 0, NULL);
+        }
+        batch.start = now_us();
+        if( !write_all(batch.conn->fd, out.data(), out.length()) ) {
+            set_context_error(batch.conn, REDIS_ERR_IO, strerror(errno));
+        }
+        batches.push_back(batch);
+    }
+
+    for(size_t b = 0; b < batches.size(); b++) {
+        GetIntoBatchType &batch = batches[b];
+        std::vector<size_t> &idx = *batch.idx;
+        RawReaderType r;
+        raw_init(r, batch.conn->fd);
+        std::string line;
+        size_t j = 0;
+        for(; j < idx.size() && !batch.conn->err; j++) {
+            int ret = raw_get_reply(batch.conn, r, decompress, values[idx[j]], line);
+            if( ret==RAW_IO_ERROR ) {
+                break;
+            }
+            bool ask;
+            Node *target;
+            if( ret==RAW_REDIRECT ) {
+                if( !follow_redirect(line, ask, target) ) {
+                    set_error(E_OTHERS, "bad redirection", batch.node, -1, 0, line.data(), line.length());
+                    if( first.err==E_OK ) {
+                        first = tls_error;
+                    }
+                    continue;
+                }
+                if( TRACING() ) {
+                    trace(trace_hooks_.on_redirect, target, get_key_hash(keys[idx[j]]) % HASH_SLOTS, "GET", 3, 1,
+                          now_us(), 0, NULL);
+                }
+                single.push_back(idx[j]);
+            } else if( values[idx[j]].ret==-1 ) {
+                set_error(E_OTHERS, "error reply", batch.node, -1, 0, line.data(), line.length());
+                if( first.err==E_OK ) {
+                    first = tls_error;
+                }
+            }
+        }
+        if( batch.conn->err ) {
+            /* the rest of the batch is lost with the connection */
+            set_error(E_IO, "get_into error", batch.node, -1, batch.conn->err, batch.conn->errstr);
+            single.insert(single.end(), idx.begin() + j, idx.end());
+        }
+        bump(metrics.bytes_in, r.bytes);
+        uint64_t rtt = now_us() - batch.start;
+        record_node_latency(batch.node, batch.connect_us, batch.queue_us, rtt);
+        if( TRACING() ) {
+            trace(trace_hooks_.after_reply, batch.node, -1, "GET", 3, 1, batch.start, rtt, NULL,
+                  0, batch.conn->err? E_IO: E_OK);
+        }
+        batch.node->put_conn(batch.conn);
+        if( batch.limited>0 ) {
+            batch.node->release();
+        }
+    }
+
+    for(size_t i = 0; i < single.size(); i++) {
+        GetIntoArgType arg;
+        arg.key = &keys[single[i]];
+        arg.decompress = decompress;
+        arg.value = &values[single[i]];
+        values[single[i]].ret = -1;
+        int ret = raw_command(keys[single[i]], "GET", get_into_exchange, &arg);
+        if( ret==0 && values[single[i]].ret==-1 ) {
+            set_error(E_OTHERS, "error reply", NULL, -1, 0, arg.error.data(), arg.error.length());
+        }
+        if( values[single[i]].ret==-1 && first.err==E_OK ) {
+            first = tls_error;
+        }
+    }
+
+    int failed = 0;
+    for(size_t i = 0; i < values.size(); i++) {
+        if( values[i].ret==-1 ) {
+            failed++;
+        }
+    }
+    std::vector<std::string> commands;
+    if( slow_threshold_us_>0 ) {
+        commands.push_back("GET");
+        commands.insert(commands.end(), keys.begin(), keys.end());
+    }
+    /* the keys of a lost connection that were retried fine don't count */
+    if( first.err!=E_OK ) {
+        tls_error = first;
+    } else {
+        tls_error.err = E_OK;
+    }
+    record_request("GET", commands, start, failed>0);
+    return failed;
+}
+
+/* the command of a streaming call up to the header of its last, streamed, argument */
+static std::string stream_prefix(const std::vector<std::string> &commands, bool value, size_t len) {
+    std::string out;
+    append_bulk_header(out, '*', commands.size() + (value? 1: 0));
+    for(size_t i = 0; i < commands.size(); i++) {
+        append_bulk_header(out, '$', commands[i].length());
+        out.append(commands[i]);
+        out.append("\r\n", 2);
+    }
+    if( value ) {
+        append_bulk_header(out, '$', len);
+    }
+    return out;
+}
+
+typedef struct {
+    const std::vector<std::string> *commands;
+    size_t                          len;
+    Cluster::ChunkSource            source;
+    Cluster::ChunkSink              sink;
+    void                           *arg;
+    std::vector<char>               chunk;
+    int                             ret;        // of read_stream()
+    std::string                     error;      // error reply
+} StreamArgType;
+
+static int write_stream_exchange(void *conn, bool asking, std::string &redirect, void *arg) {
+    redisContext *c = (redisContext *)conn;
+    StreamArgType *a = (StreamArgType *)arg;
+
+    std::string head;
+    if( asking ) {
+        head.assign(ASKING_CMD, sizeof(ASKING_CMD) - 1);
+    }
+    head.append(stream_prefix(*a->commands, true, a->len));
+    if( !write_all(c->fd, head.data(), head.length()) ) {
+        set_context_error(c, REDIS_ERR_IO, strerror(errno));
+        return RAW_IO_ERROR;
+    }
+
+    for(size_t offset = 0; offset < a->len; ) {
+        ssize_t n = a->source(&a->chunk[0], std::min(a->chunk.size(), a->len - offset), offset, a->arg);
+        if( n<=0 ) {
+            /* half a request is on the wire, the connection can't be used any more */
+            set_context_error(c, REDIS_ERR_OTHER, "value source aborted");
+            return RAW_ABORT;
+        }
+        if( !write_all(c->fd, &a->chunk[0], n) ) {
+            set_context_error(c, REDIS_ERR_IO, strerror(errno));
+            return RAW_IO_ERROR;
+        }
+        offset += n;
+    }
+    if( !write_all(c->fd, "\r\n", 2) ) {
+        set_context_error(c, REDIS_ERR_IO, strerror(errno));
+        return RAW_IO_ERROR;
+    }
+
+    RawReaderType r;
+    raw_init(r, c->fd);
+    bool error;
+    if( asking && !raw_line(r, redirect) ) {
+        raw_io_error(c, r);
+        return RAW_IO_ERROR;
+    }
+    int ret = raw_reply_line(c, r, redirect, error);
+    if( ret!=RAW_DONE ) {
+        return ret;
+    }
+    if( error ) {
+        a->error = redirect;
+        a->ret = -1;
+    } else if( redirect[0]=='+' || redirect[0]==':' ) {
+        a->ret = 0;
+    } else {
+        set_context_error(c, REDIS_ERR_PROTOCOL, "status or integer reply expected");
+        return RAW_ABORT;
+    }
+    return RAW_DONE;
+}
+
+static int read_stream_exchange(void *conn, bool asking, std::string &redirect, void *arg) {
+    redisContext *c = (redisContext *)conn;
+    StreamArgType *a = (StreamArgType *)arg;
+
+    std::string out;
+    if( asking ) {
+        out.assign(ASKING_CMD, sizeof(ASKING_CMD) - 1);
+    }
+    out.append(stream_prefix(*a->commands, false, 0));
+    if( !write_all(c->fd, out.data(), out.length()) ) {
+        set_context_error(c, REDIS_ERR_IO, strerror(errno));
+        return RAW_IO_ERROR;
+    }
+
+    RawReaderType r;
+    raw_init(r, c->fd);
+    bool error;
+    if( asking && !raw_line(r, redirect) ) {
+        raw_io_error(c, r);
+        return RAW_IO_ERROR;
+    }
+    int ret = raw_reply_line(c, r, redirect, error);
+    if( ret!=RAW_DONE ) {
+        return ret;
+    }
+    long long len;
+    if( error ) {
+        a->error = redirect;
+        a->ret = -1;
+        return RAW_DONE;
+    }
+    if( !raw_bulk_len(c, redirect, len) ) {
+        return RAW_ABORT;
+    }
+    if( len<0 ) {
+        a->ret = 0;
+        return RAW_DONE;
+    }
+
+    for(size_t offset = 0; offset < (size_t)len; ) {
+        size_t n = std::min(a->chunk.size(), (size_t)len - offset);
+        if( !raw_read(r, &a->chunk[0], n) ) {
+            raw_io_error(c, r);
+            /* the sink has seen part of the value, it is not asked again */
+            return offset>0? RAW_ABORT: RAW_IO_ERROR;
+        }
+        if( !a->sink(&a->chunk[0], n, offset, a->arg) ) {
+            set_context_error(c, REDIS_ERR_OTHER, "value sink stopped");
+            return RAW_ABORT;
+        }
+        offset += n;
+    }
+    if( (ret = raw_bulk_end(c, r))!=RAW_DONE ) {
+        return RAW_ABORT;
+    }
+    a->ret = 1;
+    return RAW_DONE;
+}
+
+int Cluster::write_stream(const std::vector<std::string> &commands, size_t len, ChunkSource source, void *arg,
+                          size_t chunk) {
+    uint64_t start = now_us();
+    MetricsType &metrics = thread_stat()->metrics;
+    bump(metrics.requests);
+    memset(&tls_phase, 0, sizeof(tls_phase));
+
+    if( commands.size()<2 ) {
+        set_error(E_COMMANDS, "none-key commands are not supported");
+        bump(metrics.errors[E_COMMANDS]);
+        return -1;
+    }
+
+    StreamArgType a;
+    a.commands = &commands;
+    a.len = len;
+    a.source = source;
+    a.sink = NULL;
+    a.arg = arg;
+    a.chunk.resize(chunk>0? chunk: 1);
+    a.ret = -1;
+
+    std::string cmd = to_upper(commands[0]);
+    int ret = raw_command(commands[1], cmd.c_str(), write_stream_exchange, &a);
+    record_request(cmd, commands, start, ret<0);
+    if( ret<0 ) {
+        return -1;
+    }
+    if( a.ret<0 ) {
+        set_error(E_OTHERS, "error reply", NULL, -1, 0, a.error.data(), a.error.length());
+    }
+    return a.ret;
+}
+
+int Cluster::read_stream(const std::vector<std::string> &commands, ChunkSink sink, void *arg, size_t chunk) {
+    uint64_t start = now_us();
+    MetricsType &metrics = thread_stat()->metrics;
+    bump(metrics.requests);
+    memset(&tls_phase, 0, sizeof(tls_phase));
+
+    if( commands.size()<2 ) {
+        set_error(E_COMMANDS, "none-key commands are not supported");
+        bump(metrics.errors[E_COMMANDS]);
+        return -1;
+    }
+
+    StreamArgType a;
+    a.commands = &commands;
+    a.len = 0;
+    a.source = NULL;
+    a.sink = sink;
+    a.arg = arg;
+    a.chunk.resize(chunk>0? chunk: 1);
+    a.ret = -1;
+
+    std::string cmd = to_upper(commands[0]);
+    int ret = raw_command(commands[1], cmd.c_str(), read_stream_exchange, &a);
+    record_request(cmd, commands, start, ret<0);
+    if( ret<0 ) {
+        return -1;
+    }
+    if( a.ret<0 ) {
+        set_error(E_OTHERS, "error reply", NULL, -1, 0, a.error.data(), a.error.length());
+    }
+    return a.ret;
+}
+
+int Cluster::raw_command(const std::string &key, const char *cmd, RawExchange exchange, void *arg) {
+
+#define MAX_TTL 5
+
+    int ttl = MAX_TTL;
+    Node *node = NULL;
+    bool try_random_node = false;
+    Node *ask_node = NULL;
+    MetricsType &metrics = thread_stat()->metrics;
+
+    tls_error.err = E_OK;
+
+    if( take_load_slots_asap() ) {
+        if( !shared_ || claim_shared_reload() ) {
+            load_slots_cache();
+        }
+    }
+    if( shared_ && __atomic_load_n(&shared_->header.epoch, __ATOMIC_ACQUIRE)!=__atomic_load_n(&shared_epoch_, __ATOMIC_RELAXED) ) {
+        adopt_shared_map();
+    }
+
+    const int slot = get_key_hash(key) % HASH_SLOTS;
+
+    while( ttl>0 ) {
+        ttl--;
+        tls_error.ttls = (MAX_TTL - ttl);
+        bump(metrics.attempts);
+
+        bool asking = false;
+        if( ask_node ) {
+            node = ask_node;
+            ask_node = NULL;
+            asking = true;
+        } else if( try_random_node ) {
+            try_random_node = false;
+            node = get_random_node(node);
+            if( !node ) {
+                set_error(E_IO, "try random node: no avaliable node", NULL, slot);
+                return -1;
+            }
+        } else {
+            node = slots_[slot];
+            if( !node ) {
+                try_random_node = true;
+                continue;
+            }
+        }
+
+        uint64_t queue_start = now_us();
+        int limited = node->acquire();
+        uint64_t queue_us = limited ? now_us() - queue_start : NO_SAMPLE;
+        if( limited<0 ) {
+            record_node_latency(node, NO_SAMPLE, queue_us, NO_SAMPLE);
+            set_error(E_OVERLOAD, "node overload", node, slot);
+            return -1;
+        }
+
+        tls_connect_us = NO_SAMPLE;
+        redisContext *c = (redisContext *)node->get_conn();
+        if( !c ) {
+            bump(metrics.connect_errors);
+            if( limited ) {
+                node->release();
+            }
+            try_random_node = true;
+            continue;
+        }
+        if( tls_connect_us!=NO_SAMPLE ) {
+            bump(metrics.connections);
+            if( TRACING() ) {
+                trace(trace_hooks_.on_reconnect, node, slot, cmd, strlen(cmd),
+                      MAX_TTL - ttl, now_us() - tls_connect_us, tls_connect_us, NULL);
+            }
+        }
+        if( TRACING() ) {
+            trace(trace_hooks_.before_send, node, slot, cmd, strlen(cmd), MAX_TTL - ttl, now_us(), 0, NULL);
+        }
+
+        std::string redirect;
+        uint64_t rtt_start = now_us();
+        int ret = exchange(c, asking, redirect, arg);
+        uint64_t rtt = now_us() - rtt_start;
+        record_node_latency(node, tls_connect_us, queue_us, rtt);
+        if( TRACING() ) {
+            bool io = (ret==RAW_IO_ERROR || c->err==REDIS_ERR_IO || c->err==REDIS_ERR_EOF);
+            trace(trace_hooks_.after_reply, node, slot, cmd, strlen(cmd), MAX_TTL - ttl, rtt_start, rtt, NULL,
+                  0, io? E_IO: E_OK);
+        }
+        if( ret==RAW_IO_ERROR ) {
+            DEBUGINFO(cmd << " error. " << c->errstr << "(" << c->err << ")");
+            set_error(E_IO, cmd, node, slot, c->err, c->errstr);
+            try_random_node = true;
+        } else if( ret==RAW_ABORT ) {
+            bool io = (c->err==REDIS_ERR_IO || c->err==REDIS_ERR_EOF);
+            set_error(io? E_IO: E_OTHERS, cmd, node, slot, c->err, c->errstr);
+        }
+        node->put_conn(c);
+        if( limited ) {
+            node->release();
+        }
+
+        if( ret==RAW_ABORT ) {
+            return -1;
+        } else if( ret==RAW_REDIRECT ) {
+            bool ask;
+            Node *target;
+            if( !follow_redirect(redirect, ask, target) ) {
+                set_error(E_OTHERS, "bad redirection", node, slot, 0, redirect.data(), redirect.length());
+                return -1;
+            }
+            if( TRACING() ) {
+                trace(trace_hooks_.on_redirect, target, slot, cmd, strlen(cmd), MAX_TTL - ttl, now_us(), 0, NULL);
+            }
+            if( ask ) {
+                ask_node = target;
+            }
+        } else if( ret==RAW_DONE ) {
+            return 0;
+        }
+    }
+
+    set_error(E_TTL, "max ttl fail", node, slot);
+    return -1;
+
+#undef MAX_TTL
+}
+
+bool Cluster::follow_redirect(const std::string &line, bool &ask, Node *&target) {
+    int slot, port;
+    std::string host;
+    if( !parse_redirect(line.c_str(), ask, slot, host, port) || slot<0 || slot>=HASH_SLOTS ) {
+        return false;
+    }
+    MetricsType &metrics = thread_stat()->metrics;
+    bump(ask? metrics.ask: metrics.moved);
+    if( add_node(host, port, target) ) {
+        DEBUGINFO("insert new node "<< target->simple_dump()<< " from redirection" );
+    }
+    if( !ask ) {
+        set_slot_owner(slot, target);
+    }
+    return true;
+}
+
+void Cluster::set_slot_owner(int slot, Node *node) {
+    slots_[slot] = node;
+    set_load_slots_asap();    // cluster nodes must have being changed, load slots cache as soon as possible
+    if( shared_ ) {
+        publish_shared_slot(slot, node);
+    }
+}
+
+bool Cluster::hedge_allowed() {
+    uint64_t reads = __atomic_load_n(&hedge_stat_.reads, __ATOMIC_RELAXED);
+    uint64_t hedged = __atomic_load_n(&hedge_stat_.hedged, __ATOMIC_RELAXED);
+    if( hedged + 1 > reads * hedge_policy_.max_ratio ) {
+        __atomic_fetch_add(&hedge_stat_.throttled, 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    __atomic_fetch_add(&hedge_stat_.hedged, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+redisReply* Cluster::hedged_command_argv(int slot, Node *node, void *&conn, int argc, const char **argv, const size_t *argvlen) {
+#define HEDGE_DELAY_UPDATE_MASK 0xff
+#define HEDGE_MIN_SAMPLES 100
+
+    redisContext *c = (redisContext *)conn;
+    redisContext *rc = NULL;
+    Node *replica = replica_slots_[slot];
+    void *reply = NULL;
+    uint64_t start = now_us();
+
+    uint64_t reads = __atomic_add_fetch(&hedge_stat_.reads, 1, __ATOMIC_RELAXED);
+    if( (reads & HEDGE_DELAY_UPDATE_MASK)==0 ) {
+        uint64_t delay = hedge_policy_.max_delay_us;
+        if( read_latency_.count()>=HEDGE_MIN_SAMPLES ) {
+            delay = read_latency_.percentile(hedge_policy_.percentile);
+            if( delay<hedge_policy_.min_delay_us )
+                delay = hedge_policy_.min_delay_us;
+            if( delay>hedge_policy_.max_delay_us )
+                delay = hedge_policy_.max_delay_us;
+        }
+        __atomic_store_n(&hedge_stat_.delay_us, delay, __ATOMIC_RELAXED);
+    }
+
+    redisAppendCommandArgv(c, argc, argv, argvlen);
+    if( flush_output(c)<0 ) {
+        return NULL;
+    }
+
+    if( !replica
+        || wait_readable(c->fd, __atomic_load_n(&hedge_stat_.delay_us, __ATOMIC_RELAXED))
+        || !hedge_allowed() ) {
+        redisGetReply(c, &reply);
+        if( reply ) {
+            read_latency_.record(now_us() - start);
+        }
+        return (redisReply *)reply;
+    }
+
+    /* master is late, race it with the replica */
+
+    rc = (redisContext *)replica->get_conn();
+    if( rc ) {
+        redisAppendCommandArgv(rc, argc, argv, argvlen);
+        if( flush_output(rc)<0 ) {
+            redisFree( rc );
+            rc = NULL;
+        }
+    }
+    DEBUGINFO("slot " << slot << " hedge to " << replica->simple_dump() << (rc? "": " fail"));
+    if( !rc ) {
+        redisGetReply(c, &reply);
+        if( reply ) {
+            read_latency_.record(now_us() - start);
+        }
+        return (redisReply *)reply;
+    }
+
+    redisContext *ctx[2] = {c, rc};
+    bool alive[2] = {true, true};
+    int timeout_ms = timeout_ > 0 ? timeout_ * 1000 : -1;
+    int winner = -1;
+
+    while( winner<0 && (alive[0] || alive[1]) ) {
+        struct pollfd pfd[2];
+        for(int i = 0; i < 2; i++) {
+            pfd[i].fd = alive[i]? ctx[i]->fd: -1;
+            pfd[i].events = POLLIN;
+            pfd[i].revents = 0;
+        }
+        int ret = ::poll(pfd, 2, timeout_ms);
+        if( ret<0 && errno==EINTR ) {
+            continue;
+        }
+        if( ret<=0 ) {
+            break;
+        }
+        for(int i = 0; i < 2 && winner<0; i++) {
+            if( !alive[i] || pfd[i].revents==0 ) {
+                continue;
+            }
+            if( redisBufferRead(ctx[i])!=REDIS_OK
+                || redisGetReplyFromReader(ctx[i], &reply)!=REDIS_OK ) {
+                alive[i] = false;
+                continue;
+            }
+            if( reply ) {
+                winner = i;
+            }
+        }
+    }
+
+    if( winner==1 ) {
+        __atomic_fetch_add(&hedge_stat_.replica_wins, 1, __ATOMIC_RELAXED);
+        replica->put_conn(rc);
+        redisFree( c );
+        conn = NULL;
+    } else {
+        redisFree( rc );
+        if( winner<0 && c->err==REDIS_OK ) {
+            /* a reply is still pending on it, don't let it back into the pool */
+            c->err = REDIS_ERR_IO;
+            snprintf(c->errstr, sizeof(c->errstr), "hedged request timeout");
+        }
+    }
+    if( reply ) {
+        read_latency_.record(now_us() - start);
+    }
+    return (redisReply *)reply;
+
+#undef HEDGE_MIN_SAMPLES
+#undef HEDGE_DELAY_UPDATE_MASK
+}
+
+redisReply* Cluster::coalesced_command_argv(const std::string& key, int argc, const char **argv, const size_t *argvlen,
+                                            bool hedge) {
+    std::string fkey;
+    for(int i = 0; i < argc; i++) {
+        uint32_t len = argvlen[i];
+        fkey.append((const char *)&len, sizeof(len));
+        fkey.append(argv[i], argvlen[i]);
+    }
+
+    FlightStripeType &stripe = flight_stripes_[crc16(fkey.data(), fkey.size()) % FLIGHT_STRIPES];
+    FlightType *flight = NULL;
+    redisReply *reply = NULL;
+
+    pthread_mutex_lock(&stripe.lock);
+
+    std::map<std::string, FlightType *>::iterator iter = stripe.flights.find(fkey);
+    if( iter==stripe.flights.end() ) {
+
+        /* leader: do the request */
+
+        flight = new FlightType;
+        flight->reply = NULL;
+        flight->refs = 1;
+        flight->done = false;
+        pthread_cond_init(&flight->cond, NULL);
+        stripe.flights[fkey] = flight;
+        pthread_mutex_unlock(&stripe.lock);
+
+        reply = redis_command_argv(key, argc, argv, argvlen, hedge);
+
+        pthread_mutex_lock(&stripe.lock);
+        flight->reply = reply;
+        flight->error = tls_error;
+        flight->done = true;
+        stripe.flights.erase(fkey);
+        pthread_cond_broadcast(&flight->cond);
+    } else {
+
+        /* waiter: wait for the leader's reply */
+
+        flight = iter->second;
+        flight->refs++;
+        while( !flight->done ) {
+            pthread_cond_wait(&flight->cond, &stripe.lock);
+        }
+        tls_error = flight->error;
+    }
+
+    /**
+     * The last one takes the reply, the others take a copy. The copy is made out of the
+     * lock while still holding a reference, which keeps the reply alive; whoever drops
+     * the last reference frees what is left.
+     */
+
+    if( flight->refs==1 ) {
+        flight->refs = 0;
+        reply = flight->reply;
+        pthread_mutex_unlock(&stripe.lock);
+        pthread_cond_destroy(&flight->cond);
+        delete flight;
+        return reply;
+    }
+    pthread_mutex_unlock(&stripe.lock);
+
+    reply = flight->reply? dup_reply(flight->reply): NULL;
+
+    pthread_mutex_lock(&stripe.lock);
+    bool last = (--flight->refs==0);
+    pthread_mutex_unlock(&stripe.lock);
+    if( last ) {
+        if( flight->reply ) {
+            freeReplyObject(flight->reply);
+        }
+        pthread_cond_destroy(&flight->cond);
+        delete flight;
+    }
+    return reply;
+}
+
+void Cluster::set_node_limits(unsigned int max_inflight, unsigned int max_waiting) {
+    std::vector<Node *> nodes;
+    node_max_inflight_ = max_inflight;
+    node_max_waiting_ = max_waiting;
+    nodes_.nodes(nodes);
+    for(size_t i = 0; i < nodes.size(); i++) {
+        nodes[i]->set_limits(max_inflight, max_waiting);
+    }
+}
+
+void Cluster::set_hot_sampling(unsigned int rate) {
+    __atomic_store_n(&hot_rate_, rate, __ATOMIC_RELAXED);
+}
+
+void Cluster::sample_hot(const std::string &key, int slot) {
+    ThreadStatType *tl = thread_stat();
+    if( !tl->hot ) {
+        HotStatType *hot = new HotStatType;
+        memset(hot->sketch, 0, sizeof(hot->sketch));
+        memset(hot->slots, 0, sizeof(hot->slots));
+        LockGuard lg(tl->lock);
+        tl->hot = hot;
+    }
+
+    uint64_t h = fnv1a64(key.data(), key.length());
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32);
+
+    LockGuard lg(tl->lock);     // only contended by readers
+    HotStatType &hot = *tl->hot;
+
+    hot.slots[slot]++;
+
+    uint32_t estimate = 0xffffffff;
+    for(int d = 0; d < HOT_DEPTH; d++) {
+        uint32_t &cell = hot.sketch[d][(h1 + d * h2) % HOT_WIDTH];
+        cell++;
+        if( cell<estimate )
+            estimate = cell;
+    }
+
+    size_t min_idx = 0;
+    for(size_t i = 0; i < hot.topk.size(); i++) {
+        if( hot.topk[i].first==key ) {
+            hot.topk[i].second = estimate;
+            return;
+        }
+        if( hot.topk[i].second<hot.topk[min_idx].second )
+            min_idx = i;
+    }
+    if( hot.topk.size()<HOT_TOPK ) {
+        hot.topk.push_back(std::make_pair(key, estimate));
+    } else if( estimate>hot.topk[min_idx].second ) {
+        hot.topk[min_idx] = std::make_pair(key, estimate);
+    }
+}
+
+static bool hot_key_greater(const Cluster::HotKeyType &l, const Cluster::HotKeyType &r) {
+    return l.count > r.count;
+}
+
+static bool hot_slot_greater(const Cluster::HotSlotType &l, const Cluster::HotSlotType &r) {
+    return l.count > r.count;
+}
+
+void Cluster::hot_keys(std::vector<HotKeyType> &keys, size_t n) {
+    keys.clear();
+    unsigned int rate = __atomic_load_n(&hot_rate_, __ATOMIC_RELAXED);
+
+    /* candidates from every top-K, estimated against the sum of all sketches */
+
+    std::set<std::string> candidates;
+    ThreadStatType *head = __atomic_load_n(&thread_stats_, __ATOMIC_ACQUIRE);
+    for(ThreadStatType *tl = head; tl; tl = tl->next) {
+        LockGuard lg(tl->lock);
+        if( !tl->hot ) {
+            continue;
+        }
+        for(size_t k = 0; k < tl->hot->topk.size(); k++) {
+            candidates.insert(tl->hot->topk[k].first);
+        }
+    }
+
+    std::set<std::string>::iterator iter = candidates.begin();
+    for(; iter != candidates.end(); iter++) {
+        uint64_t h = fnv1a64(iter->data(), iter->length());
+        uint32_t h1 = (uint32_t)h;
+        uint32_t h2 = (uint32_t)(h >> 32);
+        uint64_t total = 0;
+
+        for(ThreadStatType *tl = head; tl; tl = tl->next) {
+            LockGuard lg(tl->lock);
+            if( !tl->hot ) {
+                continue;
+            }
+            uint32_t estimate = 0xffffffff;
+            for(int d = 0; d < HOT_DEPTH; d++) {
+                uint32_t cell = tl->hot->sketch[d][(h1 + d * h2) % HOT_WIDTH];
+                if( cell<estimate )
+                    estimate = cell;
+            }
+            total += estimate;
+        }
+
+        HotKeyType hk;
+        hk.key = *iter;
+        hk.slot = get_key_hash(*iter) % HASH_SLOTS;
+        hk.count = total * rate;
+        hk.node = slots_.empty()? NULL: slots_[hk.slot];
+        keys.push_back(hk);
+    }
+
+    std::sort(keys.begin(), keys.end(), hot_key_greater);
+    if( keys.size()>n ) {
+        keys.resize(n);
+    }
+}
+
+void Cluster::hot_slots(std::vector<HotSlotType> &slots, size_t n) {
+    slots.clear();
+    unsigned int rate = __atomic_load_n(&hot_rate_, __ATOMIC_RELAXED);
+
+    std::vector<uint64_t> counts(HASH_SLOTS, 0);
+    bool sampled = false;
+    ThreadStatType *tl = __atomic_load_n(&thread_stats_, __ATOMIC_ACQUIRE);
+    for(; tl; tl = tl->next) {
+        LockGuard lg(tl->lock);
+        if( !tl->hot ) {
+            continue;
+        }
+        sampled = true;
+        for(int i = 0; i < HASH_SLOTS; i++) {
+            counts[i] += tl->hot->slots[i];
+        }
+    }
+    if( !sampled ) {
+        return;
+    }
+
+    for(int i = 0; i < HASH_SLOTS; i++) {
+        if( counts[i]==0 ) {
+            continue;
+        }
+        HotSlotType hs;
+        hs.slot = i;
+        hs.count = counts[i] * rate;
+        hs.node = slots_.empty()? NULL: slots_[i];
+        slots.push_back(hs);
+    }
+    std::sort(slots.begin(), slots.end(), hot_slot_greater);
+    if( slots.size()>n ) {
+        slots.resize(n);
+    }
+}
+
+void Cluster::reset_hot_stat() {
+    ThreadStatType *tl = __atomic_load_n(&thread_stats_, __ATOMIC_ACQUIRE);
+    for(; tl; tl = tl->next) {
+        LockGuard lg(tl->lock);
+        if( !tl->hot ) {
+            continue;
+        }
+        memset(tl->hot->sketch, 0, sizeof(tl->hot->sketch));
+        memset(tl->hot->slots, 0, sizeof(tl->hot->slots));
+        tl->hot->topk.clear();
+    }
+}
+
+int Cluster::set_compression(size_t threshold) {
+#ifdef HAVE_LZ4
+    if( compress_rules_.empty() ) {
+        add_compress_rule("SET", 2, 0);
+        add_compress_rule("SETNX", 2, 0);
+        add_compress_rule("GETSET", 2, 0);
+        add_compress_rule("SETEX", 3, 0);
+        add_compress_rule("PSETEX", 3, 0);
+        add_compress_rule("MSET", 2, 2);
+        add_compress_rule("HSET", 3, 2);
+        add_compress_rule("HMSET", 3, 2);
+        add_compress_rule("HSETNX", 3, 0);
+    }
+    if( decompress_rules_.empty() ) {
+        add_decompress_rule("GET");
+        add_decompress_rule("GETSET");
+        add_decompress_rule("MGET");
+        add_decompress_rule("HGET");
+        add_decompress_rule("HMGET");
+        add_decompress_rule("HVALS");
+        add_decompress_rule("HGETALL");
+    }
+    compress_threshold_ = threshold>0? threshold: 1;
+    return 0;
+#else
+    (void)threshold;
+    return -1;
+#endif
+}
+
+void Cluster::add_compress_rule(const std::string &cmd, int first_arg, int step) {
+    compress_rules_[to_upper(cmd)] = CompressRuleType(first_arg, step);
+}
+
+void Cluster::add_decompress_rule(const std::string &cmd) {
+    decompress_rules_.insert(to_upper(cmd));
+}
+
+int Cluster::set_io_backend(IoBackendE backend) {
+    if( backend==IO_URING ) {
+        /* io_uring may be compiled out, or disabled by the kernel or a seccomp policy */
+        UringType *probe = uring_create();
+        if( !probe ) {
+            return -1;
+        }
+        uring_destroy(probe);
+    }
+    io_backend_ = backend;
+    return 0;
+}
+
+void Cluster::set_hedge_policy(const HedgePolicyType &policy) {
+    hedge_policy_ = policy;
+    __atomic_store_n(&hedge_stat_.delay_us, (uint64_t)policy.max_delay_us, __ATOMIC_RELAXED);
+}
+
+Cluster::HedgeStatType Cluster::hedge_stat() {
+    HedgeStatType stat;
+    stat.reads = __atomic_load_n(&hedge_stat_.reads, __ATOMIC_RELAXED);
+    stat.hedged = __atomic_load_n(&hedge_stat_.hedged, __ATOMIC_RELAXED);
+    stat.replica_wins = __atomic_load_n(&hedge_stat_.replica_wins, __ATOMIC_RELAXED);
+    stat.throttled = __atomic_load_n(&hedge_stat_.throttled, __ATOMIC_RELAXED);
+    stat.delay_us = __atomic_load_n(&hedge_stat_.delay_us, __ATOMIC_RELAXED);
+    return stat;
+}
+
+void Cluster::set_error(ErrorE e, const char *what, const Node *node, int slot,
+                        int code, const char *detail, size_t detail_len) {
+    tls_error.err = e;
+    tls_error.what = what;
+    tls_error.slot = slot;
+    tls_error.code = code;
+    tls_error.node[0] = '\0';
+    tls_error.detail[0] = '\0';
+    if( node ) {
+        snprintf(tls_error.node, sizeof(tls_error.node), "%s:%u", node->host().c_str(), node->port());
+    }
+    if( detail ) {
+        if( detail_len>=sizeof(tls_error.detail) ) {
+            detail_len = strnlen(detail, sizeof(tls_error.detail) - 1);
+        }
+        memcpy(tls_error.detail, detail, detail_len);
+        tls_error.detail[detail_len] = '\0';
+    }
+}
+
+int Cluster::err() {
+    return tls_error.err;
+}
+std::string Cluster::strerr() {
+    if( tls_error.err==E_OK || !tls_error.what ) {
+        return "";
+    }
+    std::ostringstream ss;
+    ss << tls_error.what;
+    if( tls_error.detail[0] ) {
+        ss << " [" << tls_error.detail << "]";
+    }
+    if( tls_error.node[0] ) {
+        ss << " node " << tls_error.node;
+    }
+    if( tls_error.slot>=0 ) {
+        ss << " slot " << tls_error.slot;
+    }
+    if( tls_error.code ) {
+        ss << " (" << tls_error.code << ")";
+    }
+    return ss.str();
+}
+int Cluster::ttls() {
+    return tls_error.ttls;
+}
+const Cluster::ErrorStateType &Cluster::error_state() {
+    return tls_error;
+}
+Cluster::ThreadStatType *Cluster::thread_stat() {
+    if( tls_stat_owner==seq_ ) {
+        return (ThreadStatType *)tls_stat;
+    }
+
+    /* the thread switched between clusters, or it is new here */
+    pthread_t self = pthread_self();
+    ThreadStatType *ts = __atomic_load_n(&thread_stats_, __ATOMIC_ACQUIRE);
+    for(; ts; ts = ts->next) {
+        if( __atomic_load_n(&ts->dead, __ATOMIC_ACQUIRE)==STAT_LIVE && pthread_equal(ts->owner, self) ) {
+            break;
+        }
+    }
+    if( !ts ) {
+        /* take over the block of a thread that exited, its counts stay in the totals */
+        ts = __atomic_load_n(&thread_stats_, __ATOMIC_ACQUIRE);
+        for(; ts; ts = ts->next) {
+            int dead = STAT_DEAD;
+            if( __atomic_load_n(&ts->dead, __ATOMIC_RELAXED)==STAT_DEAD &&
+                __atomic_compare_exchange_n(&ts->dead, &dead, STAT_CLAIMED, false,
+                                            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ) {
+                break;
+            }
+        }
+        if( ts ) {
+            pthread_spin_lock(&ts->lock);
+            ts->owner = self;
+            ts->id = __atomic_fetch_add(&thread_seq_, 1, __ATOMIC_RELAXED);
+            pthread_spin_unlock(&ts->lock);
+            __atomic_store_n(&ts->dead, STAT_LIVE, __ATOMIC_RELEASE);
+            own_stat(seq_, &ts->dead);
+        }
+    }
+    if( !ts ) {
+        ts = new ThreadStatType;
+        ts->owner = self;
+        ts->dead = STAT_LIVE;
+        ts->id = __atomic_fetch_add(&thread_seq_, 1, __ATOMIC_RELAXED);
+        memset(&ts->metrics, 0, sizeof(ts->metrics));
+        ts->uring = NULL;
+        ts->uring_failed = false;
+        ts->hot = NULL;
+        int ret = pthread_spin_init(&ts->lock, PTHREAD_PROCESS_PRIVATE);
+        rcassert(ret == 0);
+        ts->next = __atomic_load_n(&thread_stats_, __ATOMIC_RELAXED);
+        while( !__atomic_compare_exchange_n(&thread_stats_, &ts->next, ts, true,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED) ) {
+        }
+        own_stat(seq_, &ts->dead);
+    }
+    tls_stat_owner = seq_;
+    tls_stat = ts;
+    return ts;
+}
+
+void Cluster::record_node_latency(const Node *node, uint64_t connect, uint64_t queue, uint64_t rtt) {
+    ThreadStatType *tl = thread_stat();
+
+    tls_phase.node = node;
+    if( connect!=NO_SAMPLE )
+        tls_phase.connect_us += connect;
+    if( queue!=NO_SAMPLE )
+        tls_phase.queue_us += queue;
+    if( rtt!=NO_SAMPLE )
+        tls_phase.rtt_us += rtt;
+
+    LockGuard lg(tl->lock);
+
+    if( node->index()>=tl->nodes.size() ) {
+        tl->nodes.resize(node->index() + 1, NULL);
+    }
+    NodeHistogramsType *nh = tl->nodes[node->index()];
+    if( !nh ) {
+        nh = tl->nodes[node->index()] = new NodeHistogramsType;
+    }
+    if( connect!=NO_SAMPLE )
+        nh->connect.add(connect);
+    if( queue!=NO_SAMPLE )
+        nh->queue.add(queue);
+    if( rtt!=NO_SAMPLE )
+        nh->rtt.add(rtt);
+}
+
+void Cluster::record_command_latency(const std::string &cmd, uint64_t total) {
+    ThreadStatType *tl = thread_stat();
+
+    LockGuard lg(tl->lock);
+
+    std::map<std::string, LatencyHistogram *>::iterator iter = tl->commands.find(cmd);
+    if( iter==tl->commands.end() ) {
+        iter = tl->commands.insert(std::make_pair(cmd, new LatencyHistogram)).first;
+    }
+    iter->second->add(total);
+}
+
+static void summarize(const LatencyHistogram &hist, Cluster::LatencySummaryType &out) {
+    out.count = hist.count();
+    out.p50 = hist.percentile(0.5);
+    out.p99 = hist.percentile(0.99);
+    out.p999 = hist.percentile(0.999);
+}
+
+void Cluster::node_latency(std::vector<NodeLatencyType> &out) {
+    std::vector<Node *> nodes;
+    nodes_.nodes(nodes);
+
+    std::vector<NodeHistogramsType> merged(nodes.size());
+    {
+        ThreadStatType *tl = __atomic_load_n(&thread_stats_, __ATOMIC_ACQUIRE);
+        for(; tl; tl = tl->next) {
+            LockGuard lg(tl->lock);
+
+            for(size_t j = 0; j < tl->nodes.size() && j < merged.size(); j++) {
+                if( tl->nodes[j] ) {
+                    merged[j].connect.merge(tl->nodes[j]->connect);
+                    merged[j].queue.merge(tl->nodes[j]->queue);
+                    merged[j].rtt.merge(tl->nodes[j]->rtt);
+                }
+            }
+        }
+    }
+
+    out.clear();
+    for(size_t i = 0; i < nodes.size(); i++) {
+        NodeLatencyType nl;
+        nl.node = nodes[i];
+        summarize(merged[i].connect, nl.connect);
+        summarize(merged[i].queue, nl.queue);
+        summarize(merged[i].rtt, nl.rtt);
+        out.push_back(nl);
+    }
+}
+
+void Cluster::command_latency(std::vector<CommandLatencyType> &out) {
+    std::map<std::string, LatencyHistogram> merged;
+    {
+        ThreadStatType *tl = __atomic_load_n(&thread_stats_, __ATOMIC_ACQUIRE);
+        for(; tl; tl = tl->next) {
+            LockGuard lg(tl->lock);
+
+            std::map<std::string, LatencyHistogram *>::iterator iter = tl->commands.begin();
+            for(; iter != tl->commands.end(); iter++) {
+                merged[iter->first].merge(*iter->second);
+            }
+        }
+    }
+
+    out.clear();
+    std::map<std::string, LatencyHistogram>::iterator iter = merged.begin();
+    for(; iter != merged.end(); iter++) {
+        CommandLatencyType cl;
+        cl.command = iter->first;
+        summarize(iter->second, cl.total);
+        out.push_back(cl);
+    }
+}
+
+void Cluster::reset_latency() {
+    ThreadStatType *tl = __atomic_load_n(&thread_stats_, __ATOMIC_ACQUIRE);
+    for(; tl; tl = tl->next) {
+        LockGuard lg(tl->lock);
+
+        for(size_t j = 0; j < tl->nodes.size(); j++) {
+            if( tl->nodes[j] ) {
+                tl->nodes[j]->connect.reset();
+                tl->nodes[j]->queue.reset();
+                tl->nodes[j]->rtt.reset();
+            }
+        }
+        std::map<std::string, LatencyHistogram *>::iterator iter = tl->commands.begin();
+        for(; iter != tl->commands.end(); iter++) {
+            iter->second->reset();
+        }
+    }
+}
+
+void Cluster::set_trace_hooks(const TraceHooksType *hooks) {
+    if( hooks ) {
+        trace_hooks_ = *hooks;
+        tracing_ = true;
+    } else {
+        tracing_ = false;
+        memset(&trace_hooks_, 0, sizeof(trace_hooks_));
+    }
+}
+
+void Cluster::trace(TraceHook hook, const Node *node, int slot, const char *cmd, size_t cmd_len,
+                    int attempt, uint64_t start, uint64_t elapsed, const redisReply *reply, int loaded_slots,
+                    int err) {
+    if( !hook ) {
+        return;
+    }
+    TraceEventType event;
+    event.node = node;
+    event.slot = slot;
+    event.command = cmd;
+    event.command_len = cmd_len;
+    event.attempt = attempt;
+    event.start_us = start;
+    event.elapsed_us = elapsed;
+    event.reply = reply;
+    event.err = err;
+    event.loaded_slots = loaded_slots;
+    hook(event, trace_hooks_.arg);
+}
+
+void Cluster::set_slow_log(uint64_t threshold_us, size_t capacity) {
+    slow_threshold_us_ = 0;
+    delete [] slow_ring_;
+    slow_ring_ = NULL;
+    slow_capacity_ = 0;
+    slow_next_ = 0;
+
+    if( threshold_us==0 || capacity==0 ) {
+        return;
+    }
+    slow_ring_ = new SlowSlotType[capacity];
+    memset(slow_ring_, 0, sizeof(SlowSlotType) * capacity);
+    slow_capacity_ = capacity;
+    slow_threshold_us_ = threshold_us;
+}
+
+uint64_t Cluster::record_request(const std::string &cmd, const std::vector<std::string> &commands, uint64_t start,
+                                 bool failed) {
+    uint64_t total = now_us() - start;
+    record_command_latency(cmd, total);
+    if( failed ) {
+        bump(thread_stat()->metrics.errors[tls_error.err]);
+    }
+    if( slow_threshold_us_>0 && total>=slow_threshold_us_ && commands.size()>=2 ) {
+        record_slow(commands, total, failed? tls_error.err: E_OK);
+    }
+    return total;
+}
+
+void Cluster::record_slow(const std::vector<std::string> &commands, uint64_t total, ErrorE err) {
+    uint64_t id = __atomic_fetch_add(&slow_next_, 1, __ATOMIC_RELAXED);
+    SlowSlotType &slot = slow_ring_[id % slow_capacity_];
+
+    /* claim the slot, give up if a writer one lap ahead or behind holds it */
+    uint64_t seq = __atomic_load_n(&slot.seq, __ATOMIC_RELAXED);
+    if( (seq & 1)
+        || !__atomic_compare_exchange_n(&slot.seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ) {
+        return;
+    }
+
+    SlowLogEntryType &e = slot.entry;
+    if( seq>0 && e.id>id ) {
+        /* picked one lap ago and preempted, a newer writer has been here meanwhile */
+        __atomic_store_n(&slot.seq, seq + 2, __ATOMIC_RELEASE);
+        return;
+    }
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    e.id = id;
+    e.timestamp_us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec - total;
+    e.total_us = total;
+    e.connect_us = tls_phase.connect_us;
+    e.queue_us = tls_phase.queue_us;
+    e.rtt_us = tls_phase.rtt_us;
+    e.slot = get_key_hash(commands[1]) % HASH_SLOTS;
+    e.ttls = tls_error.ttls;
+    e.err = err;
+    e.node[0] = '\0';
+    if( tls_phase.node ) {
+        snprintf(e.node, sizeof(e.node), "%s:%u", tls_phase.node->host().c_str(), tls_phase.node->port());
+    }
+
+    const size_t MAX_ARG = 32;
+    size_t len = 0;
+    for(size_t i = 0; i < commands.size() && len + 1 < sizeof(e.command); i++) {
+        if( i>0 ) {
+            e.command[len++] = ' ';
+        }
+        const std::string &arg = commands[i];
+        for(size_t j = 0; j < arg.length() && j < MAX_ARG && len + 1 < sizeof(e.command); j++) {
+            e.command[len++] = isprint((unsigned char)arg[j])? arg[j]: '?';
+        }
+        if( arg.length()>MAX_ARG ) {
+            for(int j = 0; j < 3 && len + 1 < sizeof(e.command); j++) {
+                e.command[len++] = '.';
+            }
+        }
+    }
+    e.command[len] = '\0';
+
+    __atomic_store_n(&slot.seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+void Cluster::slow_log(std::vector<SlowLogEntryType> &out, size_t n) {
+    out.clear();
+    if( !slow_ring_ ) {
+        return;
+    }
+
+    for(size_t i = 0; i < slow_capacity_; i++) {
+        SlowSlotType &slot = slow_ring_[i];
+        SlowLogEntryType e;
+
+        uint64_t seq = __atomic_load_n(&slot.seq, __ATOMIC_ACQUIRE);
+        if( seq==0 || (seq & 1) ) {
+            continue;   // empty or being written
+        }
+        memcpy(&e, &slot.entry, sizeof(e));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if( __atomic_load_n(&slot.seq, __ATOMIC_RELAXED)!=seq ) {
+            continue;   // overwritten while copying
+        }
+        out.push_back(e);
+    }
+
+    /* newest first */
+    for(size_t i = 1; i < out.size(); i++) {
+        for(size_t j = i; j > 0 && out[j - 1].id < out[j].id; j--) {
+            std::swap(out[j - 1], out[j]);
+        }
+    }
+    if( n>0 && out.size()>n ) {
+        out.resize(n);
+    }
+}
+
+std::string Cluster::slow_log_dump(size_t n) {
+    std::vector<SlowLogEntryType> entries;
+    slow_log(entries, n);
+
+    std::ostringstream ss;
+    ss<<"Slow log have "<<entries.size()<<" entries: ";
+    for(size_t i = 0; i < entries.size(); i++) {
+        const SlowLogEntryType &e = entries[i];
+        ss<< "\r\nSlow{id: "<< e.id
+          <<" time_us: "<< e.timestamp_us
+          <<" total_us: "<< e.total_us
+          <<" connect_us: "<< e.connect_us
+          <<" queue_us: "<< e.queue_us
+          <<" rtt_us: "<< e.rtt_us
+          <<" ttls: "<< e.ttls
+          <<" slot: "<< e.slot
+          <<" node: "<< e.node
+          <<" err: "<< e.err
+          <<" command: "<< e.command<<"}";
+    }
+    ss << "\r\n";
+
+    return ss.str();
+}
+
+/* capture file: CAPTURE_MAGIC, then records of
+ *   uint32 record length, including itself
+ *   uint64 timestamp_us, uint32 thread, uint32 latency_us, uint32 reply_size, uint8 err
+ *   uint32 argc, then argc times uint32 length and the argument
+ * integers in host byte order
+ */
+static const char CAPTURE_MAGIC[8] = {'R', 'C', 'C', 'A', 'P', 'T', '0', '1'};
+static const int CAPTURE_STARTING = -2;                // capture_fd_ claimed by start_capture()
+static const size_t CAPTURE_HEAD = 4 + 8 + 4 + 4 + 4 + 1 + 4;
+
+static inline void put_u32(std::string &buf, uint32_t v) {
+    buf.append((const char *)&v, sizeof(v));
+}
+
+static inline void put_u64(std::string &buf, uint64_t v) {
+    buf.append((const char *)&v, sizeof(v));
+}
+
+int Cluster::start_capture(const std::string &path, size_t buffer_size) {
+    /* claim first, a running capture keeps its file and its limit */
+    int disabled = -1;
+    if( !__atomic_compare_exchange_n(&capture_fd_, &disabled, CAPTURE_STARTING, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ) {
+        return -1;
+    }
+
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if( fd>=0 && !write_all(fd, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) ) {
+        close(fd);
+        fd = -1;
+    }
+    if( fd<0 ) {
+        __atomic_store_n(&capture_fd_, -1, __ATOMIC_RELEASE);
+        return -1;
+    }
+    capture_size_ = buffer_size;
+    __atomic_store_n(&capture_fd_, fd, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void Cluster::stop_capture() {
+    /* nothing to stop while off or still starting */
+    int fd = __atomic_load_n(&capture_fd_, __ATOMIC_ACQUIRE);
     do {
-        p2 = strchr(p1, ',');
-        if( p2 ) {
-            *p2 = '\0';
+        if( fd<0 ) {
+            return;
         }
-        p3 = strchr(p1, ':');
-        if( p3 ) {
+    } while( !__atomic_compare_exchange_n(&capture_fd_, &fd, -1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) );
 
-            *p3 = '\0';
-            port = atoi(p3+1); //get port
+    /**
+     * a thread appending right now holds its lock, once we got it the thread sees capture off;
+     * one which took out a full buffer counted itself as a writer before releasing it
+     */
+    std::string buf;
+    ThreadStatType *tl = __atomic_load_n(&thread_stats_, __ATOMIC_ACQUIRE);
+    for(; tl; tl = tl->next) {
+        {
+            LockGuard lg(tl->lock);
+            buf.swap(tl->capture);
+        }
+        if( !write_all(fd, buf.data(), buf.length()) ) {
+            DEBUGINFO("write capture fail. " << strerror(errno));
+        }
+        buf.clear();
+    }
+    while( __atomic_load_n(&capture_writers_, __ATOMIC_ACQUIRE)>0 ) {
+        sched_yield();
+    }
+    close(fd);
+}
 
-            while(p1<p3 && *p1==' ')//trim left
-                p1++;
+void Cluster::capture(const std::vector<std::string> &commands, uint64_t total, const redisReply *reply) {
+    ThreadStatType *tl = thread_stat();
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
 
-            p3--;
-            while(p3>p1 && *p3==' ')//trim right
-                *(p3--) = '\0';
+    int fd;
+    std::string full;
+    {
+        LockGuard lg(tl->lock);
 
-            host = p1;   //get host
+        fd = __atomic_load_n(&capture_fd_, __ATOMIC_ACQUIRE);
+        if( fd<0 ) {
+            return;
+        }
 
-            Node *node_in_pool;
-            bool ret = add_node(host, port, node_in_pool);
-            if(ret) {
-                DEBUGINFO("parse startup add " << node_in_pool->simple_dump());
-            } else {
-                DEBUGINFO("parse startup duplicate " << node_in_pool->simple_dump() << " ignored");
+        std::string &buf = tl->capture;
+        size_t begin = buf.length();
+        put_u32(buf, 0);
+        put_u64(buf, (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec - total);
+        put_u32(buf, tl->id);
+        put_u32(buf, total<(uint32_t)-1? total: (uint32_t)-1);
+        put_u32(buf, reply? reply_size(reply): 0);
+        buf.push_back((char)(reply? E_OK: tls_error.err));
+        put_u32(buf, commands.size());
+        for(size_t i = 0; i < commands.size(); i++) {
+            put_u32(buf, commands[i].length());
+            buf.append(commands[i]);
+        }
+        uint32_t len = buf.length() - begin;
+        memcpy(&buf[begin], &len, sizeof(len));
+        if( buf.length()<capture_size_ ) {
+            return;
+        }
+
+        /* written out once the lock is released, stop_capture() waits for it before closing fd */
+        full.swap(buf);
+        __atomic_add_fetch(&capture_writers_, 1, __ATOMIC_ACQ_REL);
+    }
+
+    if( !write_all(fd, full.data(), full.length()) ) {
+        DEBUGINFO("write capture fail. " << strerror(errno));
+    }
+    __atomic_sub_fetch(&capture_writers_, 1, __ATOMIC_RELEASE);
+}
+
+int Cluster::read_capture(FILE *in, CaptureRecordType &rec, bool &header_read) {
+    if( !header_read ) {
+        char magic[sizeof(CAPTURE_MAGIC)];
+        if( fread(magic, 1, sizeof(magic), in)!=sizeof(magic) || memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) ) {
+            return -1;
+        }
+        header_read = true;
+    }
+
+    uint32_t len;
+    size_t n = fread(&len, 1, sizeof(len), in);
+    if( n==0 && feof(in) ) {
+        return 0;
+    }
+    if( n!=sizeof(len) || len<CAPTURE_HEAD ) {
+        return -1;
+    }
+    std::string buf(len - sizeof(len), '\0');
+    if( fread(&buf[0], 1, buf.length(), in)!=buf.length() ) {
+        return -1;
+    }
+
+    const char *p = buf.data();
+    const char *end = p + buf.length();
+    uint32_t argc;
+    memcpy(&rec.timestamp_us, p, 8);
+    memcpy(&rec.thread, p + 8, 4);
+    memcpy(&rec.latency_us, p + 12, 4);
+    memcpy(&rec.reply_size, p + 16, 4);
+    rec.err = (ErrorE)p[20];
+    memcpy(&argc, p + 21, 4);
+    p += CAPTURE_HEAD - sizeof(len);
+
+    rec.commands.clear();
+    for(uint32_t i = 0; i < argc; i++) {
+        uint32_t arg_len;
+        if( end - p<4 ) {
+            return -1;
+        }
+        memcpy(&arg_len, p, 4);
+        p += 4;
+        if( (size_t)(end - p)<arg_len ) {
+            return -1;
+        }
+        rec.commands.push_back(std::string(p, arg_len));
+        p += arg_len;
+    }
+    return 1;
+}
+
+void Cluster::metrics(MetricsType &out) {
+    memset(&out, 0, sizeof(out));
+
+    ThreadStatType *ts = __atomic_load_n(&thread_stats_, __ATOMIC_ACQUIRE);
+    for(; ts; ts = ts->next) {
+        const uint64_t *from = (const uint64_t *)&ts->metrics;
+        uint64_t *to = (uint64_t *)&out;
+        for(size_t i = 0; i < sizeof(out) / sizeof(uint64_t); i++) {
+            to[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void prometheus_counter(std::ostringstream &ss, const std::string &name,
+                               const char *help, uint64_t value) {
+    ss << "# HELP " << name << " " << help << "\n"
+       << "# TYPE " << name << " counter\n"
+       << name << " " << value << "\n";
+}
+
+std::string Cluster::metrics_prometheus(const std::string &prefix) {
+    static const char *ERROR_NAMES[] = {"ok", "commands", "slot_missed", "io", "ttl", "others", "overload"};
+    MetricsType m;
+    metrics(m);
+
+    std::ostringstream ss;
+    prometheus_counter(ss, prefix + "_requests_total", "Requests run.", m.requests);
+
+    std::string name = prefix + "_errors_total";
+    ss << "# HELP " << name << " Failed requests by error.\n"
+       << "# TYPE " << name << " counter\n";
+    for(int e = E_COMMANDS; e <= E_OVERLOAD; e++) {
+        ss << name << "{error=\"" << ERROR_NAMES[e] << "\"} " << m.errors[e] << "\n";
+    }
+
+    prometheus_counter(ss, prefix + "_attempts_total", "Requests sent or tried to a node, retries included.", m.attempts);
+    prometheus_counter(ss, prefix + "_moved_total", "MOVED redirects.", m.moved);
+    prometheus_counter(ss, prefix + "_ask_total", "ASK redirects.", m.ask);
+    prometheus_counter(ss, prefix + "_slots_reloads_total", "Slots cache loads.", m.reloads);
+    prometheus_counter(ss, prefix + "_connections_total", "Connections opened.", m.connections);
+    prometheus_counter(ss, prefix + "_connect_errors_total", "Connections failed.", m.connect_errors);
+    prometheus_counter(ss, prefix + "_sent_bytes_total", "RESP bytes of requests.", m.bytes_out);
+    prometheus_counter(ss, prefix + "_received_bytes_total", "RESP bytes of replies.", m.bytes_in);
+
+    name = prefix + "_nodes";
+    ss << "# HELP " << name << " Known nodes.\n"
+       << "# TYPE " << name << " gauge\n"
+       << name << " " << nodes_.size() << "\n";
+
+    return ss.str();
+}
+
+std::string Cluster::stat_dump() {
+    std::ostringstream ss;
+
+    std::vector<Node *> nodes;
+    nodes_.nodes(nodes);
+
+    ss<<"Cluster have "<<nodes.size() <<" nodes: ";
+
+    for(size_t i = 0; i < nodes.size(); i++) {
+        ss<< "\r\n" <<nodes[i]->stat_dump();
+    }
+    if( __atomic_load_n(&hot_rate_, __ATOMIC_RELAXED)>0 ) {
+        std::vector<HotSlotType> slots;
+        std::vector<HotKeyType> keys;
+        hot_slots(slots, 10);
+        hot_keys(keys, 10);
+        ss<< "\r\nHot slots:";
+        for(size_t i = 0; i < slots.size(); i++) {
+            ss<< " " << slots[i].slot << "(" << slots[i].count << "@"
+              << (slots[i].node? slots[i].node->simple_dump(): "?") << ")";
+        }
+        ss<< "\r\nHot keys:";
+        for(size_t i = 0; i < keys.size(); i++) {
+            ss<< " " << keys[i].key << "(" << keys[i].count << "@"
+              << (keys[i].node? keys[i].node->simple_dump(): "?") << ")";
+        }
+    }
+    if( hedge_policy_.enabled ) {
+        HedgeStatType hs = hedge_stat();
+        ss<< "\r\nHedge{reads: "<< hs.reads
+          <<" hedged: "<< hs.hedged
+          <<" replica_wins: "<< hs.replica_wins
+          <<" throttled: "<< hs.throttled
+          <<" delay_us: "<< hs.delay_us<<"}";
+    }
+
+    std::vector<NodeLatencyType> node_lat;
+    node_latency(node_lat);
+    for(size_t i = 0; i < node_lat.size(); i++) {
+        const NodeLatencyType &nl = node_lat[i];
+        if( nl.rtt.count==0 && nl.connect.count==0 && nl.queue.count==0 )
+            continue;
+        ss<< "\r\nLatency{"<< nl.node->simple_dump()
+          <<" rtt: "<< nl.rtt.count <<"/"<< nl.rtt.p50 <<"/"<< nl.rtt.p99 <<"/"<< nl.rtt.p999
+          <<" connect: "<< nl.connect.count <<"/"<< nl.connect.p50 <<"/"<< nl.connect.p99 <<"/"<< nl.connect.p999
+          <<" queue: "<< nl.queue.count <<"/"<< nl.queue.p50 <<"/"<< nl.queue.p99 <<"/"<< nl.queue.p999 <<"}";
+    }
+    std::vector<CommandLatencyType> cmd_lat;
+    command_latency(cmd_lat);
+    for(size_t i = 0; i < cmd_lat.size(); i++) {
+        const CommandLatencyType &cl = cmd_lat[i];
+        ss<< "\r\nLatency{"<< cl.command
+          <<" total: "<< cl.total.count <<"/"<< cl.total.p50 <<"/"<< cl.total.p99 <<"/"<< cl.total.p999 <<"}";
+    }
+
+    MetricsType m;
+    metrics(m);
+    ss<< "\r\nMetrics{requests: "<< m.requests
+      <<" errors: "<< (m.errors[E_COMMANDS] + m.errors[E_SLOT_MISSED] + m.errors[E_IO]
+                       + m.errors[E_TTL] + m.errors[E_OTHERS] + m.errors[E_OVERLOAD])
+      <<" attempts: "<< m.attempts
+      <<" moved: "<< m.moved
+      <<" ask: "<< m.ask
+      <<" reloads: "<< m.reloads
+      <<" connections: "<< m.connections
+      <<" bytes_out: "<< m.bytes_out
+      <<" bytes_in: "<< m.bytes_in<<"}";
+    ss << "\r\n";
+
+    return ss.str();
+}
+
+/**
+ * class ShardedSubscriber
+ */
+ShardedSubscriber::ShardedSubscriber(Cluster *cluster, MessageCallback callback, void *arg)
+    :cluster_(cluster),
+     callback_(callback),
+     arg_(arg),
+     dirty_(false) {
+}
+
+ShardedSubscriber::~ShardedSubscriber() {
+    SubscriptionMapType::iterator iter = subs_.begin();
+    for(; iter != subs_.end(); iter++) {
+        SubscriptionType *sub = iter->second;
+        redisFree( (redisContext *)sub->conn );
+        delete sub;
+    }
+    subs_.clear();
+}
+
+Node *ShardedSubscriber::channel_owner(const std::string &channel, int &slot) {
+    slot = cluster_->get_key_hash(channel) % Cluster::HASH_SLOTS;
+
+    if( cluster_->take_load_slots_asap() ) {
+        cluster_->load_slots_cache();
+    }
+
+    Node *node = cluster_->slots_[slot];
+    if( !node ) {
+        node = cluster_->get_random_node(NULL);  // will be redirected on MOVED
+    }
+    return node;
+}
+
+ShardedSubscriber::SubscriptionType *ShardedSubscriber::get_subscription(Node *node) {
+    SubscriptionMapType::iterator iter = subs_.find(node);
+    if( iter != subs_.end() ) {
+        return iter->second;
+    }
+
+    void *conn = node->get_conn();
+    if( !conn ) {
+        DEBUGINFO("subscriber get connection fail from " << node->simple_dump());
+        return NULL;
+    }
+
+    SubscriptionType *sub = new SubscriptionType;
+    sub->node = node;
+    sub->conn = conn;
+    subs_[node] = sub;
+    DEBUGINFO("subscriber open connection to " << node->simple_dump());
+    return sub;
+}
+
+void ShardedSubscriber::close_subscription(SubscriptionType *sub) {
+    if( !sub->channels.empty() ) {
+        cluster_->set_load_slots_asap();  // the node may be gone, its slots served by another
+    }
+    std::set<std::string>::iterator iter = sub->channels.begin();
+    for(; iter != sub->channels.end(); iter++) {
+        channels_[*iter] = NULL;  // pending, resubscribe later
+        dirty_ = true;
+    }
+    DEBUGINFO("subscriber close connection to " << sub->node->simple_dump());
+    subs_.erase(sub->node);
+    redisFree( (redisContext *)sub->conn );
+    delete sub;
+}
+
+int ShardedSubscriber::send_command(SubscriptionType *sub, const char *cmd, const std::vector<std::string> &channels) {
+    std::vector<const char *> argv;
+    std::vector<size_t> argvlen;
+
+    argv.push_back(cmd);
+    argvlen.push_back(strlen(cmd));
+    for(size_t i = 0; i < channels.size(); i++) {
+        argv.push_back(channels[i].c_str());
+        argvlen.push_back(channels[i].length());
+    }
+
+    redisContext *c = (redisContext *)sub->conn;
+    redisAppendCommandArgv(c, argv.size(), argv.data(), argvlen.data());
+
+    int done = 0;
+    do {
+        if( redisBufferWrite(c, &done)!=REDIS_OK ) {
+            DEBUGINFO("subscriber " << cmd << " error. " << c->errstr << "(" << c->err << ")");
+            return -1;
+        }
+    } while( !done );
+    return 0;
+}
+
+int ShardedSubscriber::subscribe(const std::string &channel) {
+    return subscribe(std::vector<std::string>(1, channel));
+}
+
+int ShardedSubscriber::subscribe(const std::vector<std::string> &channels) {
+    for(size_t i = 0; i < channels.size(); i++) {
+        if( channels_.find(channels[i]) == channels_.end() ) {
+            channels_[channels[i]] = NULL;
+            dirty_ = true;
+        }
+    }
+    return refresh();
+}
+
+int ShardedSubscriber::unsubscribe(const std::string &channel) {
+    return unsubscribe(std::vector<std::string>(1, channel));
+}
+
+int ShardedSubscriber::unsubscribe(const std::vector<std::string> &channels) {
+    std::map<Node *, std::vector<std::string> > groups;
+
+    for(size_t i = 0; i < channels.size(); i++) {
+        std::map<std::string, Node *>::iterator iter = channels_.find(channels[i]);
+        if( iter == channels_.end() ) {
+            continue;
+        }
+        if( iter->second ) {
+            groups[iter->second].push_back(channels[i]);
+        }
+        channels_.erase(iter);
+    }
+
+    int ret = 0;
+    std::map<Node *, std::vector<std::string> >::iterator itg = groups.begin();
+    for(; itg != groups.end(); itg++) {
+        SubscriptionType *sub = subs_[itg->first];
+        for(size_t i = 0; i < itg->second.size(); i++) {
+            sub->channels.erase(itg->second[i]);
+        }
+        if( sub->channels.empty() ) {
+            close_subscription(sub);
+        } else if( send_command(sub, "SUNSUBSCRIBE", itg->second)<0 ) {
+            close_subscription(sub);
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+int ShardedSubscriber::refresh() {
+    std::map<Node *, SlotGroupType> moving_from;
+    std::map<Node *, SlotGroupType> moving_to;
+
+    dirty_ = false;
+
+    std::map<std::string, Node *>::iterator iter = channels_.begin();
+    for(; iter != channels_.end(); iter++) {
+        int slot;
+        Node *owner = channel_owner(iter->first, slot);
+        if( !owner ) {
+            dirty_ = true;
+            continue;
+        }
+        if( owner == iter->second ) {
+            continue;
+        }
+        if( iter->second ) {
+            moving_from[iter->second][slot].push_back(iter->first);
+        }
+        moving_to[owner][slot].push_back(iter->first);
+    }
+
+    /* unsubscribe from the old owners, the commands are grouped by slot */
+
+    std::map<Node *, SlotGroupType>::iterator itn = moving_from.begin();
+    for(; itn != moving_from.end(); itn++) {
+        SubscriptionType *sub = subs_[itn->first];
+        for(SlotGroupType::iterator its = itn->second.begin(); its != itn->second.end(); its++) {
+            for(size_t i = 0; i < its->second.size(); i++) {
+                sub->channels.erase(its->second[i]);
+                channels_[its->second[i]] = NULL;
+            }
+        }
+        if( sub->channels.empty() ) {
+            close_subscription(sub);
+            continue;
+        }
+        for(SlotGroupType::iterator its = itn->second.begin(); its != itn->second.end(); its++) {
+            if( send_command(sub, "SUNSUBSCRIBE", its->second)<0 ) {
+                close_subscription(sub);
+                break;
+            }
+        }
+    }
+
+    /* subscribe at the new owners */
+
+    int ret = 0;
+    for(itn = moving_to.begin(); itn != moving_to.end(); itn++) {
+        SubscriptionType *sub = get_subscription(itn->first);
+        if( !sub ) {
+            dirty_ = true;
+            ret = -1;
+            continue;
+        }
+        for(SlotGroupType::iterator its = itn->second.begin(); its != itn->second.end(); its++) {
+            if( send_command(sub, "SSUBSCRIBE", its->second)<0 ) {
+                close_subscription(sub);
+                dirty_ = true;
+                ret = -1;
+                break;
             }
+            for(size_t i = 0; i < its->second.size(); i++) {
+                sub->channels.insert(its->second[i]);
+                channels_[its->second[i]] = sub->node;
+            }
+            DEBUGINFO("subscriber ssubscribe " << its->second.size() << " channels of slot "
+                      << its->first << " at " << sub->node->simple_dump());
         }
-        if( p2 )
-            p1 = p2+1;
-        else
-            break;
-    } while(1);
+    }
 
-    free( tmp );
-    return node_pool_.size();
+    return ret;
 }
 
-int Cluster::load_slots_cache() {
-
-    int start, end;
-    int count = 0;
-    redisReply *reply, *subr, *innr;
-    Node *node;
-    std::vector<Node *> node_seeds;
+int ShardedSubscriber::dispatch(SubscriptionType *sub, redisReply *reply) {
+    if( reply->type==REDIS_REPLY_ERROR ) {
+        /* MOVED for a slot which is not served by this node any more */
+        DEBUGINFO("subscriber error from " << sub->node->simple_dump() << ": " << reply->str);
+        cluster_->set_load_slots_asap();
+        dirty_ = true;
+        return 0;
+    }
 
-    if(pthread_spin_trylock(&load_slots_lock_) != 0) {
-        return 0;   // only one thread is allowed to process loading
+    if( reply->type!=REDIS_REPLY_ARRAY
+        || reply->elements<3
+        || reply->element[0]->type!=REDIS_REPLY_STRING
+        || reply->element[1]->type!=REDIS_REPLY_STRING ) {
+        return 0;
     }
 
-    DEBUGINFO("load_slots_cache loading start...");
+    const char *kind = reply->element[0]->str;
+    std::string channel(reply->element[1]->str, reply->element[1]->len);
 
-    {
-        LockGuard lg(np_lock_);
-        NodePoolType::iterator iter = node_pool_.begin();
-        for(; iter != node_pool_.end(); iter++) {
-            node_seeds.push_back(*iter);
+    if( !strcasecmp(kind, "smessage") && reply->element[2]->type==REDIS_REPLY_STRING ) {
+        if( callback_ ) {
+            callback_(channel, std::string(reply->element[2]->str, reply->element[2]->len), arg_);
         }
+        return 1;
     }
 
-    for(size_t node_idx = 0; node_idx < node_seeds.size(); node_idx++) {
-        node = node_seeds[node_idx];
+    if( !strcasecmp(kind, "sunsubscribe") && sub->channels.erase(channel)>0 ) {
+        /* not requested by us: the slot was migrated away from the node */
+        DEBUGINFO("subscriber channel " << channel << " unsubscribed by " << sub->node->simple_dump());
+        channels_[channel] = NULL;
+        cluster_->set_load_slots_asap();
+        dirty_ = true;
+    }
+    return 0;
+}
 
-        redisContext *c = (redisContext *)node->get_conn();
-        if( !c ) {
+int ShardedSubscriber::poll(int timeout_ms) {
+    std::vector<struct pollfd> fds;
+    std::vector<SubscriptionType *> polled;
+    int count = 0;
+
+    if( dirty_ ) {
+        refresh();
+    }
+
+    for(SubscriptionMapType::iterator iter = subs_.begin(); iter != subs_.end(); iter++) {
+        struct pollfd pfd;
+        pfd.fd = ((redisContext *)iter->second->conn)->fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        fds.push_back(pfd);
+        polled.push_back(iter->second);
+    }
+    if( fds.empty() ) {
+        return 0;
+    }
+
+    int ret = ::poll(fds.data(), fds.size(), timeout_ms);
+    if( ret<0 ) {
+        return errno==EINTR? 0: -1;
+    }
+
+    for(size_t i = 0; i < fds.size() && ret > 0; i++) {
+        if( fds[i].revents==0 ) {
             continue;
         }
+        SubscriptionType *sub = polled[i];
+        redisContext *c = (redisContext *)sub->conn;
+        void *reply = NULL;
 
-        reply = (redisReply *)redisCommand(c, "cluster slots");
-        if( !reply ) {
-            node->put_conn(c);
+        if( redisBufferRead(c)!=REDIS_OK ) {
+            DEBUGINFO("subscriber read error. " << c->errstr << "(" << c->err << ")");
+            close_subscription(sub);
             continue;
-        } else if( reply->type==REDIS_REPLY_ERROR ) {
+        }
+        for(;;) {
+            if( redisGetReplyFromReader(c, &reply)!=REDIS_OK ) {
+                close_subscription(sub);
+                break;
+            }
+            if( !reply ) {
+                /* every channel was unsubscribed by the node */
+                if( sub->channels.empty() ) {
+                    close_subscription(sub);
+                }
+                break;
+            }
+            count += dispatch(sub, (redisReply *)reply);
             freeReplyObject(reply);
-            node->put_conn(c);
-            continue;
         }
+    }
 
-        for(size_t i=0; i<reply->elements; i++) {
+    if( dirty_ ) {
+        refresh();
+    }
+    return count;
+}
 
-            subr = reply->element[i];
-            if( subr->elements<3
-                || subr->element[0]->type!=REDIS_REPLY_INTEGER
-                || subr->element[1]->type!=REDIS_REPLY_INTEGER
-                || subr->element[2]->type!=REDIS_REPLY_ARRAY )
-                continue;
+/**
+ * class BulkLoader
+ */
+static void *bulk_job_thread(void *arg) {
+    BulkLoader::JobType *job = (BulkLoader::JobType *)arg;
+    job->loader->run_job(job);
+    return NULL;
+}
 
-            start = subr->element[0]->integer;
-            end = subr->element[1]->integer;
-            innr = subr->element[2];
+BulkLoader::BulkLoader(Cluster *cluster, int conns_per_node, int max_inflight, size_t batch)
+    :cluster_(cluster),
+     conns_per_node_(conns_per_node>0? conns_per_node: 1),
+     max_inflight_(max_inflight>0? max_inflight: 1),
+     batch_(batch>0? batch: 1) {
+}
 
-            if( innr->elements<2
-                || innr->element[0]->type!=REDIS_REPLY_STRING
-                || innr->element[1]->type!=REDIS_REPLY_INTEGER )
-                continue;
+BulkLoader::~BulkLoader() {
+    for(size_t i = 0; i < pending_.size(); i++) {
+        delete pending_[i];
+    }
+    pending_.clear();
+}
 
-            Node *node_in_pool;
-            bool ret = add_node(innr->element[0]->str, innr->element[1]->integer, node_in_pool);
-            if(ret) {
-                DEBUGINFO("insert new node "<< node_in_pool->simple_dump()<< " from cluster slots map" );
-            }
+int BulkLoader::set(const std::string &key, const std::string &value) {
+    std::vector<std::string> commands(3);
+    commands[0] = "SET";
+    commands[1] = key;
+    commands[2] = value;
+    return add(commands);
+}
 
-            for(int jj=start; jj<=end; jj++)
-                slots_[jj] = node_in_pool;
+int BulkLoader::add(const std::vector<std::string> &commands) {
+    std::vector<const char *> argv;
+    std::vector<size_t> argvlen;
 
-            count += (end-start+1);
-        }//for i
+    if( commands.size()<2 ) {
+        return -1;
+    }
+    for( size_t i=0; i<commands.size(); i++ ) {
+        argv.push_back(commands[i].c_str());
+        argvlen.push_back(commands[i].length());
+    }
 
-        freeReplyObject(reply);
-        node->put_conn(c);
-        break;
+    char *cmd = NULL;
+    int len = redisFormatCommandArgv(&cmd, argv.size(), argv.data(), argvlen.data());
+    if( len<0 ) {
+        return -1;
+    }
 
-    }//for citer
+    EntryType *entry = new EntryType;
+    entry->cmd.assign(cmd, len);
+    entry->slot = cluster_->get_key_hash(commands[1]) % Cluster::HASH_SLOTS;
+    entry->target = NULL;
+    entry->asking = false;
+    free(cmd);
+    pending_.push_back(entry);
 
-    if( count>0 )  {
-        DEBUGINFO("load_slots_cache count " << count <<"("<< (count == HASH_SLOTS? "complete":"incomplete!")<<") from " << node->simple_dump());
-    } else {
-        DEBUGINFO("load_slots_cache fail from all startup node");
+    if( pending_.size()>=batch_ ) {
+        return flush();
     }
+    return 0;
+}
 
-    DEBUGINFO("load_slots_cache loading finished");
+/* the connection k of a bulk job is broken, what it has in flight is retried */
+static void bulk_drop_conn(BulkLoader::JobType *job, std::vector<redisContext *> &conns,
+                           std::vector<std::deque<BulkLoader::EntryType *> > &inflight, size_t k) {
+    DEBUGINFO("bulk load connection error. " << conns[k]->errstr << "(" << conns[k]->err << ")");
+    redisFree( conns[k] );
+    conns[k] = NULL;
+    for(size_t i = 0; i < inflight[k].size(); i++) {
+        BulkLoader::EntryType *entry = inflight[k][i];
+        if( entry ) {
+            entry->target = NULL;
+            entry->asking = false;
+            job->retries.push_back(entry);
+        }
+    }
+    inflight[k].clear();
+}
 
-    pthread_spin_unlock(&load_slots_lock_);
-    return count;
+static bool entry_slot_less(const BulkLoader::EntryType *l, const BulkLoader::EntryType *r) {
+    return l->slot < r->slot;
 }
 
-int Cluster::clear_slots_cache() {
-    slots_.clear();
-    slots_.resize(HASH_SLOTS);
-    for(size_t i = 0; i<slots_.size(); i++) {
-        slots_[i] = NULL;
+void BulkLoader::take_reply(JobType *job, EntryType *entry, redisReply *r) {
+    bool ask;
+    int slot, port;
+    std::string host;
+    if( r->type==REDIS_REPLY_ERROR && parse_redirect(r->str, ask, slot, host, port) ) {
+        Node *node_in_pool;
+        cluster_->add_node(host, port, node_in_pool);
+        if( !ask ) {
+            job->moved.push_back(std::make_pair(slot, node_in_pool));
+        }
+        entry->target = node_in_pool;
+        entry->asking = ask;
+        job->stat.redirects++;
+        job->retries.push_back(entry);
+    } else if( r->type==REDIS_REPLY_ERROR ) {
+        job->stat.errors++;
+        job->failed++;
+        delete entry;
+    } else {
+        job->stat.commands++;
+        delete entry;
     }
-    return 0;
 }
 
-Node *Cluster::get_random_node(const Node *last) {
+void BulkLoader::run_job(JobType *job) {
+    std::vector<redisContext *> conns;
+    uint64_t start = now_us();
 
-    struct timeval tp;
-    gettimeofday(&tp, NULL);
+    /* a ring of the job, the job threads are short lived */
+    UringType *uring = cluster_->io_backend_==Cluster::IO_URING? uring_create(): NULL;
 
-    LockGuard lg(np_lock_);
+    for(int i = 0; i < conns_per_node_; i++) {
+        redisContext *c = (redisContext *)job->node->get_conn();
+        if( c ) {
+            conns.push_back(c);
+        }
+    }
 
-    std::size_t len = node_pool_.size();
-    if( len==0 )
-        return NULL;
+    size_t window = max_inflight_ / (conns.size()>0? conns.size(): 1);
+    if( window==0 ) {
+        window = 1;
+    }
+    int timeout_ms = cluster_->timeout_>0? cluster_->timeout_ * 1000: -1;
 
-    NodePoolType::iterator iter = node_pool_.begin();
-    std::advance( iter, tp.tv_usec % len );//random position
-    for(size_t i = 0; i < len; i++,iter++) {
-        if(iter == node_pool_.end())
-            iter = node_pool_.begin();
-        DEBUGINFO("get_random_node try "<<(*iter)->simple_dump());
-        if(*iter != last) {
-            return *iter;
+    /**
+     * A sliding window per connection: replies are taken as they arrive and the window
+     * of the connection is refilled. NULL in flight stands for the reply to an ASKING.
+     */
+    std::vector<std::deque<EntryType *> > inflight(conns.size());
+    std::vector<std::string> outs(uring? conns.size(): 0);
+    std::vector<struct pollfd> fds;
+    std::vector<size_t> polled;
+    size_t idx = 0;
+    for(;;) {
+        bool sending = false;
+        for(size_t k = 0; k < conns.size(); k++) {
+            if( !conns[k] ) {
+                continue;
+            }
+            bool appended = false;
+            for(; inflight[k].size()<window && idx<job->entries.size(); idx++) {
+                EntryType *entry = job->entries[idx];
+                if( entry->asking ) {
+                    if( uring ) {
+                        outs[k].append(ASKING_CMD, sizeof(ASKING_CMD) - 1);
+                    } else {
+                        redisAppendFormattedCommand(conns[k], ASKING_CMD, sizeof(ASKING_CMD) - 1);
+                    }
+                    inflight[k].push_back(NULL);
+                }
+                if( uring ) {
+                    outs[k].append(entry->cmd);
+                } else {
+                    redisAppendFormattedCommand(conns[k], entry->cmd.data(), entry->cmd.size());
+                }
+                inflight[k].push_back(entry);
+                job->stat.bytes += entry->cmd.size();
+                appended = true;
+            }
+            if( appended && !uring && flush_output(conns[k])<0 ) {
+                bulk_drop_conn(job, conns, inflight, k);
+            }
+            sending = sending || appended;
+        }
+        if( uring && sending ) {
+            /* the refills of all connections in one submission */
+            uring_send_all(uring, conns, outs);
+            for(size_t k = 0; k < conns.size(); k++) {
+                outs[k].clear();
+                if( conns[k] && conns[k]->err ) {
+                    bulk_drop_conn(job, conns, inflight, k);
+                }
+            }
         }
-    }
 
-    return NULL;
-}
+        fds.clear();
+        polled.clear();
+        for(size_t k = 0; k < conns.size(); k++) {
+            if( conns[k] && !inflight[k].empty() ) {
+                struct pollfd pfd;
+                pfd.fd = conns[k]->fd;
+                pfd.events = POLLIN;
+                pfd.revents = 0;
+                fds.push_back(pfd);
+                polled.push_back(k);
+            }
+        }
+        if( fds.empty() ) {
+            if( idx<job->entries.size() ) {
+                /* node is not reachable, let the next round route them again */
+                for(; idx<job->entries.size(); idx++) {
+                    job->entries[idx]->target = NULL;
+                    job->retries.push_back(job->entries[idx]);
+                }
+            }
+            break;
+        }
 
-uint16_t Cluster::get_key_hash(const std::string &key) {
-    std::string::size_type pos1, pos2;
-    std::string hashing_key = key;
+        int ret = poll(fds.data(), fds.size(), timeout_ms);
+        if( ret<0 && errno==EINTR ) {
+            continue;
+        }
+        for(size_t i = 0; i < fds.size(); i++) {
+            size_t k = polled[i];
+            redisContext *c = conns[k];
+            if( ret==0 ) {
+                set_context_error(c, REDIS_ERR_IO, strerror(EAGAIN));
+                bulk_drop_conn(job, conns, inflight, k);
+                continue;
+            }
+            if( ret<0 ) {
+                set_context_error(c, REDIS_ERR_IO, strerror(errno));
+                bulk_drop_conn(job, conns, inflight, k);
+                continue;
+            }
+            if( fds[i].revents==0 ) {
+                continue;
+            }
 
-    pos1 = key.find("{");
-    if( pos1!=std::string::npos ) {
-        pos2 = key.find("}", pos1+1);
-        if((pos2!=std::string::npos) && (pos2 != pos1+1)) {
-            hashing_key = key.substr(pos1+1, (pos2-pos1)-1);
+            /* one read, then every reply it completed */
+            void *reply = NULL;
+            if( uring ) {
+                uring_exchange(uring, c, NULL, 0, 1, cluster_->timeout_, &reply);
+            } else if( redisBufferRead(c)==REDIS_OK ) {
+                redisGetReplyFromReader(c, &reply);
+            }
+            while( reply ) {
+                EntryType *entry = inflight[k].front();
+                inflight[k].pop_front();
+                if( entry ) {
+                    take_reply(job, entry, (redisReply *)reply);
+                }
+                freeReplyObject(reply);
+                reply = NULL;
+                if( inflight[k].empty() || redisGetReplyFromReader(c, &reply)!=REDIS_OK ) {
+                    break;
+                }
+            }
+            if( c->err || (!reply && c->reader->err) ) {
+                bulk_drop_conn(job, conns, inflight, k);
+            }
         }
     }
-    return crc16(hashing_key.c_str(), hashing_key.length());
-}
 
-redisReply* Cluster::redis_command_argv(const std::string& key, int argc, const char **argv, const size_t *argvlen) {
+    for(size_t k = 0; k < conns.size(); k++) {
+        if( conns[k] ) {
+            job->node->put_conn(conns[k]);
+        }
+    }
+    if( uring ) {
+        uring_destroy(uring);
+    }
+    job->stat.seconds = (now_us() - start) / 1000000.0;
+}
 
+int BulkLoader::flush() {
 #define MAX_TTL 5
 
-    int ttl = MAX_TTL;
-    Node *node = NULL;
-    redisContext *c = NULL;
-    redisReply *reply = NULL;
-    bool try_random_node = false;
-
-    set_error(E_OK);
+    int failed = 0;
 
-    if( load_slots_asap_ ) {
-        load_slots_asap_ = false;
-        load_slots_cache();
+    if( cluster_->take_load_slots_asap() ) {
+        cluster_->load_slots_cache();
     }
 
-    uint16_t hashing = get_key_hash(key);
-    const int slot = hashing % HASH_SLOTS;
-
-    while( ttl>0 ) {
-        ttl--;
-        specific_data().ttls = (MAX_TTL - ttl);
-        DEBUGINFO("ttl " << ttl);
+    for(int ttl = 0; ttl < MAX_TTL && !pending_.empty(); ttl++) {
+        std::map<Node *, JobType *> jobs;
 
-        if( try_random_node ) {
+        /* bucket by node */
 
-            try_random_node = false;
-            DEBUGINFO("try random node");
-            node = get_random_node(node);
+        for(size_t i = 0; i < pending_.size(); i++) {
+            EntryType *entry = pending_[i];
+            Node *node = entry->target? entry->target: cluster_->slots_[entry->slot];
             if( !node ) {
-                set_error(E_IO) << "try random node: no avaliable node";
-                return NULL;
+                node = cluster_->get_random_node(NULL);
             }
-            DEBUGINFO("slot " << slot << " use random " << node->simple_dump());
-        } else {//find slot
-
-            node = slots_[slot];
-            if( !node ) { //not hit
-                DEBUGINFO("slot "<<slot<<" don't have node, try connection from random node.");
-                try_random_node = true;//try random next ttl
+            if( !node ) {
+                failed++;
+                delete entry;
                 continue;
             }
-            DEBUGINFO("slot " << slot << " hit at " << node->simple_dump());
-        }
-
-        c = (redisContext*)node->get_conn();
-        if( !c ) {
-            DEBUGINFO("get connection fail from " << node->simple_dump());
-            try_random_node = true;//try random next ttl
-            continue;
+            JobType *&job = jobs[node];
+            if( !job ) {
+                job = new JobType;
+                job->loader = this;
+                job->node = node;
+                job->failed = 0;
+                job->stat.commands = job->stat.errors = job->stat.redirects = job->stat.bytes = 0;
+                job->stat.seconds = 0;
+            }
+            job->entries.push_back(entry);
         }
+        pending_.clear();
 
-        reply = (redisReply *)redisCommandArgv(c, argc, argv, argvlen);
-        if( !reply ) {//next ttl
-
-            DEBUGINFO("redisCommandArgv error. " << c->errstr << "(" << c->err << ")");
-            set_error(E_IO) << "redisCommandArgv error. " << c->errstr << "(" << c->err << ")";
-            node->put_conn(c);
-            try_random_node = true;//try random next ttl
-            continue;
-
-        } else if( reply->type==REDIS_REPLY_ERROR
-                   &&(!strncmp(reply->str,"MOVED",5) || !strcmp(reply->str,"ASK")) ) { //next ttl
-
-            char *p = reply->str, *s;
-            /*
-                     * [S] for pointer 's'
-                     * [P] for pointer 'p'
-                     */
-            s = strchr(p,' ');      /* MOVED[S]3999 127.0.0.1:6381 */
-            p = strchr(s+1,' ');    /* MOVED[S]3999[P]127.0.0.1:6381 */
-            *p = '\0';
+        /* the commands of a slot go together, and so do the redirections of a migrating one */
 
-            rcassert( slot == atoi(s+1) );
+        std::map<Node *, JobType *>::iterator iter = jobs.begin();
+        for(; iter != jobs.end(); iter++) {
+            std::stable_sort(iter->second->entries.begin(), iter->second->entries.end(), entry_slot_less);
+        }
 
-            s = strchr(p+1,':');    /* MOVED 3999[P]127.0.0.1[S]6381 */
-            *s = '\0';
+        /* one thread per node */
 
-            Node *node_in_pool;
-            bool ret = add_node(p+1, atoi(s+1), node_in_pool);
-            if(ret) {
-                DEBUGINFO("insert new node "<< node_in_pool->simple_dump()<< " from redirection" );
+        std::vector<pthread_t> tids;
+        for(iter = jobs.begin(); iter != jobs.end(); iter++) {
+            pthread_t tid;
+            if( pthread_create(&tid, NULL, bulk_job_thread, iter->second)==0 ) {
+                tids.push_back(tid);
             } else {
-                DEBUGINFO("redirect slot "<< slot <<" to " << node_in_pool->simple_dump());
+                run_job(iter->second);
             }
+        }
+        for(size_t i = 0; i < tids.size(); i++) {
+            pthread_join(tids[i], NULL);
+        }
 
-            slots_[slot] = node_in_pool;
-
-            load_slots_asap_ = true;//cluster nodes must have being changed, load slots cache as soon as possible.
-            freeReplyObject( reply );
-            node->put_conn(c);
-            continue;
-
+        for(iter = jobs.begin(); iter != jobs.end(); iter++) {
+            JobType *job = iter->second;
+            NodeStatType &stat = stats_[job->node];
+            stat.node = job->node->simple_dump();
+            stat.commands += job->stat.commands;
+            stat.errors += job->stat.errors;
+            stat.redirects += job->stat.redirects;
+            stat.bytes += job->stat.bytes;
+            stat.seconds += job->stat.seconds;
+            failed += job->failed;
+            for(size_t i = 0; i < job->moved.size(); i++) {
+                cluster_->set_slot_owner(job->moved[i].first, job->moved[i].second);
+            }
+            pending_.insert(pending_.end(), job->retries.begin(), job->retries.end());
+            delete job;
         }
-        node->put_conn(c);
-        return reply;
     }
 
-    set_error(E_TTL) << "max ttl fail";
-    return NULL;
+    failed += pending_.size();
+    for(size_t i = 0; i < pending_.size(); i++) {
+        delete pending_[i];
+    }
+    pending_.clear();
+    return failed;
 
 #undef MAX_TTL
 }
 
-Cluster::ThreadDataType &Cluster::specific_data() {
-    ThreadDataType *pd = (ThreadDataType *)pthread_getspecific(key_);
-    if(!pd) {
-        pd =  new ThreadDataType;
-        pd->err = E_OK;
-        pd->ttls  = 0;
-        rcassert(pd);
-        int ret = pthread_setspecific(key_, (void *)pd);
-        rcassert(ret == 0);
+std::vector<BulkLoader::NodeStatType> BulkLoader::stat() const {
+    std::vector<NodeStatType> v;
+    std::map<Node *, NodeStatType>::const_iterator iter = stats_.begin();
+    for(; iter != stats_.end(); iter++) {
+        v.push_back(iter->second);
     }
-    return *pd;
-};
-
-std::ostringstream& Cluster::set_error(ErrorE e) {
-    ThreadDataType &sd = specific_data();
-    sd.err = e;
-    sd.strerr.str("");
-    return sd.strerr;
+    return v;
 }
 
-int Cluster::err() {
-    return specific_data().err;
-}
-std::string Cluster::strerr() {
-    return specific_data().strerr.str();
-}
-int Cluster::ttls() {
-    return specific_data().ttls;
-}
-std::string Cluster::stat_dump() {
+std::string BulkLoader::stat_dump() const {
     std::ostringstream ss;
-
-    LockGuard lg(np_lock_);
-
-    ss<<"Cluster have "<<node_pool_.size() <<" nodes: ";
-
-    for(NodePoolType::iterator iter = node_pool_.begin(); iter != node_pool_.end(); iter++) {
-        ss<< "\r\n" <<(*iter)->stat_dump();
+    std::map<Node *, NodeStatType>::const_iterator iter = stats_.begin();
+    for(; iter != stats_.end(); iter++) {
+        const NodeStatType &st = iter->second;
+        ss<< st.node <<" commands: "<< st.commands
+          <<" errors: "<< st.errors
+          <<" redirects: "<< st.redirects
+          <<" bytes: "<< st.bytes
+          <<" seconds: "<< st.seconds
+          <<" cmd/s: "<< (uint64_t)(st.seconds>0? st.commands / st.seconds: 0)
+          <<" MB/s: "<< (st.seconds>0? st.bytes / st.seconds / 1048576: 0) << "\r\n";
     }
-    ss << "\r\n";
-
     return ss.str();
 }
 
@@ -571,12 +5058,40 @@ int Cluster::test_parse_startup(const char *startup) {
     return parse_startup( startup );
 }
 
-Cluster::NodePoolType & Cluster::get_startup_nodes() {
-    return node_pool_;
+Cluster::NodePoolType Cluster::get_startup_nodes() {
+    std::vector<Node *> nodes;
+    nodes_.nodes(nodes);
+    return NodePoolType(nodes.begin(), nodes.end());
 }
 int Cluster::test_key_hash(const std::string &key) {
     return get_key_hash(key);
 }
+void Cluster::test_sample_hot(const std::string &key) {
+    sample_hot(key, get_key_hash(key) % HASH_SLOTS);
+}
+Node *Cluster::test_slot_node(const std::string &key) {
+    return slots_[get_key_hash(key) % HASH_SLOTS];
+}
+size_t Cluster::test_thread_stats() {
+    size_t n = 0;
+    ThreadStatType *ts = __atomic_load_n(&thread_stats_, __ATOMIC_ACQUIRE);
+    for(; ts; ts = ts->next) {
+        n++;
+    }
+    return n;
+}
+
+void Cluster::test_hold_shared_lock() {
+    if( shared_ ) {
+        shared_lock(&shared_->header);
+    }
+}
+bool Cluster::test_compress(const std::string &in, std::string &out) {
+    return compress_value(in.data(), in.length(), out);
+}
+bool Cluster::test_decompress(const std::string &in, std::string &out) {
+    return decompress_value(in.data(), in.length(), out);
+}
 
 }//namespace cluster
 }//namespace redis
@@ -21,9 +21,12 @@
 #include <vector>
 #include <list>
 #include <set>
+#include <map>
 #include <sstream>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <sys/types.h>
 
 
 struct redisReply;
@@ -31,8 +34,62 @@ struct redisReply;
 namespace redis {
 namespace cluster {
 
+/**
+ * Latency histogram with log-linear buckets, 8 sub-buckets per power of two,
+ * so any recorded value is reported with at most 12.5% error.
+ * Values are in microseconds. record() may be called by many threads concurrently.
+ */
+class LatencyHistogram {
+public:
+    const static int SUB_BUCKET_BITS = 3;
+    const static int BUCKETS = 16 + (64 - 4) * (1 << SUB_BUCKET_BITS);
+
+    LatencyHistogram() { reset(); }
+
+    void record(uint64_t value) {
+        __atomic_fetch_add(&counts_[bucket_of(value)], 1, __ATOMIC_RELAXED);
+    }
+    /* record() for a histogram with a single writer, no atomic instruction */
+    void add(uint64_t value) {
+        counts_[bucket_of(value)]++;
+    }
+    uint64_t count() const;
+    /* p in [0, 1], return the upper bound of the bucket where the percentile falls */
+    uint64_t percentile(double p) const;
+    void merge(const LatencyHistogram &other);
+    void reset();
+
+    static int bucket_of(uint64_t value) {
+        if( value<16 )
+            return (int)value;
+        int e = 63 - __builtin_clzll(value);
+        int sub = (int)(value >> (e - SUB_BUCKET_BITS)) & ((1 << SUB_BUCKET_BITS) - 1);
+        return 16 + (e - 4) * (1 << SUB_BUCKET_BITS) + sub;
+    }
+    static uint64_t bucket_upper(int bucket);
+
+private:
+    uint64_t counts_[BUCKETS];
+};
+
 class Node {
 public:
+    /**
+     * Options of new connections, all zero for the hiredis defaults.
+     * With buffer sizes or a source address the socket is made and connected here
+     * (so they are set before connecting) and handed to hiredis with redisConnectFd().
+     */
+    typedef struct {
+        int          keepalive_s;       // TCP keepalive idle time, probes every keepalive_s/3; 0 for off
+        int          rcvbuf;            // SO_RCVBUF bytes, 0 for the system default
+        int          sndbuf;            // SO_SNDBUF bytes, 0 for the system default
+        int          busy_poll_us;      // SO_BUSY_POLL, 0 for off
+        bool         delay;             // keep Nagle's algorithm, i.e. no TCP_NODELAY
+        bool         quickack;          // TCP_QUICKACK, re-armed every time a pooled connection is taken
+        char         source_addr[64];   // numeric address to bind before connecting, empty for any
+        size_t       reader_maxbuf;     // idle reader buffer above it is freed; 0 for the hiredis default, (size_t)-1 never
+    } ConnOptionsType;
+
     Node(const std::string& host, unsigned int port, unsigned int timeout = 0);
     ~Node();
 
@@ -62,15 +119,77 @@ public:
     }
     std::string simple_dump() const;
     std::string stat_dump();
+    const std::string &host() const { return host_; }
+    unsigned int port() const { return port_; }
+    const std::string &id() const;                   // cluster node ID, empty if not known yet, set once
+    size_t index() const { return index_; }          // position in the registry, dense from 0
+
+    /**
+     * Mark the node as a replica so that it serves reads of its master's slots:
+     * READONLY is sent on a connection when it is checked out without it,
+     * pooled connections opened before included.
+     */
+    void set_readonly(bool readonly) { __atomic_store_n(&readonly_, readonly, __ATOMIC_RELEASE); }
+
+    /**
+     * Connect over the unix domain socket at path instead of TCP, the node keeps its
+     * host:port identity. Falls back to TCP when the socket can't be connected.
+     * Empty for TCP only (default). Set before the node is used by other threads.
+     */
+    void set_unix_socket(const std::string &path) { unix_socket_ = path; }
+    const std::string &unix_socket() const { return unix_socket_; }
+
+    /* applied to the connections made from now on, set before the node is used by other threads */
+    void set_conn_options(const ConnOptionsType &options) { conn_options_ = options; }
+    const ConnOptionsType &conn_options() const { return conn_options_; }
+
+    /**
+     * Backpressure: at most max_inflight requests run on the node at the same time,
+     * at most max_waiting requests wait for their turn (no longer than the node's timeout),
+     * the others fail fast. max_inflight 0 for unlimited.
+     */
+    void set_limits(unsigned int max_inflight, unsigned int max_waiting);
+
+    /**
+     * @return
+     *   1 - got a request slot, call release() when done
+     *   0 - unlimited, nothing to release
+     *  <0 - overload
+     */
+    int acquire();
+    void release();
+    void queue_stat(unsigned int &inflight, unsigned int &waiting, uint64_t &overload);
 
 private:
+    friend class NodeRegistry;
+
+    void *connect(bool unix_socket);
+    bool send_readonly(void *conn);
+    int open_socket();
+    void set_socket_options(int fd, bool tcp);
+
     std::string  host_;
     unsigned int port_;
+    std::string  unix_socket_;
+    ConnOptionsType conn_options_;
+    std::string *id_;           // set once under the registry's lock, never changed after
+    size_t       index_;
     unsigned int timeout_;
+    bool         readonly_;
 
     std::list<void *>  connections_;
+    std::vector<char>  readonly_fds_;   // by fd of the connections made here, READONLY was sent
     pthread_spinlock_t lock_;
 
+    unsigned int       max_inflight_;
+    unsigned int       max_waiting_;
+    unsigned int       inflight_;
+    unsigned int       waiting_;
+    uint64_t           overload_count_;
+    uint64_t           wait_count_;
+    pthread_mutex_t    limit_lock_;
+    pthread_cond_t     limit_cond_;
+
     /* for statistic purpose begin */
     uint64_t conn_get_count_;
     uint64_t conn_reuse_count_;
@@ -79,6 +198,76 @@ private:
 };
 
 
+/**
+ * Registry of the nodes of a cluster, indexed by host:port and by cluster node ID.
+ *
+ * Readers work on an immutable snapshot published through an atomic pointer,
+ * without any lock or allocation. Writers (a new node or a newly learned ID) copy
+ * the snapshot under a spinlock and publish the copy; a reload brackets its changes
+ * with begin()/commit() so they are published once. Readers are not counted, so a
+ * replaced snapshot is kept until the registry is destroyed: nodes are never removed
+ * and a reload publishes once, there are few of them.
+ */
+class NodeRegistry {
+public:
+    NodeRegistry();
+    ~NodeRegistry();
+
+    Node *find(const char *host, size_t host_len, unsigned int port) const;
+    Node *find_id(const char *id, size_t id_len) const;
+
+    /**
+     * Add a node if there isn't one with the same host:port, the node is created with new Node(host, port, timeout).
+     *
+     * @return
+     *  true  - added, rpnode is the new node
+     *  false - existed, rpnode is the node in registry
+     */
+    bool add(const char *host, size_t host_len, unsigned int port, unsigned int timeout, Node *&rpnode);
+    /* intern the cluster node ID of node, the first ID learned is kept */
+    void set_id(Node *node, const char *id, size_t id_len);
+
+    /**
+     * Batch the add() and set_id() of this thread into one copy and one publish at
+     * commit(). Writers of other threads wait meanwhile, readers see the snapshot
+     * before begin() until commit().
+     */
+    void begin();
+    void commit();
+
+    size_t size() const;
+    /* O(1) random pick, returns a node other than exclude if there is one */
+    Node *random(const Node *exclude) const;
+    void nodes(std::vector<Node *> &out) const;
+
+private:
+    typedef struct {
+        std::vector<Node *> nodes;      // in order of insertion
+        std::vector<Node *> by_addr;    // open addressing on host:port, power of 2 sized
+        std::vector<Node *> by_id;      // open addressing on node ID, power of 2 sized
+    } SnapshotType;
+
+    NodeRegistry(const NodeRegistry &);
+    NodeRegistry& operator=(const NodeRegistry &);
+
+    const SnapshotType *load() const {
+        return __atomic_load_n(&snapshot_, __ATOMIC_ACQUIRE);
+    }
+    bool in_batch() const;
+    void publish(SnapshotType *snapshot);
+    static Node *lookup(const SnapshotType *snap, const char *host, size_t host_len, unsigned int port);
+    static void insert(SnapshotType *snapshot, Node *node);
+    static void index_id(SnapshotType *snapshot, Node *node);
+    static void rebuild_index(SnapshotType *snapshot);
+
+    SnapshotType               *snapshot_;
+    SnapshotType               *batch_;         // the copy changed between begin() and commit()
+    pthread_t                   batch_owner_;
+    bool                        batch_dirty_;
+    std::vector<SnapshotType *> retired_;       // replaced snapshots, readers may still be on them
+    pthread_spinlock_t          lock_;      // for writers
+};
+
 struct CompareNodeFunc {
     bool operator()(const Node* l, const Node* r) const {
         return (*l) < (*r);
@@ -96,14 +285,158 @@ public:
         E_SLOT_MISSED = 2,
         E_IO = 3,
         E_TTL = 4,
-        E_OTHERS = 5
+        E_OTHERS = 5,
+        E_OVERLOAD = 6
     };
 
+    enum IoBackendE {
+        IO_BLOCKING = 0,    // hiredis blocking calls, one write and at least one read syscall per request
+        IO_URING = 1        // io_uring, experimental, needs the library configured with --enable-io-uring
+    };
+
+    /**
+     * Hedged reads: if the master has not replied a read-only command within
+     * the given percentile of observed read latency, the same request is sent to
+     * a replica of the slot, the first reply wins and the other connection is dropped.
+     */
+    typedef struct {
+        bool         enabled;
+        double       percentile;      // hedge delay is this percentile of read latency, e.g. 0.95
+        unsigned int min_delay_us;    // lower bound of the hedge delay
+        unsigned int max_delay_us;    // upper bound of the hedge delay
+        double       max_ratio;       // at most this fraction of reads are hedged, e.g. 0.05
+    } HedgePolicyType;
+
+    typedef struct {
+        uint64_t reads;               // read-only commands seen while hedging is enabled
+        uint64_t hedged;              // requests sent to a replica
+        uint64_t replica_wins;        // hedged requests answered first by the replica
+        uint64_t throttled;           // hedges skipped because of max_ratio
+        uint64_t delay_us;            // current hedge delay
+    } HedgeStatType;
+
+    typedef struct {
+        std::string  key;
+        int          slot;
+        uint64_t     count;           // estimated requests, scaled by the sampling rate
+        Node        *node;            // owner of the slot, NULL if unknown
+    } HotKeyType;
+
+    typedef struct {
+        int          slot;
+        uint64_t     count;           // estimated requests, scaled by the sampling rate
+        Node        *node;            // owner of the slot, NULL if unknown
+    } HotSlotType;
+
+    typedef struct {
+        uint64_t     count;
+        uint64_t     p50;             // microseconds
+        uint64_t     p99;
+        uint64_t     p999;
+    } LatencySummaryType;
+
     typedef struct {
-        ErrorE             err;
-        std::ostringstream strerr;
-        int                ttls; //TTLs used by last call of run()
-    } ThreadDataType;
+        Node               *node;
+        LatencySummaryType  connect;  // new connections only
+        LatencySummaryType  queue;    // waiting for the node's in-flight limit, only when limited
+        LatencySummaryType  rtt;      // request sent to reply read, per attempt
+    } NodeLatencyType;
+
+    typedef struct {
+        std::string         command;  // upper case
+        LatencySummaryType  total;    // whole run(), retries and redirects included
+    } CommandLatencyType;
+
+    /**
+     * Counters since the cluster was created, summed over all threads.
+     */
+    typedef struct {
+        uint64_t requests;                    // calls of run()
+        uint64_t errors[E_OVERLOAD + 1];      // failed calls by ErrorE, errors[E_OK] is unused
+        uint64_t attempts;                    // TTLs used, each is a request sent or tried to a node
+        uint64_t moved;                       // MOVED redirects
+        uint64_t ask;                         // ASK redirects
+        uint64_t reloads;                     // slots cache loads
+        uint64_t connections;                 // new connections
+        uint64_t connect_errors;
+        uint64_t bytes_out;                   // RESP encoded requests
+        uint64_t bytes_in;                    // RESP encoded replies
+    } MetricsType;
+
+    /**
+     * Tracing, times are CLOCK_MONOTONIC microseconds. command and reply are only valid in the hook.
+     */
+    typedef struct {
+        const Node        *node;        // node of the attempt, the new owner for on_redirect, the seed for on_topology_reload
+        int                slot;        // -1 if not related to one slot
+        const char        *command;     // not terminated, NULL for on_topology_reload
+        size_t             command_len;
+        int                attempt;     // 1 based TTL count within the request
+        uint64_t           start_us;
+        uint64_t           elapsed_us;  // 0 for before_send and on_redirect
+        const redisReply  *reply;       // after_reply only, NULL on I/O error, always NULL for get_into() and the streaming calls
+        int                err;         // after_reply only, E_IO if the attempt failed on the connection, else E_OK
+        int                loaded_slots;// on_topology_reload only
+    } TraceEventType;
+
+    typedef void (*TraceHook)(const TraceEventType &event, void *arg);
+
+    /**
+     * Any hook may be NULL. Hooks are called in the requesting thread and must not call back into the cluster.
+     */
+    typedef struct {
+        TraceHook    before_send;       // request is about to be written to node
+        TraceHook    after_reply;       // reply read, or failed, elapsed is the round trip
+        TraceHook    on_redirect;       // MOVED or ASK
+        TraceHook    on_reconnect;      // a new connection was opened, elapsed is the connect time
+        TraceHook    on_topology_reload;// slots cache loaded, elapsed is the load time
+        void        *arg;
+    } TraceHooksType;
+
+    /**
+     * A request slower than the slow log threshold, as the client saw it.
+     * Phases are summed over all attempts of the request.
+     */
+    typedef struct {
+        uint64_t     id;              // increasing, gaps if entries were overwritten
+        uint64_t     timestamp_us;    // wall clock when the request started
+        uint64_t     total_us;
+        uint64_t     connect_us;
+        uint64_t     queue_us;
+        uint64_t     rtt_us;
+        int          slot;
+        int          ttls;
+        ErrorE       err;
+        char         node[64];        // host:port of the last attempt, empty if none
+        char         command[160];    // command and arguments, each argument truncated
+    } SlowLogEntryType;
+
+    /**
+     * One request of a capture file, see start_capture().
+     */
+    typedef struct {
+        uint64_t                 timestamp_us;  // wall clock when the request started
+        uint32_t                 thread;        // capturing thread, numbered from 0 by first request
+        uint32_t                 latency_us;
+        uint32_t                 reply_size;    // bytes of the reply in RESP, 0 if the request failed
+        ErrorE                   err;
+        std::vector<std::string> commands;
+    } CaptureRecordType;
+
+    /**
+     * Error state of the last call of run() in the calling thread.
+     * It is kept in a thread local POD and only formatted into text by strerr(),
+     * a successful call only resets err.
+     */
+    typedef struct {
+        ErrorE       err;
+        int          ttls;            // TTLs used by last call of run()
+        const char  *what;            // static description
+        int          slot;            // -1 if not related to a slot
+        int          code;            // hiredis error code or errno, 0 if none
+        char         node[64];        // host:port, empty if not related to a node
+        char         detail[128];     // e.g. hiredis errstr or command name, may be empty
+    } ErrorStateType;
 
     Cluster(unsigned int timeout = 0); // timeout: seconds waiting for when connecting to and requsting redis servers
     virtual ~Cluster();
@@ -122,6 +455,29 @@ public:
      */
     int setup(const char *startup, bool lazy);
 
+    /**
+     * Topology snapshot for warm starts, set before setup().
+     * Every successful load of the slots cache saves the slot map and the nodes to path
+     * (a fixed layout versioned file, replaced atomically by rename).
+     * setup() routes with the saved map right away if the file is valid, and checks it
+     * against CLUSTER SLOTS in a background thread instead of blocking on the network.
+     */
+    void set_topology_file(const std::string &path);
+
+    /**
+     * Share the slot map with the other processes of the host using the same name,
+     * e.g. pre-forked workers: it lives in the POSIX shared memory segment name ("/myapp_slots")
+     * and is guarded by a seqlock. A reload or a MOVED learned by any process is adopted
+     * by the others on their next request, and of the reloads asked for at the same time
+     * only one per host is done. Set before setup(), which adopts a published map
+     * instead of loading one.
+     *
+     * @return
+     *   0 - success
+     *  <0 - the segment can't be opened, or it was made by an incompatible version
+     */
+    int set_shared_topology(const std::string &name);
+
     /**
      * Caller should call freeReplyObject to free reply.
      *
@@ -131,24 +487,259 @@ public:
      *             get the last error message with function err() & strerr()
      */
     redisReply* run(const std::vector<std::string> &commands);
+
+    typedef struct {
+        char   *buf;      // caller owned
+        size_t  cap;
+        size_t  len;      // set to the length of the value
+        int     ret;      // set like get_into() returns
+    } GetIntoType;
+
+    /**
+     * GET key into caller owned memory: the reply header is parsed off the socket and
+     * the value is read straight into buf, without the hiredis reader and redisReply.
+     * Redirections are followed like run() does. A compressed value (see set_compression())
+     * is decompressed into buf, which costs one more copy.
+     *
+     * @return
+     *   1 - found, the value is buf[0, len)
+     *   0 - key not found
+     *  -1 - error, including error replies, see err() & strerr()
+     *  -2 - the value doesn't fit in cap, len is the size needed, buf is clobbered
+     */
+    int get_into(const std::string &key, char *buf, size_t cap, size_t &len);
+    /**
+     * Pipelined get_into() of many keys: the GETs of the keys owned by the same node are
+     * sent in one write, values[i] receives keys[i]. Keys redirected by the cluster are
+     * fetched again one by one.
+     *
+     * @return number of keys whose ret is -1
+     */
+    int get_into(const std::vector<std::string> &keys, std::vector<GetIntoType> &values);
+
+    /* up to cap bytes of the value from offset into buf, returns the count, <=0 to abort */
+    typedef ssize_t (*ChunkSource)(char *buf, size_t cap, size_t offset, void *arg);
+    /* the next len bytes of the value, at offset, false to stop reading */
+    typedef bool (*ChunkSink)(const char *chunk, size_t len, size_t offset, void *arg);
+
+    /**
+     * Streaming write of a value of len bytes: commands are the command and the arguments
+     * before the value, which is sent as the last argument, e.g. {"SET", key} or {"HSET", key, field}.
+     * The value is sent to the socket chunk by chunk as source produces it, so the memory
+     * used stays at one chunk whatever len is. If the request is redirected, source is
+     * asked for the value again from offset 0. Compression rules don't apply.
+     * The reply must be a status or an integer.
+     *
+     * @return
+     *   0 - success
+     *  -1 - error, including error replies and an aborted source, see err() & strerr()
+     */
+    int write_stream(const std::vector<std::string> &commands, size_t len, ChunkSource source, void *arg,
+                     size_t chunk = 64 * 1024);
+    /**
+     * Streaming read: the bulk string reply of commands (GET, HGET, GETRANGE ...) is read
+     * off the socket chunk by chunk into sink. Stopping early drops the connection.
+     * Compressed values are handed over as stored.
+     *
+     * @return
+     *   1 - found, the whole value went to sink
+     *   0 - nil reply
+     *  -1 - error, including error replies and a stopped sink, see err() & strerr()
+     */
+    int read_stream(const std::vector<std::string> &commands, ChunkSink sink, void *arg, size_t chunk = 64 * 1024);
+    /**
+     * Errors are kept per thread, they describe the last run() of the calling thread.
+     */
     int err();
     std::string strerr();
     int ttls();               /* return number of ttls used by last run() */
+    const ErrorStateType &error_state();
     std::string stat_dump();
 
+    /**
+     * Per-node backpressure, see Node::set_limits(), applied to current and future nodes.
+     * When the wait queue of a node is full run() fails with E_OVERLOAD.
+     */
+    void set_node_limits(unsigned int max_inflight, unsigned int max_waiting);
+
+    /**
+     * Connect to co-located nodes over unix domain sockets, routing stays the same.
+     * add_unix_socket() maps one host:port to a socket path. set_local_unix_socket() maps
+     * every node on an address of this host (any interface, see getifaddrs(), or loopback)
+     * to pattern, where "%d" stands for the port, e.g. "/var/run/redis/redis-%d.sock".
+     * Explicit mappings win. Applied to current and future nodes, must be done before the
+     * cluster is used by other threads.
+     */
+    void add_unix_socket(const std::string &host, int port, const std::string &path);
+    /* <0 if the local addresses can't be listed */
+    int set_local_unix_socket(const std::string &pattern);
+
+    /**
+     * Options of the connections to every node, current and future, see Node::ConnOptionsType.
+     * Pooled connections keep the options they were made with.
+     * Must be set before the cluster is used by other threads.
+     */
+    void set_conn_options(const Node::ConnOptionsType &options);
+
+    /**
+     * Transport of run() and BulkLoader requests, IO_BLOCKING by default.
+     * With IO_URING every thread gets its own ring with a registered receive buffer:
+     * the send and the first receive of a request go in one submission, and the
+     * pipelines of a BulkLoader job are sent with one submission for all connections.
+     * A thread whose ring can't be set up keeps using blocking calls.
+     * Must be set before the cluster is used by other threads.
+     * IO_URING is experimental: it is not built unless configured with --enable-io-uring,
+     * and it has not been run against the real liburing in CI yet.
+     *
+     * @return
+     *   0 - success
+     *  <0 - io_uring not built in or refused by the kernel, the backend is unchanged
+     */
+    int set_io_backend(IoBackendE backend);
+    IoBackendE io_backend() const { return io_backend_; }
+
+    /**
+     * Hedging is off by default, set policy.enabled to turn it on.
+     * Replicas are learned from CLUSTER SLOTS when the slots cache is loaded.
+     */
+    void set_hedge_policy(const HedgePolicyType &policy);
+    HedgeStatType hedge_stat();
+
+    /**
+     * Coalesce identical concurrent read-only requests (same command and arguments):
+     * only the first one goes to the network, the others wait for it and
+     * get their own copy of its reply (or its error).
+     * Off by default.
+     */
+    void set_coalescing(bool enable) { coalescing_ = enable; }
+
+    /**
+     * Transparent value compression (needs the library built with lz4).
+     * Values longer than threshold in the configured argument positions are
+     * compressed and tagged with a small header; string replies of the configured
+     * read commands are decompressed. Untagged (legacy) values pass through unchanged.
+     * Default rules cover SET/SETEX/SETNX/GETSET/MSET/HSET/HMSET and GET/MGET/HGET/HMGET/HVALS/HGETALL.
+     * Rules must be set up before the cluster is used by other threads.
+     *
+     * @return
+     *   0 - success
+     *  <0 - compression not available
+     */
+    int set_compression(size_t threshold);
+    /* compress arguments first_arg, first_arg+step, ... of cmd; step 0 for only one argument */
+    void add_compress_rule(const std::string &cmd, int first_arg, int step);
+    /* decompress the string replies of cmd */
+    void add_decompress_rule(const std::string &cmd);
+
+    /**
+     * Hot key and hot slot detection: one of every rate requests is sampled into
+     * per-thread count-min sketches, slot counters and a small top-K, merged when queried.
+     * rate 0 turns sampling off (default). Top entries are shown by stat_dump() too.
+     * May be changed while other threads use the cluster.
+     */
+    void set_hot_sampling(unsigned int rate);
+    void hot_keys(std::vector<HotKeyType> &keys, size_t n);
+    void hot_slots(std::vector<HotSlotType> &slots, size_t n);
+    void reset_hot_stat();
+
+    /**
+     * Latency histograms, always recorded. Every thread records into its own
+     * histograms (per node and per command), they are merged when read here
+     * or by stat_dump(), which shows them as count/p50/p99/p999 in microseconds.
+     */
+    void node_latency(std::vector<NodeLatencyType> &out);
+    void command_latency(std::vector<CommandLatencyType> &out);
+    void reset_latency();
+
+    /**
+     * Counters are kept per thread with relaxed atomics and summed here
+     * without taking any lock, scraping never blocks requests.
+     */
+    void metrics(MetricsType &out);
+    /* Prometheus text exposition format, names are prefixed with prefix_ */
+    std::string metrics_prometheus(const std::string &prefix = "redis_cluster");
+
+    /**
+     * Install (or remove with NULL) tracing hooks, the hooks are copied.
+     * Must be done before the cluster is used by other threads.
+     * Without hooks the cost is one predictable branch per hook point,
+     * none at all when the library is built with -DNO_TRACE_HOOKS.
+     */
+    void set_trace_hooks(const TraceHooksType *hooks);
+
+    /**
+     * Client side slow log: requests taking at least threshold_us are kept in a
+     * lock-free ring of the last capacity entries. threshold_us 0 turns it off (default).
+     * Must be set before the cluster is used by other threads.
+     */
+    void set_slow_log(uint64_t threshold_us, size_t capacity = 128);
+    /* newest first, at most n entries (0 for all) */
+    void slow_log(std::vector<SlowLogEntryType> &out, size_t n = 0);
+    std::string slow_log_dump(size_t n = 0);
+
+    /**
+     * Traffic capture: every request of run() is appended to the file at path as a compact
+     * binary record, the arguments are kept whole. Every thread fills its own buffer of
+     * buffer_size bytes, written out with one write() when full and by stop_capture(),
+     * so requests never wait for each other. Records of different threads are not in time order.
+     * May be started and stopped while other threads use the cluster.
+     *
+     * @return
+     *   0 - success
+     *  <0 - the file can't be created, or capture is running already
+     */
+    int start_capture(const std::string &path, size_t buffer_size = 1 << 20);
+    void stop_capture();
+
+    /**
+     * Read the next record of a capture file, from a file or a pipe. header_read is false
+     * before the first call on in, the file header is read and checked then.
+     *
+     * @return
+     *   1 - got a record
+     *   0 - end of file
+     *  <0 - not a capture file, or truncated
+     */
+    static int read_capture(FILE *in, CaptureRecordType &rec, bool &header_read);
+
 public:/* for unittest */
     int test_parse_startup(const char *startup);
-    NodePoolType& get_startup_nodes();
+    NodePoolType get_startup_nodes();
     int test_key_hash(const std::string &key);
+    void test_sample_hot(const std::string &key);
+    Node *test_slot_node(const std::string &key);
+    void test_record_latency(const std::string &cmd, uint64_t total) { record_command_latency(cmd, total); }
+    static bool test_compress(const std::string &in, std::string &out);
+    static bool test_decompress(const std::string &in, std::string &out);
+    /* take the writers' lock of the shared map and never release it, as a writer dying mid-write */
+    void test_hold_shared_lock();
+    /* blocks in the per-thread statistic list */
+    size_t test_thread_stats();
 
 private:
+    friend class ShardedSubscriber;
+    friend class BulkLoader;
+
     bool add_node(const std::string &host, int port, Node *&rpnode);
+    bool add_node(const char *host, size_t host_len, int port, Node *&rpnode);
     int parse_startup(const char *startup);
+    void apply_unix_socket(Node *node);
     int load_slots_cache();
     int clear_slots_cache();
+    /* return number of slots loaded from the topology file, 0 if none */
+    int load_topology_file();
+    void save_topology_file();
+    static void *validate_topology(void *arg);
+
+    struct SharedTopologyType;
+    void publish_shared_map();
+    void publish_shared_slot(int slot, Node *node);
+    /* false if the shared map can't be read now or was left torn by a dead writer */
+    bool adopt_shared_map();
+    bool claim_shared_reload();
     Node *get_random_node(const Node *last);
-    inline ThreadDataType &specific_data();
-    inline std::ostringstream& set_error(ErrorE e);
+    void set_error(ErrorE e, const char *what, const Node *node = NULL, int slot = -1,
+                   int code = 0, const char *detail = NULL, size_t detail_len = (size_t)-1);
 
     /**
      *  Support hash tag, which means if there is a substring between {} bracket in a key, only what is inside the string is hashed.
@@ -159,23 +750,352 @@ private:
     /**
      *  Agent for connecting and run redisCommandArgv.
      *  Max ttl(default 5) retries or redirects.
+     *  With hedge (a read-only command under an enabled hedge policy) the request may be
+     *  hedged to the slot's replica, see hedged_command_argv().
      *
      * @return
      *  not NULL - success, return the redisReply object. Caller should call freeReplyObject to free reply object.
      *  NULL     - error
      */
-    redisReply* redis_command_argv(const std::string& key, int argc, const char **argv, const size_t *argvlen);
+    redisReply* redis_command_argv(const std::string& key, int argc, const char **argv, const size_t *argvlen,
+                                   bool hedge = false);
+
+    /**
+     *  One round trip on conn, through the io backend of this thread. With asking
+     *  the request is preceded by ASKING, whose reply is dropped.
+     */
+    redisReply* command_argv(void *conn, bool asking, int argc, const char **argv, const size_t *argvlen);
+
+    /**
+     *  Send the request on conn, and if no reply comes within the hedge delay, send it to
+     *  the slot's replica as well. The connection which loses the race is freed and set to NULL.
+     */
+    redisReply* hedged_command_argv(int slot, Node *node, void *&conn, int argc, const char **argv, const size_t *argvlen);
+    bool hedge_allowed();
+
+    /**
+     *  Singleflight in front of redis_command_argv(), identical in-flight requests share one round trip.
+     */
+    redisReply* coalesced_command_argv(const std::string& key, int argc, const char **argv, const size_t *argvlen,
+                                       bool hedge);
+
+    /* a round trip on conn (preceded by ASKING if asking), returns one of RAW_* */
+    typedef int (*RawExchange)(void *conn, bool asking, std::string &redirect, void *arg);
+
+    /**
+     *  Routing of the requests whose reply is not read by hiredis: like redis_command_argv(),
+     *  but exchange() does the round trip on the connection. A redirection comes back as the
+     *  MOVED/ASK error line in redirect. 0 when a reply was consumed, <0 on error (set for err()).
+     */
+    int raw_command(const std::string &key, const char *cmd, RawExchange exchange, void *arg);
+    /* learn a MOVED/ASK error line (without '-'), false if it is not one */
+    bool follow_redirect(const std::string &line, bool &ask, Node *&target);
+    /* a MOVED learned: node owns slot now, and the slots are reloaded soon */
+    void set_slot_owner(int slot, Node *node);
+
+    /* load_slots_asap_ is set by any thread, and taken by the one that reloads */
+    void set_load_slots_asap() {
+        __atomic_store_n(&load_slots_asap_, true, __ATOMIC_RELAXED);
+    }
+    bool take_load_slots_asap() {
+        return __atomic_load_n(&load_slots_asap_, __ATOMIC_RELAXED)
+               && __atomic_exchange_n(&load_slots_asap_, false, __ATOMIC_RELAXED);
+    }
+
+    void sample_hot(const std::string &key, int slot);
+
+    typedef struct {
+        LatencyHistogram connect;
+        LatencyHistogram queue;
+        LatencyHistogram rtt;
+    } NodeHistogramsType;
+
+    const static int HOT_DEPTH = 4;
+    const static int HOT_WIDTH = 1024;
+    const static size_t HOT_TOPK = 32;
+
+    /* hot key sampling of one thread, created on its first sample */
+    typedef struct {
+        uint32_t                         sketch[HOT_DEPTH][HOT_WIDTH];
+        uint32_t                         slots[HASH_SLOTS];
+        std::vector<std::pair<std::string, uint32_t> > topk;
+    } HotStatType;
+
+    /**
+     * per-thread statistic, owned by the cluster. Blocks are never unlinked, readers walk
+     * the list without a lock: the block of a thread that exited is taken over by the next
+     * new thread, so the list is as long as the most threads that were alive at once.
+     */
+    struct ThreadStatType {
+        pthread_t                                  owner;
+        uint32_t                                   id;         // numbered from 0 in order of creation or takeover
+        int                                        dead;       // STAT_LIVE, STAT_DEAD once the owner exited, STAT_CLAIMED while taken over
+        ThreadStatType                            *next;
+        MetricsType                                metrics;    // written by the owner only, relaxed atomics
+        pthread_spinlock_t                         lock;       // for histograms, only contended by readers
+        std::vector<NodeHistogramsType *>          nodes;      // by Node::index()
+        std::map<std::string, LatencyHistogram *>  commands;
+        std::string                                capture;    // records not written yet, guarded by lock
+        void                                      *uring;      // io_uring of the thread, created on first use
+        HotStatType                               *hot;        // set by the owner under lock, NULL until sampled
+        bool                                       uring_failed;
+    };
+
+    ThreadStatType *thread_stat();
+    /* NO_SAMPLE for the parts not measured in this attempt */
+    void record_node_latency(const Node *node, uint64_t connect, uint64_t queue, uint64_t rtt);
+    void record_command_latency(const std::string &cmd, uint64_t total);
+    /**
+     * latency, error count and slow log of a finished request, returns its total time.
+     * commands may be empty when the slow log is off, the raw calls only build them for it.
+     */
+    uint64_t record_request(const std::string &cmd, const std::vector<std::string> &commands, uint64_t start,
+                            bool failed);
+
+    void record_slow(const std::vector<std::string> &commands, uint64_t total, ErrorE err);
+    void capture(const std::vector<std::string> &commands, uint64_t total, const redisReply *reply);
 
-    NodePoolType        node_pool_;
-    pthread_spinlock_t  np_lock_;
+    void trace(TraceHook hook, const Node *node, int slot, const char *cmd, size_t cmd_len,
+               int attempt, uint64_t start, uint64_t elapsed, const redisReply *reply, int loaded_slots = 0,
+               int err = E_OK);
+
+    NodeRegistry        nodes_;
 
     std::vector<Node *> slots_;
+    std::vector<Node *> replica_slots_;
     pthread_spinlock_t  load_slots_lock_;
 
+    typedef struct {
+        redisReply         *reply;    // owned by the last one who releases the flight
+        ErrorStateType      error;
+        int                 refs;     // leader + waiters
+        bool                done;
+        pthread_cond_t      cond;
+    } FlightType;
+    typedef struct {
+        pthread_mutex_t                      lock;
+        std::map<std::string, FlightType *>  flights;
+    } FlightStripeType;
+    const static int FLIGHT_STRIPES = 16;
+
+    unsigned int        node_max_inflight_;
+    unsigned int        node_max_waiting_;
+
+    std::map<std::string, std::string> unix_sockets_;   // host:port -> path
+    std::string         local_unix_pattern_;    // empty for disabled
+    std::set<std::string> local_addrs_;
+    Node::ConnOptionsType conn_options_;
+
+    unsigned int        hot_rate_;              // 0 for disabled, atomic
+
+    typedef std::pair<int, int> CompressRuleType;   // first argument, step
+
+    size_t              compress_threshold_;    // 0 for disabled
+    std::map<std::string, CompressRuleType> compress_rules_;
+    std::set<std::string> decompress_rules_;
+
+    bool                coalescing_;
+    FlightStripeType    flight_stripes_[FLIGHT_STRIPES];
+
+    HedgePolicyType     hedge_policy_;
+    HedgeStatType       hedge_stat_;
+    LatencyHistogram    read_latency_;
+
+    const static uint64_t NO_SAMPLE = (uint64_t)-1;
+    uint64_t            seq_;                   // unique among the clusters of the process
+    ThreadStatType     *thread_stats_;          // lock-free list, pushed at head
+    uint32_t            thread_seq_;            // id of the next ThreadStatType
+
+    bool                tracing_;               // any hook installed
+    TraceHooksType      trace_hooks_;
+
+    typedef struct {
+        uint64_t         seq;                   // odd while being written
+        SlowLogEntryType entry;
+    } SlowSlotType;
+
+    uint64_t            slow_threshold_us_;     // 0 for disabled
+    SlowSlotType       *slow_ring_;
+    size_t              slow_capacity_;
+    uint64_t            slow_next_;             // id of the next entry
+
+    int                 capture_fd_;            // -1 for disabled, CAPTURE_STARTING while start_capture() opens the file
+    size_t              capture_size_;          // per-thread buffer
+    int                 capture_writers_;       // threads writing a full buffer out, without their lock
+
+    std::string         topology_file_;         // empty for disabled
+    bool                validating_;            // validate_topology thread started
+    pthread_t           validate_tid_;
+
+    SharedTopologyType *shared_;                // NULL for disabled
+    uint64_t            shared_epoch_;          // epoch of the shared map last adopted or published
+    pthread_spinlock_t  shared_adopt_lock_;
+    std::vector<Node *> shared_nodes_;          // by index in the shared node table, guarded by shared_adopt_lock_
+
+    IoBackendE          io_backend_;
+
     bool                load_slots_asap_;
     unsigned int        timeout_;
+};
+
+/**
+ * Sharded pub/sub consumer (SSUBSCRIBE), built on the slot map of a Cluster.
+ *
+ * One dedicated subscription connection is kept per owning node, channels are
+ * subscribed in groups sharing the same slot, and when the topology changes only
+ * the channels whose slot moved are re-subscribed at the new owner.
+ * Publishing is done with cluster->run({"SPUBLISH", channel, message}), which is
+ * routed by the channel's slot like any other key.
+ *
+ * Messages are delivered to the callback, from poll() on the caller's thread; there
+ * is no internal queue. A consumer on other threads hands them over from the callback
+ * into a queue of its own.
+ *
+ * A ShardedSubscriber is not thread safe, all calls must be made from one thread.
+ */
+class ShardedSubscriber {
+public:
+    typedef void (*MessageCallback)(const std::string &channel, const std::string &message, void *arg);
+
+    ShardedSubscriber(Cluster *cluster, MessageCallback callback, void *arg = NULL);
+    ~ShardedSubscriber();
+
+    /**
+     * @return
+     *   0 - success
+     *  <0 - fail, the failed channels are retried by next poll()
+     */
+    int subscribe(const std::string &channel);
+    int subscribe(const std::vector<std::string> &channels);
+    int unsubscribe(const std::string &channel);
+    int unsubscribe(const std::vector<std::string> &channels);
+
+    /**
+     * Wait at most timeout_ms for messages and dispatch them to the callback.
+     *
+     * @return
+     *  >=0 - number of messages dispatched
+     *  <0  - fail
+     */
+    int poll(int timeout_ms);
+
+    /**
+     * Check the owner of every subscribed channel against the slots cache,
+     * move only the channels whose slot has moved.
+     */
+    int refresh();
+
+    size_t channels() const { return channels_.size(); }
+    size_t connections() const { return subs_.size(); }
+
+private:
+    typedef struct {
+        Node                  *node;
+        void                  *conn;
+        std::set<std::string>  channels;
+    } SubscriptionType;
+    typedef std::map<Node *, SubscriptionType *> SubscriptionMapType;
+    typedef std::map<int, std::vector<std::string> > SlotGroupType;
+
+    ShardedSubscriber(const ShardedSubscriber &);
+    ShardedSubscriber& operator=(const ShardedSubscriber &);
+
+    Node *channel_owner(const std::string &channel, int &slot);
+    SubscriptionType *get_subscription(Node *node);
+    void close_subscription(SubscriptionType *sub);
+    int send_command(SubscriptionType *sub, const char *cmd, const std::vector<std::string> &channels);
+    int dispatch(SubscriptionType *sub, redisReply *reply);
+
+    Cluster               *cluster_;
+    MessageCallback        callback_;
+    void                  *arg_;
+
+    SubscriptionMapType    subs_;
+    std::map<std::string, Node *> channels_;   // channel -> node subscribed at, NULL if pending
+    bool                   dirty_;             // some channels need to be (re)subscribed
+};
+
+/**
+ * Bulk loader for mass insertion.
+ *
+ * Commands are pre-encoded to RESP, bucketed by the node owning the key's slot and
+ * ordered by slot. flush() streams every bucket to its node over several connections
+ * in parallel (one thread per node), each a sliding window of a bounded number of
+ * commands in flight refilled as replies arrive, and re-routes the commands answered
+ * with MOVED/ASK.
+ * add() flushes by itself once batch commands are queued.
+ *
+ * A BulkLoader is not thread safe, all calls must be made from one thread.
+ */
+class BulkLoader {
+public:
+    typedef struct {
+        std::string  node;        // host:port
+        uint64_t     commands;    // commands answered without error
+        uint64_t     errors;      // commands answered with an error
+        uint64_t     redirects;   // MOVED/ASK re-routed
+        uint64_t     bytes;       // bytes of requests sent
+        double       seconds;     // time spent on the node
+    } NodeStatType;
+
+    BulkLoader(Cluster *cluster, int conns_per_node = 4, int max_inflight = 1000, size_t batch = 100000);
+    ~BulkLoader();
+
+    /**
+     * Queue a command, key is commands[1].
+     *
+     * @return
+     *  >=0 - number of failed commands if a flush was triggered
+     *  <0  - invalid command
+     */
+    int add(const std::vector<std::string> &commands);
+    int set(const std::string &key, const std::string &value);
+
+    /**
+     * Send all queued commands and wait for their replies.
+     *
+     * @return number of commands that failed (error reply, I/O error or too many redirects)
+     */
+    int flush();
+
+    size_t pending() const { return pending_.size(); }
+    std::vector<NodeStatType> stat() const;
+    std::string stat_dump() const;
+
+public: /* used by the node workers */
+    typedef struct {
+        std::string  cmd;         // pre-encoded RESP
+        int          slot;
+        Node        *target;      // node to send to, NULL for the slots cache owner
+        bool         asking;      // prefix with ASKING
+    } EntryType;
+
+    typedef struct {
+        BulkLoader              *loader;
+        Node                    *node;
+        std::vector<EntryType *> entries;
+        std::vector<EntryType *> retries;
+        std::vector<std::pair<int, Node *> > moved;     // slot owners learned, applied by flush()
+        NodeStatType             stat;
+        uint64_t                 failed;
+    } JobType;
+
+    void run_job(JobType *job);
+
+private:
+    BulkLoader(const BulkLoader &);
+    BulkLoader& operator=(const BulkLoader &);
+
+    /* account the reply of entry, which is deleted or queued for a retry */
+    void take_reply(JobType *job, EntryType *entry, redisReply *reply);
+
+    Cluster                 *cluster_;
+    int                      conns_per_node_;
+    int                      max_inflight_;
+    size_t                   batch_;
 
-    pthread_key_t       key_;
+    std::vector<EntryType *> pending_;
+    std::map<Node *, NodeStatType> stats_;
 };
 
 class LockGuard {
@@ -0,0 +1,365 @@
+/* Headless load generator, the non-interactive counterpart of test/infinite.
+ *
+ * Worker threads run a GET/SET mix over a key space for a fixed duration,
+ * either as fast as possible (closed loop) or at a target rate (open loop,
+ * latency is measured from the intended start so queueing is not hidden).
+ * The result is written as a JSON report.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <hiredis/hiredis.h>
+#include "../redis_cluster.h"
+#include "mock_cluster.h"
+
+typedef struct {
+    char          dist;         // 'f'ixed, 'u'niform or 'e'xponential
+    unsigned int  min;
+    unsigned int  max;          // uniform: [min, max]; fixed and exponential: max is the size or mean
+} SizeDistType;
+
+typedef struct {
+    int           threads;
+    unsigned int  keyspace;
+    SizeDistType  value_size;
+    double        read_ratio;
+    double        qps;          // total target, 0 for closed loop
+    double        duration;     // seconds
+} ConfType;
+
+typedef struct {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t read_misses;
+    uint64_t errors;            // run() failed
+    uint64_t error_replies;     // server answered with an error
+    uint64_t errors_by_kind[redis::cluster::Cluster::E_OVERLOAD + 1];
+    uint64_t ttls;
+    uint64_t max_us;
+} CountType;
+
+typedef struct {
+    redis::cluster::LatencyHistogram read_latency;
+    redis::cluster::LatencyHistogram write_latency;
+    CountType                        count;
+} WorkerStatType;
+
+typedef struct {
+    int                      id;
+    pthread_t                tid;
+    const ConfType          *conf;
+    redis::cluster::Cluster *cluster;
+    const std::string       *payload;
+    WorkerStatType           stat;
+} WorkerType;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(uint64_t when) {
+    uint64_t now = now_us();
+    if( when>now ) {
+        usleep(when - now);
+    }
+}
+
+static double rand_unit(unsigned int &seed) {
+    return rand_r(&seed) / (RAND_MAX + 1.0);
+}
+
+static unsigned int value_size(const SizeDistType &dist, unsigned int &seed) {
+    switch( dist.dist ) {
+    case 'u':
+        return dist.min + (unsigned int)(rand_unit(seed) * (dist.max - dist.min + 1));
+    case 'e':
+        return 1 + (unsigned int)(-log(1.0 - rand_unit(seed)) * dist.max);
+    default:
+        return dist.max;
+    }
+}
+
+static bool parse_size(const char *arg, SizeDistType &dist) {
+    if( !strncmp(arg, "uniform:", 8) ) {
+        dist.dist = 'u';
+        return sscanf(arg + 8, "%u-%u", &dist.min, &dist.max)==2 && dist.min<=dist.max && dist.max>0;
+    } else if( !strncmp(arg, "exp:", 4) ) {
+        dist.dist = 'e';
+        dist.min = 1;
+        return sscanf(arg + 4, "%u", &dist.max)==1 && dist.max>0;
+    } else {
+        dist.dist = 'f';
+        if( !strncmp(arg, "fixed:", 6) ) {
+            arg += 6;
+        }
+        dist.min = dist.max = atoi(arg);
+        return dist.max>0;
+    }
+}
+
+static void *worker_main(void *arg) {
+    WorkerType *worker = (WorkerType *)arg;
+    const ConfType &conf = *worker->conf;
+    WorkerStatType &stat = worker->stat;
+    CountType &count = stat.count;
+    unsigned int seed = (unsigned int)now_us() + worker->id * 7919;
+    size_t max_size = worker->payload->length();
+
+    double interval = conf.qps>0? conf.threads * 1000000.0 / conf.qps: 0;
+    uint64_t start = now_us();
+    uint64_t stop = start + (uint64_t)(conf.duration * 1000000);
+    uint64_t n = 0;
+
+    std::vector<std::string> commands;
+    char key[32];
+
+    for(;; n++) {
+        uint64_t intended = interval>0? start + (uint64_t)(n * interval): now_us();
+        if( intended>=stop ) {
+            break;
+        }
+        sleep_until(intended);
+
+        snprintf(key, sizeof(key), "key_%u", (unsigned int)(rand_unit(seed) * conf.keyspace));
+        bool read = rand_unit(seed) < conf.read_ratio;
+
+        commands.clear();
+        commands.push_back(read? "GET": "SET");
+        commands.push_back(key);
+        if( !read ) {
+            size_t size = value_size(conf.value_size, seed);
+            size_t offset = rand_unit(seed) * (max_size - (size<max_size? size: max_size) + 1);
+            commands.push_back(worker->payload->substr(offset, size));
+        }
+
+        uint64_t begin = interval>0? intended: now_us();
+        redisReply *reply = worker->cluster->run(commands);
+        uint64_t latency = now_us() - begin;
+
+        if( read ) {
+            count.reads++;
+            stat.read_latency.add(latency);
+        } else {
+            count.writes++;
+            stat.write_latency.add(latency);
+        }
+        if( latency>count.max_us ) {
+            count.max_us = latency;
+        }
+        count.ttls += worker->cluster->ttls();
+
+        if( !reply ) {
+            count.errors++;
+            count.errors_by_kind[worker->cluster->err()]++;
+            continue;
+        }
+        if( reply->type==REDIS_REPLY_ERROR ) {
+            count.error_replies++;
+        } else if( read && reply->type==REDIS_REPLY_NIL ) {
+            count.read_misses++;
+        }
+        freeReplyObject(reply);
+    }
+    return NULL;
+}
+
+static void json_latency(std::ostringstream &ss, const redis::cluster::LatencyHistogram &hist) {
+    ss << "{\"count\": " << hist.count()
+       << ", \"p50\": " << hist.percentile(0.5)
+       << ", \"p90\": " << hist.percentile(0.9)
+       << ", \"p99\": " << hist.percentile(0.99)
+       << ", \"p999\": " << hist.percentile(0.999) << "}";
+}
+
+static void usage(const char *prog) {
+    std::cerr << "usage: " << prog << " [-t threads] [-k keyspace] [-v size] [-r read_ratio] [-q qps] [-d seconds] [-o file] [-c file] [-M nodes] [startup]\r\n"
+              << "  -t threads     worker threads, default 4\r\n"
+              << "  -k keyspace    number of distinct keys, default 100000\r\n"
+              << "  -v size        value size: N or fixed:N, uniform:MIN-MAX, exp:MEAN, default 100\r\n"
+              << "  -r read_ratio  fraction of GET, the rest are SET, default 0.9\r\n"
+              << "  -q qps         total target rate, open loop; 0 for as fast as possible (default)\r\n"
+              << "  -d seconds     duration, default 10\r\n"
+              << "  -o file        JSON report, default stdout\r\n"
+              << "  -c file        capture the traffic to file, for tools/replay\r\n"
+              << "  -M nodes       run against an in-process mock cluster of nodes masters\r\n"
+              << "  startup        '127.0.0.1:7000,127.0.0.1:7001'" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    ConfType conf;
+    conf.threads = 4;
+    conf.keyspace = 100000;
+    conf.value_size.dist = 'f';
+    conf.value_size.min = conf.value_size.max = 100;
+    conf.read_ratio = 0.9;
+    conf.qps = 0;
+    conf.duration = 10;
+    const char *output = NULL;
+    const char *capture = NULL;
+    int mock_nodes = 0;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "t:k:v:r:q:d:o:c:M:h"))!=-1 ) {
+        switch(opt) {
+        case 't': conf.threads = atoi(optarg); break;
+        case 'k': conf.keyspace = strtoul(optarg, NULL, 10); break;
+        case 'v':
+            if( !parse_size(optarg, conf.value_size) ) {
+                std::cerr << "bad value size " << optarg << std::endl;
+                return 1;
+            }
+            break;
+        case 'r': conf.read_ratio = atof(optarg); break;
+        case 'q': conf.qps = atof(optarg); break;
+        case 'd': conf.duration = atof(optarg); break;
+        case 'o': output = optarg; break;
+        case 'c': capture = optarg; break;
+        case 'M': mock_nodes = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if( conf.threads<=0 || conf.keyspace==0 || conf.duration<=0 || (mock_nodes==0 && optind>=argc) ) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    MockCluster mock;
+    std::string startup;
+    if( mock_nodes>0 ) {
+        if( mock.start(mock_nodes)!=0 ) {
+            std::cerr << "mock cluster start fail" << std::endl;
+            return 1;
+        }
+        startup = mock.startup();
+    } else {
+        startup = argv[optind];
+    }
+
+    redis::cluster::Cluster *cluster = new redis::cluster::Cluster(5);
+    if( cluster->setup(startup.c_str(), false)!=0 ) {
+        std::cerr << "cluster setup fail" << std::endl;
+        return 1;
+    }
+    if( capture && cluster->start_capture(capture)!=0 ) {
+        perror(capture);
+        return 1;
+    }
+
+    /* values are slices of one random payload */
+
+    size_t max_size = conf.value_size.dist=='e'? conf.value_size.max * 10: conf.value_size.max;
+    std::string payload(max_size, '\0');
+    unsigned int seed = 1;
+    for(size_t i = 0; i < max_size; i++) {
+        payload[i] = 'a' + rand_r(&seed) % 26;
+    }
+
+    std::vector<WorkerType> workers(conf.threads);
+    uint64_t start = now_us();
+    for(int i = 0; i < conf.threads; i++) {
+        WorkerType &w = workers[i];
+        w.id = i;
+        w.conf = &conf;
+        w.cluster = cluster;
+        w.payload = &payload;
+        memset(&w.stat.count, 0, sizeof(w.stat.count));
+        if( pthread_create(&w.tid, NULL, worker_main, &w)!=0 ) {
+            std::cerr << "pthread_create fail" << std::endl;
+            return 1;
+        }
+    }
+
+    WorkerStatType stat;
+    CountType &total = stat.count;
+    memset(&total, 0, sizeof(total));
+    for(int i = 0; i < conf.threads; i++) {
+        WorkerType &w = workers[i];
+        pthread_join(w.tid, NULL);
+        stat.read_latency.merge(w.stat.read_latency);
+        stat.write_latency.merge(w.stat.write_latency);
+        total.reads += w.stat.count.reads;
+        total.writes += w.stat.count.writes;
+        total.read_misses += w.stat.count.read_misses;
+        total.errors += w.stat.count.errors;
+        total.error_replies += w.stat.count.error_replies;
+        for(int e = 0; e <= redis::cluster::Cluster::E_OVERLOAD; e++) {
+            total.errors_by_kind[e] += w.stat.count.errors_by_kind[e];
+        }
+        total.ttls += w.stat.count.ttls;
+        if( w.stat.count.max_us>total.max_us ) {
+            total.max_us = w.stat.count.max_us;
+        }
+    }
+    double elapsed = (now_us() - start) / 1000000.0;
+
+    redis::cluster::LatencyHistogram all;
+    all.merge(stat.read_latency);
+    all.merge(stat.write_latency);
+    uint64_t requests = total.reads + total.writes;
+
+    redis::cluster::Cluster::MetricsType m;
+    cluster->metrics(m);
+
+    static const char *ERROR_NAMES[] = {"ok", "commands", "slot_missed", "io", "ttl", "others", "overload"};
+    std::ostringstream ss;
+    ss << "{\n"
+       << "  \"config\": {\"threads\": " << conf.threads
+       << ", \"keyspace\": " << conf.keyspace
+       << ", \"value_size\": {\"dist\": \""
+       << (conf.value_size.dist=='u'? "uniform": conf.value_size.dist=='e'? "exp": "fixed")
+       << "\", \"min\": " << conf.value_size.min << ", \"max\": " << conf.value_size.max << "}"
+       << ", \"read_ratio\": " << conf.read_ratio
+       << ", \"target_qps\": " << conf.qps
+       << ", \"duration\": " << conf.duration
+       << ", \"startup\": \"" << (mock_nodes>0? "mock": startup) << "\"},\n"
+       << "  \"elapsed\": " << elapsed << ",\n"
+       << "  \"requests\": " << requests << ",\n"
+       << "  \"throughput\": " << (elapsed>0? requests / elapsed: 0) << ",\n"
+       << "  \"reads\": " << total.reads << ",\n"
+       << "  \"read_misses\": " << total.read_misses << ",\n"
+       << "  \"writes\": " << total.writes << ",\n"
+       << "  \"errors\": " << total.errors << ",\n"
+       << "  \"error_replies\": " << total.error_replies << ",\n"
+       << "  \"errors_by_kind\": {";
+    for(int e = redis::cluster::Cluster::E_COMMANDS; e <= redis::cluster::Cluster::E_OVERLOAD; e++) {
+        ss << (e>1? ", ": "") << "\"" << ERROR_NAMES[e] << "\": " << total.errors_by_kind[e];
+    }
+    ss << "},\n"
+       << "  \"ttls\": " << total.ttls << ",\n"
+       << "  \"redirects\": {\"moved\": " << m.moved << ", \"ask\": " << m.ask << "},\n"
+       << "  \"latency_us\": ";
+    json_latency(ss, all);
+    ss << ",\n  \"max_latency_us\": " << total.max_us << ",\n"
+       << "  \"read_latency_us\": ";
+    json_latency(ss, stat.read_latency);
+    ss << ",\n  \"write_latency_us\": ";
+    json_latency(ss, stat.write_latency);
+    ss << "\n}\n";
+
+    if( output ) {
+        FILE *out = fopen(output, "w");
+        if( !out ) {
+            perror(output);
+            return 1;
+        }
+        fputs(ss.str().c_str(), out);
+        fclose(out);
+    } else {
+        std::cout << ss.str();
+    }
+
+    delete cluster;
+    mock.stop();
+    return total.errors>0? 2: 0;
+}
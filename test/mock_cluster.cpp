@@ -0,0 +1,622 @@
+#include "mock_cluster.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <hiredis/hiredis.h>
+
+extern uint16_t crc16(const char *buf, int len);    // deps/crc16.c, linked with redis_cluster.o
+
+static const char *MOCK_HOST = "127.0.0.1";
+
+class MockLock {
+public:
+    MockLock(pthread_mutex_t &lock):lock_(lock) { pthread_mutex_lock(&lock_); }
+    ~MockLock() { pthread_mutex_unlock(&lock_); }
+private:
+    pthread_mutex_t &lock_;
+};
+
+static std::string bulk(const std::string &s) {
+    char header[32];
+    snprintf(header, sizeof(header), "$%zu\r\n", s.length());
+    return header + s + "\r\n";
+}
+
+static std::string integer(long long n) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), ":%lld\r\n", n);
+    return buf;
+}
+
+static std::string arg(const redisReply *request, size_t i) {
+    const redisReply *e = request->element[i];
+    return std::string(e->str, e->len);
+}
+
+static std::string push(const char *kind, const std::string &channel, const std::string &payload) {
+    return "*3\r\n" + bulk(kind) + bulk(channel) + payload;
+}
+
+MockCluster::MockCluster()
+    :masters_(0),
+     replicas_(0),
+     owner_(HASH_SLOTS, -1),
+     importing_(HASH_SLOTS, -1),
+     running_(false) {
+    pthread_mutex_init(&lock_, NULL);
+}
+
+MockCluster::~MockCluster() {
+    stop();
+    pthread_mutex_destroy(&lock_);
+}
+
+int MockCluster::start(int nodes, int replicas) {
+    if( running_ || nodes<=0 || replicas<0 ) {
+        return -1;
+    }
+    masters_ = nodes;
+    replicas_ = replicas;
+
+    for(int i = 0; i < nodes * (1 + replicas); i++) {
+        NodeType *node = new NodeType;
+        node->cluster = this;
+        node->index = i;
+        node->master = i<nodes? -1: (i - nodes) / replicas;
+        node->delay_us = 0;
+        node->down = false;
+        node->drop_gen = 0;
+        node->requests = 0;
+        node->unix_accepts = 0;
+
+        node->listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        setsockopt(node->listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = inet_addr(MOCK_HOST);
+        addr.sin_port = 0;
+        if( node->listen_fd<0
+            || bind(node->listen_fd, (struct sockaddr *)&addr, sizeof(addr))!=0
+            || listen(node->listen_fd, 128)!=0
+            || getsockname(node->listen_fd, (struct sockaddr *)&addr, &len)!=0 ) {
+            if( node->listen_fd>=0 )
+                close(node->listen_fd);
+            delete node;
+            stop();
+            return -1;
+        }
+        node->port = ntohs(addr.sin_port);
+
+        /* the unix socket is optional, tests of it are skipped without */
+        char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+        snprintf(path, sizeof(path), "/tmp/mock_cluster.%d.%d.sock", (int)getpid(), node->port);
+        struct sockaddr_un un;
+        memset(&un, 0, sizeof(un));
+        un.sun_family = AF_UNIX;
+        strcpy(un.sun_path, path);
+        unlink(path);
+        node->unix_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if( node->unix_fd>=0
+            && (bind(node->unix_fd, (struct sockaddr *)&un, sizeof(un))!=0 || listen(node->unix_fd, 128)!=0) ) {
+            close(node->unix_fd);
+            node->unix_fd = -1;
+        }
+        if( node->unix_fd>=0 ) {
+            node->unix_path = path;
+        }
+        nodes_.push_back(node);
+    }
+
+    for(int slot = 0; slot < HASH_SLOTS; slot++) {
+        owner_[slot] = (int)((int64_t)slot * nodes / HASH_SLOTS);
+        importing_[slot] = -1;
+    }
+
+    running_ = true;
+    for(size_t i = 0; i < nodes_.size(); i++) {
+        pthread_create(&nodes_[i]->tid, NULL, node_main, nodes_[i]);
+    }
+    return 0;
+}
+
+void MockCluster::stop() {
+    bool was_running = running_;
+    running_ = false;
+    for(size_t i = 0; i < nodes_.size(); i++) {
+        NodeType *node = nodes_[i];
+        if( was_running ) {
+            pthread_join(node->tid, NULL);
+        }
+        for(size_t j = 0; j < node->clients.size(); j++) {
+            close(node->clients[j].fd);
+            redisReaderFree((redisReader *)node->clients[j].reader);
+        }
+        close(node->listen_fd);
+        if( node->unix_fd>=0 ) {
+            close(node->unix_fd);
+            unlink(node->unix_path.c_str());
+        }
+        delete node;
+    }
+    nodes_.clear();
+}
+
+std::string MockCluster::startup() const {
+    std::string out;
+    for(size_t i = 0; i < nodes_.size(); i++) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%s%s:%d", i? ",": "", MOCK_HOST, nodes_[i]->port);
+        out += buf;
+    }
+    return out;
+}
+
+int MockCluster::port(int node) const {
+    return nodes_[node]->port;
+}
+
+std::string MockCluster::unix_socket(int node) const {
+    return nodes_[node]->unix_path;
+}
+
+void MockCluster::set_delay(int node, unsigned int delay_us) {
+    MockLock lg(lock_);
+    nodes_[node]->delay_us = delay_us;
+}
+
+void MockCluster::drop_connections(int node) {
+    MockLock lg(lock_);
+    nodes_[node]->drop_gen++;
+}
+
+void MockCluster::set_down(int node, bool down) {
+    MockLock lg(lock_);
+    nodes_[node]->down = down;
+    nodes_[node]->drop_gen++;
+}
+
+void MockCluster::inject_reply(int node, const std::string &raw, int count) {
+    MockLock lg(lock_);
+    for(int i = 0; i < count; i++) {
+        nodes_[node]->injected.push_back(raw);
+    }
+}
+
+void MockCluster::begin_migration(int slot, int to) {
+    MockLock lg(lock_);
+    importing_[slot] = to;
+}
+
+void MockCluster::end_migration(int slot) {
+    MockLock lg(lock_);
+    int to = importing_[slot];
+    if( to<0 ) {
+        return;
+    }
+    move_keys(slot, owner_[slot], to);
+    owner_[slot] = to;
+    importing_[slot] = -1;
+}
+
+void MockCluster::failover(int from, int to) {
+    MockLock lg(lock_);
+    for(int slot = 0; slot < HASH_SLOTS; slot++) {
+        if( owner_[slot]==from ) {
+            move_keys(slot, from, to);
+            owner_[slot] = to;
+            importing_[slot] = -1;
+        }
+    }
+}
+
+int MockCluster::owner(int slot) const {
+    MockLock lg(lock_);
+    return owner_[slot];
+}
+
+uint64_t MockCluster::requests(int node) const {
+    MockLock lg(lock_);
+    return nodes_[node]->requests;
+}
+
+uint64_t MockCluster::unix_connections(int node) const {
+    MockLock lg(lock_);
+    return nodes_[node]->unix_accepts;
+}
+
+bool MockCluster::get(const std::string &key, std::string &value) const {
+    MockLock lg(lock_);
+    int slot = key_slot(key);
+    const std::map<std::string, std::string> *data = &nodes_[owner_[slot]]->data;
+    std::map<std::string, std::string>::const_iterator iter = data->find(key);
+    if( iter==data->end() && importing_[slot]>=0 ) {
+        data = &nodes_[importing_[slot]]->data;
+        iter = data->find(key);
+    }
+    if( iter==data->end() ) {
+        return false;
+    }
+    value = iter->second;
+    return true;
+}
+
+int MockCluster::key_slot(const std::string &key) {
+    std::string::size_type pos1 = key.find('{');
+    if( pos1!=std::string::npos ) {
+        std::string::size_type pos2 = key.find('}', pos1 + 1);
+        if( pos2!=std::string::npos && pos2>pos1 + 1 ) {
+            return crc16(key.data() + pos1 + 1, pos2 - pos1 - 1) % HASH_SLOTS;
+        }
+    }
+    return crc16(key.data(), key.length()) % HASH_SLOTS;
+}
+
+void MockCluster::move_keys(int slot, int from, int to) {
+    if( from<0 || to<0 || from==to ) {
+        return;
+    }
+    std::map<std::string, std::string> &src = nodes_[from]->data;
+    std::map<std::string, std::string>::iterator iter = src.begin();
+    while( iter!=src.end() ) {
+        if( key_slot(iter->first)==slot ) {
+            nodes_[to]->data[iter->first] = iter->second;
+            src.erase(iter++);
+        } else {
+            iter++;
+        }
+    }
+}
+
+std::string MockCluster::redirect(const char *type, int slot, int node) const {
+    char buf[128];
+    snprintf(buf, sizeof(buf), "-%s %d %s:%d\r\n", type, slot, MOCK_HOST, nodes_[node]->port);
+    return buf;
+}
+
+std::string MockCluster::cluster_slots() const {
+    std::string body;
+    int ranges = 0;
+    for(int start = 0; start < HASH_SLOTS; ) {
+        int end = start;
+        while( end + 1 < HASH_SLOTS && owner_[end + 1]==owner_[start] ) {
+            end++;
+        }
+        char id[41];
+        snprintf(id, sizeof(id), "%040d", owner_[start]);
+        char header[32];
+        snprintf(header, sizeof(header), "*%d\r\n", 3 + replicas_);
+        body += header + integer(start) + integer(end)
+                + "*3\r\n" + bulk(MOCK_HOST) + integer(nodes_[owner_[start]]->port) + bulk(id);
+        for(int r = 0; r < replicas_; r++) {
+            int index = replica(owner_[start], r);
+            snprintf(id, sizeof(id), "%040d", index);
+            body += "*3\r\n" + bulk(MOCK_HOST) + integer(nodes_[index]->port) + bulk(id);
+        }
+        ranges++;
+        start = end + 1;
+    }
+    char header[32];
+    snprintf(header, sizeof(header), "*%d\r\n", ranges);
+    return header + body;
+}
+
+bool MockCluster::handle(NodeType *node, ClientType &client, void *req, std::string &out, unsigned int &delay_us) {
+    const redisReply *request = (const redisReply *)req;
+
+    MockLock lg(lock_);
+
+    node->requests++;
+    delay_us = node->delay_us;
+
+    if( !node->injected.empty() ) {
+        out = node->injected.front();
+        node->injected.pop_front();
+        return !out.empty();
+    }
+
+    if( request->type!=REDIS_REPLY_ARRAY || request->elements==0 ) {
+        out = "-ERR protocol error\r\n";
+        return true;
+    }
+    for(size_t i = 0; i < request->elements; i++) {
+        if( request->element[i]->type!=REDIS_REPLY_STRING ) {
+            out = "-ERR protocol error\r\n";
+            return true;
+        }
+    }
+
+    std::string cmd = arg(request, 0);
+    bool asking = client.asking;
+    client.asking = false;
+
+    if( !strcasecmp(cmd.c_str(), "PING") ) {
+        out = "+PONG\r\n";
+        return true;
+    }
+    if( !strcasecmp(cmd.c_str(), "READONLY") ) {
+        client.readonly = true;
+        out = "+OK\r\n";
+        return true;
+    }
+    if( !strcasecmp(cmd.c_str(), "ASKING") ) {
+        client.asking = true;
+        out = "+OK\r\n";
+        return true;
+    }
+    if( !strcasecmp(cmd.c_str(), "CLUSTER") ) {
+        if( request->elements>1 && !strcasecmp(arg(request, 1).c_str(), "SLOTS") ) {
+            out = cluster_slots();
+        } else {
+            out = "-ERR unsupported CLUSTER subcommand\r\n";
+        }
+        return true;
+    }
+
+    size_t first_key = 1, last_key = 1;
+    if( !strcasecmp(cmd.c_str(), "GET") && request->elements==2 ) {
+    } else if( !strcasecmp(cmd.c_str(), "SET") && request->elements>=3 ) {
+    } else if( (!strcasecmp(cmd.c_str(), "MGET") || !strcasecmp(cmd.c_str(), "DEL")) && request->elements>=2 ) {
+        last_key = request->elements - 1;
+    } else if( !strcasecmp(cmd.c_str(), "SPUBLISH") && request->elements==3 ) {
+    } else if( (!strcasecmp(cmd.c_str(), "SSUBSCRIBE") || !strcasecmp(cmd.c_str(), "SUNSUBSCRIBE"))
+               && request->elements>=2 ) {
+        last_key = request->elements - 1;
+    } else {
+        out = "-ERR unknown command '" + cmd + "'\r\n";
+        return true;
+    }
+
+    /* route by the slot of the keys */
+
+    int slot = key_slot(arg(request, first_key));
+    for(size_t i = first_key + 1; i <= last_key; i++) {
+        if( key_slot(arg(request, i))!=slot ) {
+            out = "-CROSSSLOT Keys in request don't hash to the same slot\r\n";
+            return true;
+        }
+    }
+
+    bool shard_channel = !strncasecmp(cmd.c_str(), "SSUB", 4) || !strncasecmp(cmd.c_str(), "SUNSUB", 6)
+                         || !strcasecmp(cmd.c_str(), "SPUBLISH");
+    bool read = !strcasecmp(cmd.c_str(), "GET") || !strcasecmp(cmd.c_str(), "MGET");
+    if( node->master>=0 ) {
+        /* a replica reads the data of its master */
+        if( !(read && client.readonly && owner_[slot]==node->master) ) {
+            out = redirect("MOVED", slot, owner_[slot]);
+            return true;
+        }
+    } else if( owner_[slot]==node->index ) {
+        if( importing_[slot]>=0 && !shard_channel ) {
+            for(size_t i = first_key; i <= last_key; i++) {
+                if( !node->data.count(arg(request, i)) ) {
+                    out = redirect("ASK", slot, importing_[slot]);
+                    return true;
+                }
+            }
+        }
+    } else if( !(asking && importing_[slot]==node->index)
+               && strcasecmp(cmd.c_str(), "SUNSUBSCRIBE") ) {    // served for a slot moved away, like redis
+        out = redirect("MOVED", slot, owner_[slot]);
+        return true;
+    }
+
+    if( shard_channel ) {
+        pubsub(node, client, cmd, request, out);
+        return true;
+    }
+
+    std::map<std::string, std::string> &data = node->master>=0? nodes_[node->master]->data: node->data;
+    if( !strcasecmp(cmd.c_str(), "GET") ) {
+        std::map<std::string, std::string>::iterator iter = data.find(arg(request, 1));
+        out = iter==data.end()? "$-1\r\n": bulk(iter->second);
+    } else if( !strcasecmp(cmd.c_str(), "SET") ) {
+        data[arg(request, 1)] = arg(request, 2);
+        out = "+OK\r\n";
+    } else if( !strcasecmp(cmd.c_str(), "MGET") ) {
+        char header[32];
+        snprintf(header, sizeof(header), "*%zu\r\n", request->elements - 1);
+        out = header;
+        for(size_t i = 1; i < request->elements; i++) {
+            std::map<std::string, std::string>::iterator iter = data.find(arg(request, i));
+            out += iter==data.end()? "$-1\r\n": bulk(iter->second);
+        }
+    } else {
+        long long n = 0;
+        for(size_t i = 1; i < request->elements; i++) {
+            n += data.erase(arg(request, i));
+        }
+        out = integer(n);
+    }
+    return true;
+}
+
+void MockCluster::pubsub(NodeType *node, ClientType &client, const std::string &cmd, const void *req, std::string &out) {
+    const redisReply *request = (const redisReply *)req;
+
+    if( !strcasecmp(cmd.c_str(), "SPUBLISH") ) {
+        std::string channel = arg(request, 1);
+        long long receivers = 0;
+        for(size_t i = 0; i < node->clients.size(); i++) {
+            if( node->clients[i].channels.count(channel) ) {
+                node->clients[i].pushed += push("smessage", channel, bulk(arg(request, 2)));
+                receivers++;
+            }
+        }
+        out = integer(receivers);
+        return;
+    }
+
+    bool subscribe = !strcasecmp(cmd.c_str(), "SSUBSCRIBE");
+    for(size_t i = 1; i < request->elements; i++) {
+        std::string channel = arg(request, i);
+        if( subscribe ) {
+            client.channels.insert(channel);
+        } else {
+            client.channels.erase(channel);
+        }
+        out += push(subscribe? "ssubscribe": "sunsubscribe", channel, integer(client.channels.size()));
+    }
+}
+
+void MockCluster::unsubscribe_moved(NodeType *node) {
+    MockLock lg(lock_);
+    for(size_t i = 0; i < node->clients.size(); i++) {
+        ClientType &client = node->clients[i];
+        std::set<std::string>::iterator iter = client.channels.begin();
+        while( iter!=client.channels.end() ) {
+            if( owner_[key_slot(*iter)]!=node->index ) {
+                std::string channel = *iter;
+                client.channels.erase(iter++);
+                client.pushed += push("sunsubscribe", channel, integer(client.channels.size()));
+            } else {
+                iter++;
+            }
+        }
+    }
+}
+
+void *MockCluster::node_main(void *arg) {
+    NodeType *node = (NodeType *)arg;
+    node->cluster->serve(node);
+    return NULL;
+}
+
+void MockCluster::serve(NodeType *node) {
+    std::vector<struct pollfd> pfds;
+    std::vector<bool> closing;
+    int drop_gen = 0;
+    char buf[16 * 1024];
+
+    while( running_ ) {
+        bool down;
+        int gen;
+        {
+            MockLock lg(lock_);
+            down = node->down;
+            gen = node->drop_gen;
+        }
+        if( gen!=drop_gen ) {
+            drop_gen = gen;
+            for(size_t i = 0; i < node->clients.size(); i++) {
+                close(node->clients[i].fd);
+                redisReaderFree((redisReader *)node->clients[i].reader);
+            }
+            node->clients.clear();
+        }
+        unsubscribe_moved(node);
+
+        /* the tcp and the unix listener, then the clients; poll skips a listener of -1 */
+        const size_t LISTENERS = 2;
+        pfds.resize(node->clients.size() + LISTENERS);
+        pfds[0].fd = node->listen_fd;
+        pfds[1].fd = node->unix_fd;
+        for(size_t i = 0; i < node->clients.size(); i++) {
+            pfds[i + LISTENERS].fd = node->clients[i].fd;
+        }
+        for(size_t i = 0; i < pfds.size(); i++) {
+            pfds[i].events = POLLIN;
+            pfds[i].revents = 0;
+        }
+
+        /* messages pushed to the clients, written before waiting */
+        for(size_t i = 0; i < node->clients.size(); i++) {
+            ClientType &client = node->clients[i];
+            size_t done = 0;
+            while( done<client.pushed.length() ) {
+                ssize_t w = write(client.fd, client.pushed.data() + done, client.pushed.length() - done);
+                if( w<=0 ) {
+                    break;
+                }
+                done += w;
+            }
+            client.pushed.clear();
+        }
+
+        if( poll(pfds.data(), pfds.size(), 10)<=0 ) {
+            continue;
+        }
+
+        for(size_t i = 0; i < LISTENERS; i++) {
+            if( !(pfds[i].revents & POLLIN) ) {
+                continue;
+            }
+            int fd = accept(pfds[i].fd, NULL, NULL);
+            if( fd>=0 && down ) {
+                close(fd);
+            } else if( fd>=0 ) {
+                ClientType client;
+                client.fd = fd;
+                client.reader = redisReaderCreate();
+                client.asking = false;
+                client.readonly = false;
+                node->clients.push_back(client);
+                if( pfds[i].fd==node->unix_fd ) {
+                    MockLock lg(lock_);
+                    node->unix_accepts++;
+                }
+            }
+        }
+
+        closing.assign(node->clients.size(), false);
+        for(size_t i = LISTENERS; i < pfds.size(); i++) {
+            if( !(pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) ) {
+                continue;
+            }
+            ClientType &client = node->clients[i - LISTENERS];
+            ssize_t n = read(client.fd, buf, sizeof(buf));
+            if( n<=0 ) {
+                closing[i - LISTENERS] = true;
+                continue;
+            }
+
+            redisReader *reader = (redisReader *)client.reader;
+            redisReaderFeed(reader, buf, n);
+
+            std::string out;
+            void *request = NULL;
+            while( !closing[i - LISTENERS] && redisReaderGetReply(reader, &request)==REDIS_OK && request ) {
+                std::string reply;
+                unsigned int delay_us = 0;
+                if( !handle(node, client, request, reply, delay_us) ) {
+                    closing[i - LISTENERS] = true;
+                }
+                freeReplyObject(request);
+                request = NULL;
+                if( delay_us>0 ) {
+                    usleep(delay_us);
+                }
+                out += reply;
+            }
+
+            size_t done = 0;
+            while( done<out.length() ) {
+                ssize_t w = write(client.fd, out.data() + done, out.length() - done);
+                if( w<=0 ) {
+                    closing[i - LISTENERS] = true;
+                    break;
+                }
+                done += w;
+            }
+        }
+
+        for(size_t i = node->clients.size(); i > 0; i--) {
+            if( closing[i - 1] ) {
+                close(node->clients[i - 1].fd);
+                redisReaderFree((redisReader *)node->clients[i - 1].reader);
+                node->clients.erase(node->clients.begin() + (i - 1));
+            }
+        }
+    }
+}
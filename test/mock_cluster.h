@@ -0,0 +1,129 @@
+#ifndef MOCK_CLUSTER_H_
+#define MOCK_CLUSTER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
+
+/**
+ * In-process fake redis cluster for tests and benchmarks.
+ *
+ * Every node listens on an ephemeral port of 127.0.0.1 and on a unix socket, and is
+ * served by its own thread. Nodes speak enough RESP for GET/SET/DEL/MGET/PING/READONLY/ASKING,
+ * CLUSTER SLOTS and sharded pub/sub (SSUBSCRIBE/SUNSUBSCRIBE/SPUBLISH), answer MOVED/ASK by a
+ * shared slot table, and can be scripted to delay replies, drop connections, inject replies,
+ * migrate slots and fail over. Like redis, a node unsubscribes its clients from the channels
+ * of a slot it lost, with a sunsubscribe message. Masters may have replicas, which serve
+ * reads of their master's slots to READONLY connections and redirect anything else.
+ *
+ * All methods may be called while clients are running.
+ */
+class MockCluster {
+public:
+    const static int HASH_SLOTS = 16384;
+
+    MockCluster();
+    ~MockCluster();
+
+    /**
+     * Start nodes masters, the slots are split evenly in order. Each master has replicas
+     * replicas, listed by CLUSTER SLOTS; replica r of master m is node nodes + m * replicas + r.
+     *
+     * @return
+     *   0 - success
+     *  <0 - fail
+     */
+    int start(int nodes, int replicas = 0);
+    void stop();
+
+    std::string startup() const;        // "127.0.0.1:port1,127.0.0.1:port2,..."
+    int port(int node) const;
+    /* path of the node's unix socket, empty if it couldn't be created */
+    std::string unix_socket(int node) const;
+    int nodes() const { return (int)nodes_.size(); }
+    int replica(int master, int r) const { return masters_ + master * replicas_ + r; }
+
+    /* wait delay_us before every reply of node */
+    void set_delay(int node, unsigned int delay_us);
+    /* close every connection currently open to node */
+    void drop_connections(int node);
+    /* a down node closes every connection as soon as it is accepted */
+    void set_down(int node, bool down);
+    /* answer the next count requests to node with the raw RESP reply, "" to close the connection instead */
+    void inject_reply(int node, const std::string &raw, int count = 1);
+
+    /**
+     * Slot migration as done by redis-trib: while migrating, the owner answers ASK
+     * for the keys it doesn't have, the target serves them after ASKING.
+     * end_migration() moves the remaining keys and the slot, the old owner answers MOVED.
+     */
+    void begin_migration(int slot, int to);
+    void end_migration(int slot);
+    /* move every slot (and key) of from to to, like a failover to a promoted replica */
+    void failover(int from, int to);
+
+    int owner(int slot) const;
+    uint64_t requests(int node) const;
+    uint64_t unix_connections(int node) const;
+    bool get(const std::string &key, std::string &value) const;
+
+    static int key_slot(const std::string &key);
+
+private:
+    typedef struct {
+        int                     fd;
+        void                   *reader;     // redisReader
+        bool                    asking;
+        bool                    readonly;
+        std::set<std::string>   channels;   // shard channels subscribed to
+        std::string             pushed;     // messages to write, besides the replies
+    } ClientType;
+
+    typedef struct {
+        MockCluster                        *cluster;
+        int                                 index;
+        int                                 master;     // of a replica, -1 for a master
+        int                                 port;
+        int                                 listen_fd;
+        int                                 unix_fd;
+        std::string                         unix_path;
+        pthread_t                           tid;
+        std::vector<ClientType>             clients;    // used by the node thread only
+        unsigned int                        delay_us;
+        bool                                down;
+        int                                 drop_gen;   // bumped by drop_connections()
+        std::deque<std::string>             injected;
+        uint64_t                            requests;
+        uint64_t                            unix_accepts;
+        std::map<std::string, std::string>  data;
+    } NodeType;
+
+    MockCluster(const MockCluster &);
+    MockCluster& operator=(const MockCluster &);
+
+    static void *node_main(void *arg);
+    void serve(NodeType *node);
+    /* return false to close the connection */
+    bool handle(NodeType *node, ClientType &client, void *request, std::string &out, unsigned int &delay_us);
+    /* SSUBSCRIBE/SUNSUBSCRIBE/SPUBLISH, the slot is checked by the caller */
+    void pubsub(NodeType *node, ClientType &client, const std::string &cmd, const void *request, std::string &out);
+    /* drop the channels of the slots node lost, telling the clients */
+    void unsubscribe_moved(NodeType *node);
+    std::string redirect(const char *type, int slot, int node) const;
+    std::string cluster_slots() const;
+    void move_keys(int slot, int from, int to);
+
+    std::vector<NodeType *> nodes_;
+    int                     masters_;
+    int                     replicas_;      // per master
+    std::vector<int>        owner_;         // by slot
+    std::vector<int>        importing_;     // by slot, -1 if not migrating
+    mutable pthread_mutex_t lock_;          // for everything above except clients
+    volatile bool           running_;
+};
+
+#endif
@@ -0,0 +1,112 @@
+/* Bulk load key/value records into redis cluster.
+ *
+ * Records are read from a file or stdin, one per line: key<TAB>value
+ * Keys are bucketed per node by their slot and streamed to the masters
+ * over several pipelined connections, see redis::cluster::BulkLoader.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <iostream>
+#include <string>
+#include "../redis_cluster.h"
+
+static void usage(const char *prog) {
+    std::cerr << "usage: " << prog << " [-c conns_per_node] [-w max_inflight] [-b batch] [-f file] startup\r\n"
+              << "  -c conns_per_node  connections per node, default 4\r\n"
+              << "  -w max_inflight    commands in flight per node, default 1000\r\n"
+              << "  -b batch           commands queued before flushing, default 100000\r\n"
+              << "  -f file            input file of 'key<TAB>value' lines, default stdin\r\n"
+              << "  startup            '127.0.0.1:7000,127.0.0.1:7001'" << std::endl;
+}
+
+static double now_sec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char *argv[]) {
+    int conns = 4;
+    int inflight = 1000;
+    size_t batch = 100000;
+    const char *file = NULL;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "c:w:b:f:h"))!=-1 ) {
+        switch(opt) {
+        case 'c': conns = atoi(optarg); break;
+        case 'w': inflight = atoi(optarg); break;
+        case 'b': batch = strtoul(optarg, NULL, 10); break;
+        case 'f': file = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if( optind>=argc ) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *in = stdin;
+    if( file && !(in = fopen(file, "r")) ) {
+        perror(file);
+        return 1;
+    }
+
+    redis::cluster::Cluster *cluster = new redis::cluster::Cluster(5);
+    if( cluster->setup(argv[optind], false)!=0 ) {
+        std::cerr << "cluster setup fail" << std::endl;
+        return 1;
+    }
+
+    redis::cluster::BulkLoader loader(cluster, conns, inflight, batch);
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    uint64_t records = 0;
+    uint64_t skipped = 0;
+    uint64_t failed = 0;
+    double start = now_sec();
+    double last = start;
+
+    while( (len = getline(&line, &cap, in))>=0 ) {
+        if( len>0 && line[len - 1]=='\n' ) {
+            line[--len] = '\0';
+        }
+        char *tab = (char *)memchr(line, '\t', len);
+        if( !tab || tab==line ) {
+            skipped++;
+            continue;
+        }
+        int ret = loader.set(std::string(line, tab - line), std::string(tab + 1, line + len - (tab + 1)));
+        if( ret>0 ) {
+            failed += ret;
+        }
+        records++;
+
+        double now = now_sec();
+        if( now - last>=1 ) {
+            last = now;
+            std::cerr << records << " records, " << (uint64_t)(records / (now - start)) << " records/s" << std::endl;
+        }
+    }
+    failed += loader.flush();
+    double elapsed = now_sec() - start;
+
+    std::cout << records << " records loaded in " << elapsed << " seconds, "
+              << (uint64_t)(elapsed>0? records / elapsed: 0) << " records/s, "
+              << failed << " failed, " << skipped << " malformed lines skipped\r\n"
+              << loader.stat_dump();
+
+    free(line);
+    if( in!=stdin ) {
+        fclose(in);
+    }
+    delete cluster;
+    return failed>0? 2: 0;
+}
@@ -0,0 +1,277 @@
+/* Replay a traffic capture, see redis::cluster::Cluster::start_capture().
+ *
+ * Requests are re-issued against a cluster (a test cluster, or an in-process mock one)
+ * either at their original timing or as fast as possible. Requests of one captured
+ * thread are replayed in order by one worker, and the latency seen now is compared
+ * with the captured one, overall and per command.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <hiredis/hiredis.h>
+#include "../redis_cluster.h"
+#include "../test/mock_cluster.h"
+
+typedef redis::cluster::Cluster::CaptureRecordType RecordType;
+typedef redis::cluster::LatencyHistogram HistogramType;
+
+typedef struct {
+    HistogramType captured;
+    HistogramType replayed;
+} LatencyPairType;
+
+typedef struct {
+    int                                 id;
+    pthread_t                           tid;
+    redis::cluster::Cluster            *cluster;
+    double                              speed;      // 0 for as fast as possible
+    uint64_t                            base_us;    // local time of the first record
+    uint64_t                            first_us;   // timestamp of the first record
+    std::vector<const RecordType *>     records;
+    std::map<std::string, LatencyPairType> latency; // by command
+    uint64_t                            errors;
+    uint64_t                            captured_errors;
+    uint64_t                            max_behind_us;
+} WorkerType;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool by_time(const RecordType &a, const RecordType &b) {
+    return a.timestamp_us < b.timestamp_us;
+}
+
+static std::string to_upper(const std::string &in) {
+    std::string out = in;
+    for(size_t i = 0; i < out.length(); i++) {
+        out[i] = toupper((unsigned char)out[i]);
+    }
+    return out;
+}
+
+static void *worker_main(void *arg) {
+    WorkerType *worker = (WorkerType *)arg;
+
+    for(size_t i = 0; i < worker->records.size(); i++) {
+        const RecordType &rec = *worker->records[i];
+
+        if( worker->speed>0 ) {
+            uint64_t when = worker->base_us + (uint64_t)((rec.timestamp_us - worker->first_us) / worker->speed);
+            uint64_t now = now_us();
+            if( when>now ) {
+                usleep(when - now);
+            } else if( now - when>worker->max_behind_us ) {
+                worker->max_behind_us = now - when;
+            }
+        }
+
+        uint64_t begin = now_us();
+        redisReply *reply = worker->cluster->run(rec.commands);
+        uint64_t latency = now_us() - begin;
+
+        LatencyPairType &pair = worker->latency[to_upper(rec.commands[0])];
+        pair.captured.add(rec.latency_us);
+        pair.replayed.add(latency);
+        if( rec.err!=redis::cluster::Cluster::E_OK ) {
+            worker->captured_errors++;
+        }
+        if( !reply ) {
+            worker->errors++;
+            continue;
+        }
+        freeReplyObject(reply);
+    }
+    return NULL;
+}
+
+static void report_line(std::ostringstream &ss, const char *name, const HistogramType &hist) {
+    char line[160];
+    snprintf(line, sizeof(line), "  %-10s %10llu %8llu %8llu %8llu %8llu\r\n", name,
+             (unsigned long long)hist.count(),
+             (unsigned long long)hist.percentile(0.5), (unsigned long long)hist.percentile(0.9),
+             (unsigned long long)hist.percentile(0.99), (unsigned long long)hist.percentile(0.999));
+    ss << line;
+}
+
+static void report_diff(std::ostringstream &ss, const LatencyPairType &pair) {
+    const double p[] = {0.5, 0.9, 0.99, 0.999};
+    char line[160];
+    int len = snprintf(line, sizeof(line), "  %-10s %10s", "diff", "");
+    for(size_t i = 0; i < sizeof(p) / sizeof(p[0]); i++) {
+        long long diff = (long long)pair.replayed.percentile(p[i]) - (long long)pair.captured.percentile(p[i]);
+        len += snprintf(line + len, sizeof(line) - len, " %+8lld", diff);
+    }
+    ss << line << "\r\n";
+}
+
+static void usage(const char *prog) {
+    std::cerr << "usage: " << prog << " [-s speed] [-t threads] [-M nodes] file [startup]\r\n"
+              << "  -s speed    1 for the original timing (default), 2 for twice as fast, 0 for as fast as possible\r\n"
+              << "  -t threads  workers, default one per captured thread\r\n"
+              << "  -M nodes    replay against an in-process mock cluster of nodes masters\r\n"
+              << "  file        capture file, - for stdin\r\n"
+              << "  startup     '127.0.0.1:7000,127.0.0.1:7001'" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    double speed = 1;
+    int threads = 0;
+    int mock_nodes = 0;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "s:t:M:h"))!=-1 ) {
+        switch(opt) {
+        case 's': speed = atof(optarg); break;
+        case 't': threads = atoi(optarg); break;
+        case 'M': mock_nodes = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if( optind>=argc || (mock_nodes<=0 && optind + 1>=argc) || speed<0 ) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    /* load the whole capture, records of different threads are not in time order in the file */
+
+    bool from_stdin = strcmp(argv[optind], "-")==0;
+    FILE *in = from_stdin ? stdin : fopen(argv[optind], "r");
+    if( !in ) {
+        perror(argv[optind]);
+        return 1;
+    }
+    std::vector<RecordType> records;
+    RecordType rec;
+    int ret;
+    bool header_read = false;
+    std::map<uint32_t, int> captured_threads;  // captured thread -> dense index
+    while( (ret = redis::cluster::Cluster::read_capture(in, rec, header_read))>0 ) {
+        if( rec.commands.size()<2 ) {
+            continue;
+        }
+        records.push_back(rec);
+        captured_threads.insert(std::make_pair(rec.thread, (int)captured_threads.size()));
+    }
+    if( !from_stdin ) {
+        fclose(in);
+    }
+    if( ret<0 ) {
+        std::cerr << argv[optind] << ": bad capture file, replaying the " << records.size() << " records before the error" << std::endl;
+    }
+    if( records.empty() ) {
+        std::cerr << "no records" << std::endl;
+        return 1;
+    }
+    std::stable_sort(records.begin(), records.end(), by_time);
+    if( threads<=0 ) {
+        threads = captured_threads.size();
+    }
+
+    MockCluster mock;
+    std::string startup;
+    if( mock_nodes>0 ) {
+        if( mock.start(mock_nodes)!=0 ) {
+            std::cerr << "mock cluster start fail" << std::endl;
+            return 1;
+        }
+        startup = mock.startup();
+    } else {
+        startup = argv[optind + 1];
+    }
+
+    redis::cluster::Cluster *cluster = new redis::cluster::Cluster(5);
+    if( cluster->setup(startup.c_str(), false)!=0 ) {
+        std::cerr << "cluster setup fail" << std::endl;
+        return 1;
+    }
+
+    std::vector<WorkerType> workers(threads);
+    for(int i = 0; i < threads; i++) {
+        workers[i].id = i;
+        workers[i].cluster = cluster;
+        workers[i].speed = speed;
+        workers[i].first_us = records[0].timestamp_us;
+        workers[i].errors = 0;
+        workers[i].captured_errors = 0;
+        workers[i].max_behind_us = 0;
+    }
+    for(size_t i = 0; i < records.size(); i++) {
+        workers[captured_threads[records[i].thread] % threads].records.push_back(&records[i]);
+    }
+
+    uint64_t start = now_us();
+    for(int i = 0; i < threads; i++) {
+        workers[i].base_us = start;
+        if( pthread_create(&workers[i].tid, NULL, worker_main, &workers[i])!=0 ) {
+            std::cerr << "create thread fail" << std::endl;
+            return 1;
+        }
+    }
+
+    std::map<std::string, LatencyPairType> latency;
+    LatencyPairType all;
+    uint64_t errors = 0;
+    uint64_t captured_errors = 0;
+    uint64_t max_behind = 0;
+    for(int i = 0; i < threads; i++) {
+        WorkerType &w = workers[i];
+        pthread_join(w.tid, NULL);
+        std::map<std::string, LatencyPairType>::iterator iter = w.latency.begin();
+        for(; iter != w.latency.end(); iter++) {
+            latency[iter->first].captured.merge(iter->second.captured);
+            latency[iter->first].replayed.merge(iter->second.replayed);
+            all.captured.merge(iter->second.captured);
+            all.replayed.merge(iter->second.replayed);
+        }
+        errors += w.errors;
+        captured_errors += w.captured_errors;
+        if( w.max_behind_us>max_behind ) {
+            max_behind = w.max_behind_us;
+        }
+    }
+    double elapsed = (now_us() - start) / 1000000.0;
+    double captured_elapsed = (records.back().timestamp_us - records[0].timestamp_us) / 1000000.0;
+
+    std::ostringstream ss;
+    ss << "replayed " << records.size() << " records with " << threads << " threads in " << elapsed
+       << "s (captured over " << captured_elapsed << "s)";
+    if( speed>0 ) {
+        ss << ", at most " << max_behind << "us behind schedule";
+    }
+    ss << "\r\nerrors: captured " << captured_errors << ", replayed " << errors << "\r\n";
+    ss << "latency(us)         count      p50      p90      p99     p999\r\n";
+
+    std::map<std::string, LatencyPairType>::iterator iter = latency.begin();
+    for(; iter != latency.end(); iter++) {
+        ss << iter->first << "\r\n";
+        report_line(ss, "captured", iter->second.captured);
+        report_line(ss, "replayed", iter->second.replayed);
+        report_diff(ss, iter->second);
+    }
+    ss << "ALL\r\n";
+    report_line(ss, "captured", all.captured);
+    report_line(ss, "replayed", all.replayed);
+    report_diff(ss, all);
+    std::cout << ss.str();
+
+    delete cluster;
+    if( mock_nodes>0 ) {
+        mock.stop();
+    }
+    return errors>0? 2: 0;
+}
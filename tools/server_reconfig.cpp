@@ -1,55 +1,82 @@
 /* For testing client functions, this program automatically changes the cluster servers
  *
- * It uses ./redis-trib.rb(see http://redis.io/topics/cluster-tutorial) and ./redis-cli commands
- * so before run the program you should make sure redis-trib.rb and redis-cli already existed in
- * the CURRENT directory
+ * Every round it checks (and fixes, if necessary) the cluster, reshards a random number of
+ * slots from the biggest master to the others and fails over one master to its slave.
+ * It talks to the servers directly, with the connections of redis::cluster::Node:
+ * a slot is moved by CLUSTER SETSLOT IMPORTING/MIGRATING, a loop of CLUSTER GETKEYSINSLOT
+ * and pipelined MIGRATE ... KEYS batches, then CLUSTER SETSLOT NODE, several slots at once.
  */
 #include <stdint.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <string.h>
-#include <unistd.h>
 #include <stdlib.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
 #include <iostream>
 #include <list>
+#include <map>
 #include <vector>
 #include <cassert>
 #include <sstream>
+#include <hiredis/hiredis.h>
+#include "../redis_cluster.h"
 
 
 #ifdef DEBUG
-#define DBG_TRACE_CMD(cmd) fprintf(stderr, "[CMD] %s %s\r\n", cur_time(), cmd)
-#define DBG_SHELL_QUIET ""
+#define DBG_TRACE_CMD(format, args...) fprintf(stderr, "[CMD] %s " format "\r\n", cur_time(), ##args)
 #else
-#define DBG_TRACE_CMD(cmd)
-#define DBG_SHELL_QUIET " 2>&1 >/dev/null"
+#define DBG_TRACE_CMD(format, args...)
 #endif
 
 #define DBG_ERR(format, args...) fprintf(stderr, "[WARN] %s " format "\r\n", cur_time(), ##args)
 #define DBG_INFO(format, args...) fprintf(stderr, "[INFO] %s " format "\r\n", cur_time(), ##args)
 
-#define MAX_LINE_LEN 300
+#define HASH_SLOTS 16384
 
 typedef struct {
     std::string id;
     std::string host;
     std::string port;
+    redis::cluster::Node *server;   // connection pool, owned by g_servers
 } Node;
 typedef std::list<Node *> NodeSet;
 
 typedef struct {
-    uint32_t slots;
-    NodeSet  nodes;  // node in front is master, others are slaves
+    uint32_t         slots;
+    std::vector<int> slot_set;  // slots covered by the Master
+    NodeSet          nodes;     // node in front is master, others are slaves
 } Group;
 typedef std::list<Group *> GroupSet;
 
 typedef struct {
-    std::string  unit;  // first slot set  covered by the Master, like '1132-3345' or '8893'
-    uint32_t     count; // total slot count covered by the Master
-} SlotsDistr;
+    int          parallel;      // slots migrated at the same time
+    unsigned int batch;         // keys per MIGRATE
+    unsigned int pipeline;      // MIGRATE commands in flight per slot
+    unsigned int timeout_ms;    // MIGRATE timeout
+    unsigned int throttle_us;   // pause between batches of one slot
+    bool         replace;       // MIGRATE ... REPLACE
+} ReshardConf;
+
+typedef struct {
+    int  slot;
+    Node *from;
+    Node *to;
+} SlotMove;
+
+typedef struct {
+    const std::vector<SlotMove> *moves;
+    const NodeSet               *masters;   // told the new owner at last
+    volatile int                 next;
+    volatile int                 failed;
+    uint64_t                     keys;
+} MoveJob;
 
 
 GroupSet g_cluster;
+ReshardConf g_conf = {4, 100, 4, 5000, 0, false};
+std::map<std::string, redis::cluster::Node *> g_servers;    // by host:port
 
 char *cur_time() {
     static char cur_time_buf[50];
@@ -61,55 +88,141 @@ char *cur_time() {
     return cur_time_buf;
 }
 
-/* note: the length of line output by running command 'cmd', and 'check_exist' should be no more than MAX_LINE_LEN
-*/
-bool run_shell(const char *cmd, const char *check_exist) {
-
-    char chkcmd[MAX_LINE_LEN + MAX_LINE_LEN + 50];
-    snprintf(chkcmd, sizeof(chkcmd), "%s |grep -q -F \"%s\"" DBG_SHELL_QUIET,cmd, check_exist);
-    DBG_TRACE_CMD(chkcmd);
-    int ret = system(chkcmd);
-    if(WIFEXITED(ret) && WEXITSTATUS(ret) == 0) {
-        return true;
-    } else {
-        return false;
+double now_sec() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+redis::cluster::Node *get_server(const std::string &host, const std::string &port) {
+    std::string addr = host + ":" + port;
+    std::map<std::string, redis::cluster::Node *>::iterator it = g_servers.find(addr);
+    if( it!=g_servers.end() ) {
+        return it->second;
     }
+    redis::cluster::Node *server = new redis::cluster::Node(host, atoi(port.c_str()), 5);
+    g_servers[addr] = server;
+    return server;
 }
 
+/* run one command on the server, the caller frees the reply; NULL on io error
+ */
+redisReply *run(redis::cluster::Node *server, const std::vector<std::string> &cmd) {
+    redisContext *conn = (redisContext *)server->get_conn();
+    if( !conn ) {
+        DBG_ERR("connect to %s:%u fail", server->host().c_str(), server->port());
+        return NULL;
+    }
+
+    std::vector<const char *> argv(cmd.size());
+    std::vector<size_t> argvlen(cmd.size());
+    for(size_t i = 0; i < cmd.size(); i++) {
+        argv[i] = cmd[i].data();
+        argvlen[i] = cmd[i].length();
+    }
+    DBG_TRACE_CMD("%s:%u %s %s", server->host().c_str(), server->port(), cmd[0].c_str(), cmd.size()>1? cmd[1].c_str(): "");
 
-/* note: the length of line output by running command 'cmd', and 'check' should be no more than MAX_LINE_LEN
-*/
-bool run_shell(const char *cmd, const char *check, std::vector<std::string> &output) {
-    int idx_last;
-    output.clear();
+    redisReply *reply = (redisReply *)redisCommandArgv(conn, argv.size(), &argv[0], &argvlen[0]);
+    if( !reply ) {
+        DBG_ERR("%s:%u %s: %s", server->host().c_str(), server->port(), cmd[0].c_str(), conn->errstr);
+    }
+    server->put_conn(conn);
+    return reply;
+}
 
-    DBG_TRACE_CMD(cmd);
+redisReply *run(redis::cluster::Node *server, const char *a0, const char *a1, const char *a2 = NULL,
+                const char *a3 = NULL, const char *a4 = NULL) {
+    std::vector<std::string> cmd;
+    const char *args[] = {a0, a1, a2, a3, a4};
+    for(size_t i = 0; i < sizeof(args) / sizeof(args[0]) && args[i]; i++) {
+        cmd.push_back(args[i]);
+    }
+    return run(server, cmd);
+}
 
-    FILE *result = popen(cmd, "r");
-    if(!result) {
-        perror(NULL);
+/* run a command expected to answer OK
+ */
+bool run_ok(redis::cluster::Node *server, const char *a0, const char *a1, const char *a2 = NULL,
+            const char *a3 = NULL, const char *a4 = NULL) {
+    redisReply *reply = run(server, a0, a1, a2, a3, a4);
+    if( !reply ) {
         return false;
     }
+    bool ok = reply->type!=REDIS_REPLY_ERROR;
+    if( !ok ) {
+        DBG_ERR("%s:%u %s %s %s: %s", server->host().c_str(), server->port(), a0, a1, a2? a2: "", reply->str);
+    }
+    freeReplyObject(reply);
+    return ok;
+}
+
+/* one line of CLUSTER NODES:
+ * <id> <ip:port@cport> <flags> <master> <ping-sent> <pong-recv> <config-epoch> <link-state> <slot> ...
+ */
+typedef struct {
+    std::string              id;
+    std::string              host;
+    std::string              port;
+    std::string              flags;
+    std::string              master;
+    std::vector<int>         slots;
+    std::map<int, std::string> migrating;  // slot -> destination id, only shown for myself
+    std::map<int, std::string> importing;  // slot -> source id, only shown for myself
+} NodeLine;
+
+bool has_flag(const NodeLine &line, const char *flag) {
+    std::string flags = "," + line.flags + ",";
+    return flags.find(std::string(",") + flag + ",")!=std::string::npos;
+}
 
-    char buf[MAX_LINE_LEN];
-    char chkcmd[MAX_LINE_LEN + MAX_LINE_LEN + 50];
+bool cluster_nodes(redis::cluster::Node *server, std::vector<NodeLine> &lines) {
+    lines.clear();
+    redisReply *reply = run(server, "CLUSTER", "NODES");
+    if( !reply ) {
+        return false;
+    }
+    if( reply->type!=REDIS_REPLY_STRING ) {
+        DBG_ERR("cluster nodes of %s:%u: %s", server->host().c_str(), server->port(),
+                reply->type==REDIS_REPLY_ERROR? reply->str: "unexpected reply");
+        freeReplyObject(reply);
+        return false;
+    }
 
-    while(fgets(buf,sizeof(buf),result)) {
-        idx_last = strlen(buf) - 1;
-        if(idx_last >= 0 && buf[idx_last] == '\n') {
-            buf[idx_last] = '\0';
+    std::istringstream in(std::string(reply->str, reply->len));
+    freeReplyObject(reply);
+    std::string text;
+    while( std::getline(in, text) ) {
+        std::istringstream fields(text);
+        NodeLine line;
+        std::string addr, ping, pong, epoch, link, slot;
+        if( !(fields >> line.id >> addr >> line.flags >> line.master >> ping >> pong >> epoch >> link) ) {
+            continue;
         }
-        snprintf(chkcmd, sizeof(chkcmd), "echo \"%s\"|grep -q -E \"%s\"" DBG_SHELL_QUIET, buf, check);
-        DBG_TRACE_CMD(chkcmd);
-        int ret = system(chkcmd);
-        if(WIFEXITED(ret) && WEXITSTATUS(ret) != 0) {
-            DBG_ERR("check \"%s\" fail", chkcmd);
-            fclose(result);
-            return false;
+        size_t pos_port = addr.rfind(':', addr.find('@'));
+        if( pos_port==std::string::npos ) {
+            continue;
         }
-        output.push_back(buf);
+        line.host = addr.substr(0, pos_port);
+        line.port = addr.substr(pos_port + 1, addr.find('@') - pos_port - 1);
+
+        while( fields >> slot ) {
+            size_t pos;
+            if( slot[0]=='[' ) {
+                if( (pos = slot.find("->-"))!=std::string::npos ) {
+                    line.migrating[atoi(slot.c_str() + 1)] = slot.substr(pos + 3, slot.length() - pos - 4);
+                } else if( (pos = slot.find("-<-"))!=std::string::npos ) {
+                    line.importing[atoi(slot.c_str() + 1)] = slot.substr(pos + 3, slot.length() - pos - 4);
+                }
+            } else if( (pos = slot.find('-'))!=std::string::npos ) {
+                for(int s = atoi(slot.c_str()); s <= atoi(slot.c_str() + pos + 1); s++) {
+                    line.slots.push_back(s);
+                }
+            } else {
+                line.slots.push_back(atoi(slot.c_str()));
+            }
+        }
+        lines.push_back(line);
     }
-    fclose(result);
     return true;
 }
 
@@ -129,72 +242,44 @@ void clear_servers() {
     g_cluster.clear();
 
 }
+
+Node *new_node(const NodeLine &line) {
+    Node *node = new Node;
+    assert(node);
+    node->id = line.id;
+    node->host = line.host;
+    node->port = line.port;
+    node->server = get_server(line.host, line.port);
+    return node;
+}
+
 void load_servers(std::string &host, std::string &port) {
 
     static unsigned int rand_grop_seed = (unsigned int)time(NULL);
-    std::vector<SlotsDistr> slots_distr;
-
-    char cmd[MAX_LINE_LEN];
-    std::vector<std::string> output;
+    std::vector<NodeLine> lines;
 
     clear_servers();
 
-    /* get slots distributions */
-
-    snprintf(cmd, sizeof(cmd), "./redis-trib.rb check %s:%s "
-             "|grep -F \") master\" "
-             "|sed 's/: (0 slots)/:- (0 slots)/g'" // for master who have 0 slot
-             "|tr \", \" \":\""
-             "|awk -F: '{print $5\"(\"$0}'"
-             "|awk -F\\( '{print $1\" \"$3}'"
-             "|awk -F: '{print $1}'", host.c_str(), port.c_str());
-    if(!run_shell(cmd, "^[0-9-]+ [0-9]+$", output)) { /* check string like '1132-3345 8893' or '1132 8893'*/
+    if( !cluster_nodes(get_server(host, port), lines) ) {
         return;
     }
-    for(size_t idx = 0; idx < output.size(); idx++) {
-        size_t pos = output[idx].find(' ');
-        SlotsDistr sld = {output[idx].substr(0, pos), atoi(output[idx].substr(pos+1).c_str())};
-        slots_distr.push_back(sld);
-    }
-
-    /* get all masters */
 
-    for(size_t idx = 0; idx < slots_distr.size(); idx++) {
+    /* get all masters, with their slots */
 
-        /* filter specific master node by it's first slot set
-           sed 's/connected$/connected -/g' : for master who have 0 slot
-           grep -E \"connected.* %s\" : for master who have slots number less than 10
-         */
-        snprintf(cmd, sizeof(cmd), "echo \"cluster nodes\" | ./redis-cli -h %s -p %s "
-                 "|grep -F \"master - \" |sed 's/connected$/connected -/g' |grep -E \"connected.* %s\" |awk  '{print $1\" \"$2}'",
-                 host.c_str(), port.c_str(), slots_distr[idx].unit.c_str());
-
-        if(!run_shell(cmd, "^[a-z0-9]+ [0-9.]+:[0-9]+$", output)) { /* check string like 'ee6a90e9e077cdeec98aede832b485b997821188 192.168.102.43:7003' */
-            clear_servers();
-            return;
-        }
-        if(output.size() != 1) {
-            clear_servers();
-            return;  // if server is abnormal
+    std::map<std::string, Group *> groups;  // by master id
+    for(size_t idx = 0; idx < lines.size(); idx++) {
+        const NodeLine &line = lines[idx];
+        if( !has_flag(line, "master") || has_flag(line, "fail") || has_flag(line, "handshake") || has_flag(line, "noaddr") ) {
+            continue;
         }
-
-        /* save master's id address and slots count */
-
-        size_t pos_addr = output[0].find(' ');
-        size_t pos_port = output[0].find(':');
-
-        Node *node = new Node;
-        assert(node);
-        node->id = output[0].substr(0, pos_addr);
-        node->host = output[0].substr(pos_addr + 1, (pos_port - pos_addr) - 1);
-        node->port = output[0].substr(pos_port + 1);
-        //DBG_INFO("get master node [%s] [%s]:[%s]", node->id.c_str(), node->host.c_str(), node->port.c_str() );
         Group *grp = new Group;
         assert(grp);
-        grp->nodes.push_back(node);
-        grp->slots = slots_distr[idx].count;
+        grp->nodes.push_back(new_node(line));
+        grp->slot_set = line.slots;
+        grp->slots = line.slots.size();
 
         g_cluster.push_back(grp);
+        groups[line.id] = grp;
     }
 
     if(g_cluster.size() == 0) {
@@ -202,6 +287,17 @@ void load_servers(std::string &host, std::string &port) {
         return;
     }
 
+    /* get all connected slaves per master */
+
+    for(size_t idx = 0; idx < lines.size(); idx++) {
+        const NodeLine &line = lines[idx];
+        std::map<std::string, Group *>::iterator itm = groups.find(line.master);
+        if( !has_flag(line, "slave") || has_flag(line, "fail") || itm==groups.end() ) {
+            continue;
+        }
+        itm->second->nodes.push_back(new_node(line));
+    }
+
     //put a group to header randomly
 
     size_t distance = rand_r(&rand_grop_seed) % g_cluster.size();
@@ -213,40 +309,6 @@ void load_servers(std::string &host, std::string &port) {
         g_cluster.insert(g_cluster.begin(), grp);
     }
 
-    /* get all slaves per master */
-
-    itg = g_cluster.begin();
-    for(; itg != g_cluster.end(); itg++) {
-        Group *grp = *itg;
-        NodeSet::iterator itn = grp->nodes.begin();
-        assert(itn != grp->nodes.end());
-        Node *node = *itn;
-
-        snprintf(cmd, sizeof(cmd), "echo \"cluster slaves %s \" | ./redis-cli -h %s -p %s "
-                 "|grep -E \" connected$\" "
-                 "|tr  \"\\\"\" \" \""
-                 "|awk '{print $1\" \"$2}'",
-                 node->id.c_str(), host.c_str(), port.c_str());
-
-        if(!run_shell(cmd, "^[a-z0-9]+ [0-9.]+:[0-9]+$", output)) { /* check string like 'b854c21f83132f6f1b6266f4ef1443bfcd04bb42 192.168.102.43:7008' */
-            clear_servers();
-            return;
-        }
-        for(size_t idx = 0; idx < output.size(); idx++) {
-            size_t pos_addr = output[idx].find(' ');
-            size_t pos_port = output[idx].find(':');
-
-            Node *node = new Node;
-            assert(node);
-            node->id = output[idx].substr(0, pos_addr);
-            node->host = output[idx].substr(pos_addr + 1, (pos_port - pos_addr) - 1);
-            node->port = output[idx].substr(pos_port + 1);
-            //DBG_INFO("get slave node [%s] [%s]:[%s]", node->id.c_str(), node->host.c_str(), node->port.c_str() );
-
-            grp->nodes.push_back(node);
-        }
-    }
-
     std::ostringstream ss;
     ss << "load_servers got servers:\r\n";
     itg = g_cluster.begin();
@@ -265,21 +327,299 @@ void load_servers(std::string &host, std::string &port) {
     DBG_INFO("%s", ss.str().c_str());
 }
 
+NodeSet masters() {
+    NodeSet nodes;
+    for(GroupSet::iterator itg = g_cluster.begin(); itg != g_cluster.end(); itg++) {
+        nodes.push_back((*itg)->nodes.front());
+    }
+    return nodes;
+}
+
+Node *find_master(const std::string &id) {
+    for(GroupSet::iterator itg = g_cluster.begin(); itg != g_cluster.end(); itg++) {
+        if( (*itg)->nodes.front()->id==id ) {
+            return (*itg)->nodes.front();
+        }
+    }
+    return NULL;
+}
+
+/* move the keys left in slot, a batch of keys per MIGRATE and up to pipeline MIGRATEs in flight
+ *
+ * @return
+ *   >=0 - keys moved
+ *    <0 - fail
+ */
+int64_t migrate_keys(int slot, Node *from, Node *to) {
+    char slot_str[16], count_str[16], timeout_str[16];
+    snprintf(slot_str, sizeof(slot_str), "%d", slot);
+    snprintf(count_str, sizeof(count_str), "%u", g_conf.batch * g_conf.pipeline);
+    snprintf(timeout_str, sizeof(timeout_str), "%u", g_conf.timeout_ms);
+
+    int64_t moved = 0;
+    for(;;) {
+        redisReply *keys = run(from->server, "CLUSTER", "GETKEYSINSLOT", slot_str, count_str);
+        if( !keys ) {
+            return -1;
+        }
+        if( keys->type!=REDIS_REPLY_ARRAY ) {
+            DBG_ERR("getkeysinslot %d from %s fail: %s", slot, from->id.c_str(),
+                    keys->type==REDIS_REPLY_ERROR? keys->str: "unexpected reply");
+            freeReplyObject(keys);
+            return -1;
+        }
+        if( keys->elements==0 ) {
+            freeReplyObject(keys);
+            return moved;
+        }
+
+        redisContext *conn = (redisContext *)from->server->get_conn();
+        if( !conn ) {
+            freeReplyObject(keys);
+            return -1;
+        }
+
+        /* MIGRATE host port "" 0 timeout [REPLACE] KEYS key ... */
+
+        std::vector<const char *> argv;
+        std::vector<size_t> argvlen;
+        const char *head[] = {"MIGRATE", to->host.c_str(), to->port.c_str(), "", "0", timeout_str, "REPLACE", "KEYS"};
+        size_t sent = 0;
+        size_t idx = 0;
+        while( idx < keys->elements ) {
+            argv.clear();
+            argvlen.clear();
+            for(size_t i = 0; i < sizeof(head) / sizeof(head[0]); i++) {
+                if( i==6 && !g_conf.replace ) {
+                    continue;
+                }
+                argv.push_back(head[i]);
+                argvlen.push_back(strlen(head[i]));
+            }
+            for(size_t end = idx + g_conf.batch; idx < keys->elements && idx < end; idx++) {
+                argv.push_back(keys->element[idx]->str);
+                argvlen.push_back(keys->element[idx]->len);
+            }
+            redisAppendCommandArgv(conn, argv.size(), &argv[0], &argvlen[0]);
+            sent++;
+        }
+        DBG_TRACE_CMD("migrate %zu keys of slot %d in %zu batches", keys->elements, slot, sent);
+
+        bool ok = true;
+        bool broken = false;
+        for(size_t i = 0; i < sent; i++) {
+            redisReply *reply = NULL;
+            if( redisGetReply(conn, (void **)&reply)!=REDIS_OK ) {
+                DBG_ERR("migrate slot %d from %s fail: %s", slot, from->id.c_str(), conn->errstr);
+                ok = false;
+                broken = true;
+                break;
+            }
+            if( reply->type==REDIS_REPLY_ERROR ) {
+                DBG_ERR("migrate slot %d from %s fail: %s", slot, from->id.c_str(), reply->str);
+                ok = false;
+            }
+            freeReplyObject(reply);
+        }
+        if( broken ) {
+            /* replies are left unread, the connection is out of sync with the pool's users */
+            redisFree(conn);
+        } else {
+            from->server->put_conn(conn);
+        }
+        if( ok ) {
+            moved += keys->elements;
+        }
+        freeReplyObject(keys);
+
+        if( !ok ) {
+            return -1;
+        }
+        if( g_conf.throttle_us>0 ) {
+            usleep(g_conf.throttle_us);
+        }
+    }
+}
+
+/* set the new owner on both ends first, then tell the other masters
+ */
+bool set_slot_owner(int slot, Node *to, const NodeSet &nodes) {
+    char slot_str[16];
+    snprintf(slot_str, sizeof(slot_str), "%d", slot);
+
+    bool ok = run_ok(to->server, "CLUSTER", "SETSLOT", slot_str, "NODE", to->id.c_str());
+    for(NodeSet::const_iterator itn = nodes.begin(); itn != nodes.end(); itn++) {
+        if( *itn!=to ) {
+            ok = run_ok((*itn)->server, "CLUSTER", "SETSLOT", slot_str, "NODE", to->id.c_str()) && ok;
+        }
+    }
+    return ok;
+}
+
+/* move one slot as redis-trib does
+ *
+ * @return
+ *   >=0 - keys moved
+ *    <0 - fail
+ */
+int64_t move_slot(const SlotMove &move, const NodeSet &nodes) {
+    char slot_str[16];
+    snprintf(slot_str, sizeof(slot_str), "%d", move.slot);
+
+    if( !run_ok(move.to->server, "CLUSTER", "SETSLOT", slot_str, "IMPORTING", move.from->id.c_str()) ||
+        !run_ok(move.from->server, "CLUSTER", "SETSLOT", slot_str, "MIGRATING", move.to->id.c_str()) ) {
+        return -1;
+    }
+    int64_t keys = migrate_keys(move.slot, move.from, move.to);
+    if( keys<0 ) {
+        return -1;
+    }
+
+    /* the source comes right after the target, so it stops answering ASK as soon as possible */
+
+    NodeSet order = nodes;
+    order.remove(move.from);
+    order.push_front(move.from);
+    return set_slot_owner(move.slot, move.to, order)? keys: -1;
+}
+
+void *move_worker(void *arg) {
+    MoveJob *job = (MoveJob *)arg;
+    for(;;) {
+        int idx = __sync_fetch_and_add(&job->next, 1);
+        if( idx >= (int)job->moves->size() || job->failed ) {
+            break;
+        }
+        int64_t keys = move_slot((*job->moves)[idx], *job->masters);
+        if( keys<0 ) {
+            DBG_ERR("move slot %d fail", (*job->moves)[idx].slot);
+            __sync_fetch_and_add(&job->failed, 1);
+            break;
+        }
+        __sync_fetch_and_add(&job->keys, (uint64_t)keys);
+    }
+    return NULL;
+}
+
+/* move the slots, g_conf.parallel of them at the same time
+ */
+bool move_slots(const std::vector<SlotMove> &moves) {
+    NodeSet nodes = masters();
+    MoveJob job = {&moves, &nodes, 0, 0, 0};
+    double start = now_sec();
+
+    int parallel = g_conf.parallel < (int)moves.size()? g_conf.parallel: (int)moves.size();
+    std::vector<pthread_t> tids(parallel);
+    for(int i = 0; i < parallel; i++) {
+        if( pthread_create(&tids[i], NULL, move_worker, &job)!=0 ) {
+            DBG_ERR("create move thread fail");
+            __sync_fetch_and_add(&job.failed, 1);
+            tids.resize(i);
+            break;
+        }
+    }
+    for(size_t i = 0; i < tids.size(); i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    double elapsed = now_sec() - start;
+    DBG_INFO("moved %d/%zu slots, %llu keys in %.3f seconds (%.0f keys/s)",
+             job.next < (int)moves.size()? job.next: (int)moves.size(), moves.size(),
+             (unsigned long long)job.keys, elapsed, elapsed>0? job.keys / elapsed: 0);
+    return job.failed==0;
+}
+
+/* check every master agrees on the slots and none is left open, close open slots
+ *
+ * @return
+ *   true  - the cluster is ok
+ *   false - not yet
+ */
+bool check_cluster(std::string &host, std::string &port, bool fix) {
+    load_servers(host, port);
+    if( g_cluster.size()==0 ) {
+        return false;
+    }
+
+    bool ok = true;
+    std::vector<int> owner(HASH_SLOTS, -1);
+    int idx = 0;
+    for(GroupSet::iterator itg = g_cluster.begin(); itg != g_cluster.end(); itg++, idx++) {
+        for(size_t i = 0; i < (*itg)->slot_set.size(); i++) {
+            owner[(*itg)->slot_set[i]] = idx;
+        }
+    }
+    for(int slot = 0; slot < HASH_SLOTS; slot++) {
+        if( owner[slot]<0 ) {
+            DBG_ERR("check_cluster: slot %d is not covered", slot);
+            ok = false;
+            break;
+        }
+    }
+
+    NodeSet nodes = masters();
+    for(NodeSet::iterator itn = nodes.begin(); itn != nodes.end(); itn++) {
+        Node *node = *itn;
+        std::vector<NodeLine> lines;
+        if( !cluster_nodes(node->server, lines) ) {
+            ok = false;
+            continue;
+        }
+        for(size_t i = 0; i < lines.size(); i++) {
+            const NodeLine &line = lines[i];
+            if( has_flag(line, "master") && line.slots.size()>0 && (!find_master(line.id) ||
+                find_master(line.id)->server!=get_server(line.host, line.port)) ) {
+                DBG_ERR("check_cluster: %s:%s doesn't agree on master %s", node->host.c_str(), node->port.c_str(), line.id.c_str());
+                ok = false;
+            }
+            if( !has_flag(line, "myself") ) {
+                continue;
+            }
+
+            std::map<int, std::string>::const_iterator its = line.migrating.begin();
+            for(; its != line.migrating.end(); its++) {
+                DBG_ERR("check_cluster: slot %d is migrating from %s to %s", its->first, line.id.c_str(), its->second.c_str());
+                ok = false;
+                Node *to = find_master(its->second);
+                if( fix && to ) {
+                    SlotMove move = {its->first, node, to};
+                    move_slot(move, nodes);
+                }
+            }
+            for(its = line.importing.begin(); its != line.importing.end(); its++) {
+                DBG_ERR("check_cluster: slot %d is importing from %s to %s", its->first, its->second.c_str(), line.id.c_str());
+                ok = false;
+                Node *from = find_master(its->second);
+                if( fix && from ) {
+                    char slot_str[16];
+                    snprintf(slot_str, sizeof(slot_str), "%d", its->first);
+                    std::vector<NodeLine> from_lines;
+                    bool migrating = false;
+                    if( cluster_nodes(from->server, from_lines) ) {
+                        for(size_t j = 0; j < from_lines.size(); j++) {
+                            if( has_flag(from_lines[j], "myself") && from_lines[j].migrating.count(its->first) ) {
+                                migrating = true;
+                            }
+                        }
+                    }
+                    if( !migrating ) {
+                        run_ok(node->server, "CLUSTER", "SETSLOT", slot_str, "STABLE");
+                    }
+                }
+            }
+        }
+    }
+    return ok;
+}
+
 void fix_cluster(std::string &host, std::string &port) {
 #define CLUSTER_FIX_ROUNDS 5
 
-    char cmd[MAX_LINE_LEN];
-
     int retry = 0;
     for(; retry < CLUSTER_FIX_ROUNDS; retry++,sleep(5)) {
         DBG_INFO("fix_cluster: check and fix(if necessary) round %d/%d...", retry + 1, CLUSTER_FIX_ROUNDS);
 
-        snprintf(cmd, sizeof(cmd), "./redis-trib.rb fix %s:%s 2>&1 >/dev/null", host.c_str(), port.c_str());
-        DBG_TRACE_CMD(cmd);
-        system(cmd);
-
-        snprintf(cmd, sizeof(cmd), "./redis-trib.rb check %s:%s", host.c_str(), port.c_str());
-        if(!run_shell(cmd, "[WARNING]") && !run_shell(cmd, "[ERR]")) {
+        if( check_cluster(host, port, true) ) {
             DBG_INFO("fix_cluster: check/fix successful");
             break;
         }
@@ -291,8 +631,6 @@ void fix_cluster(std::string &host, std::string &port) {
 }
 
 void failover(std::string &host, std::string &port) {
-    char cmd[MAX_LINE_LEN];
-
     load_servers(host, port);
 
     if(g_cluster.size() < 1) {
@@ -311,13 +649,9 @@ void failover(std::string &host, std::string &port) {
     grp->nodes.pop_front();       // move master node to tail
     grp->nodes.push_back(node);
     node =  *(grp->nodes.begin());// failover
-    snprintf(cmd, sizeof(cmd), "echo \"cluster failover\" | ./redis-cli -h %s -p %s" DBG_SHELL_QUIET,
-             node->host.c_str(), node->port.c_str());
     DBG_INFO("failover %s:%s begin...",node->host.c_str(), node->port.c_str());
 
-    DBG_TRACE_CMD(cmd);
-    int ret = system(cmd);
-    if(WIFEXITED(ret) && WEXITSTATUS(ret) != 0) {
+    if( !run_ok(node->server, "CLUSTER", "FAILOVER") ) {
         DBG_ERR("failover %s:%s fail",node->host.c_str(), node->port.c_str());
         return;
     }
@@ -329,7 +663,6 @@ void failover(std::string &host, std::string &port) {
 void reshard(std::string &host, std::string &port) {
     Group *grp_from;
     Group *grp_to;
-    char cmd[MAX_LINE_LEN];
 
     load_servers(host, port);
 
@@ -346,65 +679,89 @@ void reshard(std::string &host, std::string &port) {
             grp_from = grp_to;
         }
     }
+    if(grp_from->slots < 2) {
+        DBG_ERR("reshard: too few slots in source group");
+        return;
+    }
 
     uint32_t left_count = (uint32_t)(100000*(rand()/(RAND_MAX+0.1))) % (grp_from->slots/2);
     while(left_count == 0) {
         left_count = (uint32_t)(100000*(rand()/(RAND_MAX+0.1))) % (grp_from->slots/2);
     }
     uint32_t every_count = left_count / (g_cluster.size() - 1);
-    Node    *snode;
+    Node    *snode = grp_from->nodes.front();
     Node    *dnode;
     uint32_t count;
-    NodeSet::iterator itn = grp_from->nodes.begin();
-    if(itn == grp_from->nodes.end()) {
-        DBG_ERR("reshard: no node exists in source group");
-        return;
-    }
-    snode = *itn;
 
+    /* hand out the source's last slots, every_count per destination, the remainder to the last one */
+
+    std::vector<SlotMove> moves;
+    size_t next = grp_from->slot_set.size();
     itg = g_cluster.begin();
-    for(; itg != g_cluster.end(); itg++) {
+    for(; itg != g_cluster.end() && left_count > 0; itg++) {
         if(*itg == grp_from) {
             continue;
         }
 
         grp_to = *itg;
-        itn = grp_to->nodes.begin();
-        if(itn == grp_to->nodes.end()) {
-            DBG_ERR("reshard: no node exists in destination group");
-            return;
-        }
-        dnode  = *itn;
+        dnode  = grp_to->nodes.front();
 
-        if(left_count - every_count >= every_count) {
+        if(left_count - every_count >= every_count && every_count > 0) {
             count = every_count; // not last destination node
         } else {
             count = left_count; // last destination node
         }
-        assert(count > 0);
-        snprintf(cmd, sizeof(cmd), "./redis-trib.rb reshard "
-                 "--from %s --to %s --slots %u --yes %s:%s " DBG_SHELL_QUIET,
-                 snode->id.c_str(), dnode->id.c_str(), count,
-                 snode->host.c_str(), snode->port.c_str());
-        DBG_INFO("reshard %u slots from %s to %s begin...", count, snode->id.c_str(), dnode->id.c_str());
-        DBG_TRACE_CMD(cmd);
-        int ret = system(cmd);
-        if(WIFEXITED(ret) && WEXITSTATUS(ret) != 0) {
-            DBG_ERR("reshard %u slots from %s to %s fail", count, snode->id.c_str(), dnode->id.c_str());
-            return;
+        left_count -= count;
+        DBG_INFO("reshard %u slots from %s to %s", count, snode->id.c_str(), dnode->id.c_str());
+        for(; count > 0; count--) {
+            SlotMove move = {grp_from->slot_set[--next], snode, dnode};
+            moves.push_back(move);
         }
     }
+
+    if( !move_slots(moves) ) {
+        DBG_ERR("reshard from %s fail", snode->id.c_str());
+    }
+}
+
+static void usage(const char *prog) {
+    std::cerr << "usage: " << prog << " [-p parallel] [-b batch] [-w pipeline] [-t timeout_ms] [-s throttle_us] [-r] [-1] interval host port\r\n"
+              << "  -p parallel     slots migrated at the same time, default 4\r\n"
+              << "  -b batch        keys per MIGRATE, default 100\r\n"
+              << "  -w pipeline     MIGRATE commands in flight per slot, default 4\r\n"
+              << "  -t timeout_ms   MIGRATE timeout, default 5000\r\n"
+              << "  -s throttle_us  pause between batches of a slot, default 0\r\n"
+              << "  -r              MIGRATE with REPLACE\r\n"
+              << "  -1              run one round and exit\r\n"
+              << "  interval        seconds waiting for to start next operations" << std::endl;
 }
 
 int main(int argc, char **argv) {
     unsigned int interval;
-    if( argc < 4 ) {
-        DBG_ERR("usage: %s interval host port\r\n interval: seconds waiting for to start next operations", argv[0]);
+    bool once = false;
+
+    int opt;
+    while( (opt = getopt(argc, argv, "p:b:w:t:s:r1h"))!=-1 ) {
+        switch(opt) {
+        case 'p': g_conf.parallel = atoi(optarg); break;
+        case 'b': g_conf.batch = strtoul(optarg, NULL, 10); break;
+        case 'w': g_conf.pipeline = strtoul(optarg, NULL, 10); break;
+        case 't': g_conf.timeout_ms = strtoul(optarg, NULL, 10); break;
+        case 's': g_conf.throttle_us = strtoul(optarg, NULL, 10); break;
+        case 'r': g_conf.replace = true; break;
+        case '1': once = true; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if( argc - optind < 3 || g_conf.parallel<1 || g_conf.batch<1 || g_conf.pipeline<1 ) {
+        usage(argv[0]);
         return 1;
     }
-    interval = (unsigned int)atoi(argv[1]);
-    std::string host(argv[2]);
-    std::string port(argv[3]);
+    interval = (unsigned int)atoi(argv[optind]);
+    std::string host(argv[optind + 1]);
+    std::string port(argv[optind + 2]);
 
     for(;;) {
         fix_cluster(host, port);
@@ -412,12 +769,21 @@ int main(int argc, char **argv) {
         reshard(host, port);
         sleep(10);
         failover(host, port);
+        if( once ) {
+            break;
+        }
         sleep(10);
         DBG_INFO("waiting %d seconds to start next round...", interval);
         sleep(interval);
     }
+
+    clear_servers();
+    std::map<std::string, redis::cluster::Node *>::iterator it = g_servers.begin();
+    for(; it != g_servers.end(); it++) {
+        delete it->second;
+    }
+    return 0;
 }
 
 #undef DBG_TRACE_CMD
-#undef MAX_LINE_LEN
-
+#undef HASH_SLOTS
@@ -1,9 +1,22 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <string>
 #include <vector>
+#include <algorithm>
 #include <gtest/gtest.h>
+#include <hiredis/hiredis.h>
 #include "../redis_cluster.h"
+#include "../test/mock_cluster.h"
 
 
 class ClusterTestObj : public ::testing::Test {
@@ -34,6 +47,20 @@ TEST_F(ClusterTestObj, errinfo) {
     ASSERT_TRUE(cluster_->strerr().find("not supported") != std::string::npos);
 }
 
+TEST_F(ClusterTestObj, error_state) {
+    std::vector<std::string> cmd;
+    cmd.push_back("info");
+    cmd.push_back("all");
+    ASSERT_TRUE(cluster_->setup("",true) == 0);
+    ASSERT_FALSE(cluster_->run(cmd));
+
+    const redis::cluster::Cluster::ErrorStateType &es = cluster_->error_state();
+    ASSERT_EQ(es.err, redis::cluster::Cluster::E_COMMANDS);
+    ASSERT_STREQ(es.detail, "INFO");
+    ASSERT_EQ(es.slot, -1);
+    ASSERT_EQ(cluster_->strerr(), "command not supported [INFO]");
+}
+
 TEST_F(ClusterTestObj, test_parse_startup) {
 
     ASSERT_TRUE(cluster_->setup("",true) == 0);
@@ -149,6 +176,1519 @@ TEST(CaseNodePool, test_NodePoolType) {
 
 }
 
+TEST(CaseHistogram, test_LatencyHistogram) {
+    redis::cluster::LatencyHistogram hist;
+
+    ASSERT_EQ(hist.count(), 0);
+    ASSERT_EQ(hist.percentile(0.99), 0);
+
+    /* small values are exact */
+
+    for(uint64_t v = 0; v < 16; v++) {
+        ASSERT_EQ(redis::cluster::LatencyHistogram::bucket_upper(
+                      redis::cluster::LatencyHistogram::bucket_of(v)), v);
+    }
+
+    /* any value falls into a bucket whose upper bound is within 12.5% */
+
+    for(uint64_t v = 16; v < 10000000; v = v * 3 + 1) {
+        uint64_t upper = redis::cluster::LatencyHistogram::bucket_upper(
+                             redis::cluster::LatencyHistogram::bucket_of(v));
+        ASSERT_GE(upper, v);
+        ASSERT_LE(upper, v + v / 8);
+    }
+
+    for(int i = 1; i <= 1000; i++) {
+        hist.record(i);
+    }
+    ASSERT_EQ(hist.count(), 1000);
+    ASSERT_NEAR(hist.percentile(0.5), 500, 500 / 8);
+    ASSERT_NEAR(hist.percentile(0.99), 990, 990 / 8);
+
+    redis::cluster::LatencyHistogram other;
+    other.record(100000);
+    hist.merge(other);
+    ASSERT_EQ(hist.count(), 1001);
+    ASSERT_GE(hist.percentile(1.0), 100000);
+}
+
+TEST(CaseCodec, test_compress) {
+    using redis::cluster::Cluster;
+    std::string out;
+
+    /* legacy values pass through */
+
+    ASSERT_FALSE(Cluster::test_decompress("hello world", out));
+    ASSERT_FALSE(Cluster::test_decompress("", out));
+
+#ifdef HAVE_LZ4
+    std::string json;
+    for(int i = 0; i < 1000; i++) {
+        json += "{\"field\":\"value\",\"number\":12345},";
+    }
+    std::string packed, unpacked;
+    ASSERT_TRUE(Cluster::test_compress(json, packed));
+    ASSERT_LT(packed.size(), json.size());
+    ASSERT_TRUE(Cluster::test_decompress(packed, unpacked));
+    ASSERT_EQ(unpacked, json);
+
+    /* a legacy value that starts with the magic by chance is not trusted for its length */
+
+    std::string fake("\xffRZ\x01\xff\xff\xff\xff" "abcd", 12);
+    ASSERT_FALSE(Cluster::test_decompress(fake, unpacked));
+    fake[4] = fake[5] = '\x00';
+    fake[6] = '\x40';
+    fake[7] = '\x00';
+    ASSERT_FALSE(Cluster::test_decompress(fake, unpacked));
+
+    /* not compressed if it doesn't help */
+
+    ASSERT_FALSE(Cluster::test_compress("abc", packed));
+#else
+    ASSERT_FALSE(Cluster::test_compress(std::string(1000, 'a'), out));
+#endif
+}
+
+static void *sample_hot_thread(void *arg) {
+    redis::cluster::Cluster *cluster = (redis::cluster::Cluster *)arg;
+    for(int i = 0; i < 300; i++) {
+        cluster->test_sample_hot("hot_3");
+    }
+    return NULL;
+}
+
+TEST(CaseHotKeys, test_hot_sampling) {
+    redis::cluster::Cluster *cluster = new redis::cluster::Cluster();
+    std::vector<redis::cluster::Cluster::HotKeyType> keys;
+    std::vector<redis::cluster::Cluster::HotSlotType> slots;
+
+    cluster->hot_keys(keys, 10);
+    ASSERT_TRUE(keys.empty());
+
+    cluster->set_hot_sampling(1);
+    for(int i = 0; i < 1000; i++) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "cold_%d", i);
+        cluster->test_sample_hot(buf);
+        if( i % 2 == 0 )
+            cluster->test_sample_hot("hot_1");
+        if( i % 4 == 0 )
+            cluster->test_sample_hot("hot_2");
+    }
+
+    cluster->hot_keys(keys, 2);
+    ASSERT_EQ(keys.size(), 2);
+    ASSERT_EQ(keys[0].key, "hot_1");
+    ASSERT_GE(keys[0].count, 500);
+    ASSERT_EQ(keys[1].key, "hot_2");
+    ASSERT_GE(keys[1].count, 250);
+    ASSERT_EQ(keys[0].slot, cluster->test_key_hash("hot_1") % redis::cluster::Cluster::HASH_SLOTS);
+
+    cluster->hot_slots(slots, 1);
+    ASSERT_EQ(slots.size(), 1);
+    ASSERT_EQ(slots[0].slot, keys[0].slot);
+
+    /* every thread samples into its own sketch, merged when read */
+    cluster->reset_hot_stat();
+    pthread_t threads[4];
+    for(int i = 0; i < 4; i++) {
+        ASSERT_EQ(pthread_create(&threads[i], NULL, sample_hot_thread, cluster), 0);
+    }
+    for(int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    cluster->hot_keys(keys, 1);
+    ASSERT_EQ(keys.size(), 1);
+    ASSERT_EQ(keys[0].key, "hot_3");
+    ASSERT_EQ(keys[0].count, 1200);
+    cluster->hot_slots(slots, 1);
+    ASSERT_EQ(slots[0].count, 1200);
+
+    cluster->reset_hot_stat();
+    cluster->hot_keys(keys, 2);
+    ASSERT_TRUE(keys.empty());
+
+    delete cluster;
+}
+
+TEST(CaseNodeLimits, test_acquire_release) {
+    redis::cluster::Node node("126.0.0.1", 6000, 1);
+    unsigned int inflight, waiting;
+    uint64_t overload;
+
+    /* unlimited by default */
+
+    ASSERT_EQ(node.acquire(), 0);
+
+    /* no waiting allowed, fail fast */
+
+    node.set_limits(2, 0);
+    ASSERT_EQ(node.acquire(), 1);
+    ASSERT_EQ(node.acquire(), 1);
+    ASSERT_LT(node.acquire(), 0);
+    node.queue_stat(inflight, waiting, overload);
+    ASSERT_EQ(inflight, 2);
+    ASSERT_EQ(waiting, 0);
+    ASSERT_EQ(overload, 1);
+
+    node.release();
+    ASSERT_EQ(node.acquire(), 1);
+
+    /* waiting times out after the node's timeout */
+
+    node.set_limits(2, 1);
+    ASSERT_LT(node.acquire(), 0);
+    node.queue_stat(inflight, waiting, overload);
+    ASSERT_EQ(waiting, 0);
+    ASSERT_EQ(overload, 2);
+
+    node.release();
+    node.release();
+}
+TEST(CaseNodeRegistry, test_add_find) {
+    redis::cluster::NodeRegistry registry;
+    redis::cluster::Node *node1 = NULL;
+    redis::cluster::Node *node2 = NULL;
+    redis::cluster::Node *dup = NULL;
+
+    ASSERT_EQ(registry.size(), 0);
+    ASSERT_EQ(registry.random(NULL), (redis::cluster::Node *)NULL);
+
+    /* add new nodes, duplicates return the existing one */
+
+    ASSERT_TRUE(registry.add("126.0.0.1", 9, 6000, 1, node1));
+    ASSERT_TRUE(registry.add("126.0.0.1", 9, 6001, 1, node2));
+    ASSERT_FALSE(registry.add("126.0.0.1:6000", 9, 6000, 1, dup));
+    ASSERT_EQ(dup, node1);
+    ASSERT_EQ(registry.size(), 2);
+
+    /* find by host and port, host need not be terminated */
+
+    ASSERT_EQ(registry.find("126.0.0.1:6001", 9, 6001), node2);
+    ASSERT_EQ(registry.find("126.0.0.2", 9, 6001), (redis::cluster::Node *)NULL);
+
+    /* find by node id */
+
+    ASSERT_EQ(registry.find_id("abcdef", 6), (redis::cluster::Node *)NULL);
+    registry.set_id(node1, "abcdef", 6);
+    ASSERT_EQ(registry.find_id("abcdef", 6), node1);
+    ASSERT_EQ(node1->id(), "abcdef");
+
+    /* random never returns the excluded node */
+
+    for(int i = 0; i < 100; i++) {
+        ASSERT_EQ(registry.random(node1), node2);
+    }
+
+    /* grows past the initial index size */
+
+    for(int i = 0; i < 100; i++) {
+        redis::cluster::Node *node = NULL;
+        ASSERT_TRUE(registry.add("127.0.0.1", 9, 7000 + i, 1, node));
+    }
+    ASSERT_EQ(registry.size(), 102);
+    ASSERT_EQ(registry.find("127.0.0.1", 9, 7099)->port(), 7099);
+    ASSERT_EQ(registry.find("126.0.0.1", 9, 6000), node1);
+    ASSERT_EQ(registry.find_id("abcdef", 6), node1);
+
+    /* a batch is seen by its thread, and by readers only after commit */
+
+    registry.begin();
+    redis::cluster::Node *batched = NULL;
+    for(int i = 0; i < 100; i++) {
+        ASSERT_TRUE(registry.add("128.0.0.1", 9, 8000 + i, 1, batched));
+        registry.set_id(batched, ("id" + std::to_string(i)).c_str(), 2 + (i>9) + 1);
+    }
+    ASSERT_FALSE(registry.add("128.0.0.1", 9, 8000, 1, dup));
+    ASSERT_EQ(registry.size(), 102);
+    ASSERT_EQ(registry.find("128.0.0.1", 9, 8099), (redis::cluster::Node *)NULL);
+    registry.commit();
+    ASSERT_EQ(registry.size(), 202);
+    ASSERT_EQ(registry.find("128.0.0.1", 9, 8099), batched);
+    ASSERT_EQ(registry.find_id("id99", 4), batched);
+    ASSERT_EQ(registry.find("128.0.0.1", 9, 8000), dup);
+    ASSERT_EQ(registry.find_id("abcdef", 6), node1);
+}
+static void *record_latency_thread(void *arg) {
+    redis::cluster::Cluster *cluster = (redis::cluster::Cluster *)arg;
+    for(int i = 1; i <= 1000; i++) {
+        cluster->test_record_latency("GET", i);
+    }
+    cluster->test_record_latency("SET", 100000);
+    return NULL;
+}
+
+TEST(CaseLatency, test_command_latency) {
+    redis::cluster::Cluster *cluster = new redis::cluster::Cluster();
+    std::vector<redis::cluster::Cluster::CommandLatencyType> lat;
+
+    cluster->command_latency(lat);
+    ASSERT_TRUE(lat.empty());
+
+    /* per-thread histograms are merged when read */
+
+    pthread_t threads[4];
+    for(int i = 0; i < 4; i++) {
+        ASSERT_EQ(pthread_create(&threads[i], NULL, record_latency_thread, cluster), 0);
+    }
+    for(int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    cluster->command_latency(lat);
+    ASSERT_EQ(lat.size(), 2);
+    ASSERT_EQ(lat[0].command, "GET");
+    ASSERT_EQ(lat[0].total.count, 4000);
+    ASSERT_NEAR(lat[0].total.p50, 500, 500 / 8);
+    ASSERT_NEAR(lat[0].total.p99, 990, 990 / 8);
+    ASSERT_EQ(lat[1].command, "SET");
+    ASSERT_EQ(lat[1].total.count, 4);
+    ASSERT_GE(lat[1].total.p999, 100000);
+
+    cluster->reset_latency();
+    cluster->command_latency(lat);
+    ASSERT_EQ(lat.size(), 2);
+    ASSERT_EQ(lat[0].total.count, 0);
+
+    delete cluster;
+}
+
+TEST(CaseLatency, test_exited_thread_reuse) {
+    redis::cluster::Cluster *cluster = new redis::cluster::Cluster();
+    std::vector<redis::cluster::Cluster::CommandLatencyType> lat;
+
+    /* one thread at a time: each takes over the block of the one before */
+
+    for(int i = 0; i < 8; i++) {
+        pthread_t tid;
+        ASSERT_EQ(pthread_create(&tid, NULL, record_latency_thread, cluster), 0);
+        pthread_join(tid, NULL);
+    }
+    ASSERT_EQ(cluster->test_thread_stats(), 1);
+
+    cluster->command_latency(lat);
+    ASSERT_EQ(lat.size(), 2);
+    ASSERT_EQ(lat[0].total.count, 8000);
+    ASSERT_EQ(lat[1].total.count, 8);
+
+    delete cluster;
+}
+
+TEST_F(ClusterTestObj, metrics) {
+    std::vector<std::string> cmd;
+    cmd.push_back("info");
+    cmd.push_back("all");
+    ASSERT_TRUE(cluster_->setup("127.0.0.1:7000",true) == 0);
+    ASSERT_FALSE(cluster_->run(cmd));
+    ASSERT_FALSE(cluster_->run(cmd));
+
+    redis::cluster::Cluster::MetricsType m;
+    cluster_->metrics(m);
+    ASSERT_EQ(m.requests, 2);
+    ASSERT_EQ(m.errors[redis::cluster::Cluster::E_COMMANDS], 2);
+    ASSERT_EQ(m.errors[redis::cluster::Cluster::E_IO], 0);
+    ASSERT_EQ(m.bytes_out, 0);
+
+    std::string text = cluster_->metrics_prometheus("rc");
+    ASSERT_TRUE(text.find("# TYPE rc_requests_total counter\nrc_requests_total 2\n") != std::string::npos);
+    ASSERT_TRUE(text.find("rc_errors_total{error=\"commands\"} 2\n") != std::string::npos);
+    ASSERT_TRUE(text.find("rc_nodes 1\n") != std::string::npos);
+}
+static void count_trace_event(const redis::cluster::Cluster::TraceEventType &event, void *arg) {
+    std::vector<redis::cluster::Cluster::TraceEventType> *events =
+        (std::vector<redis::cluster::Cluster::TraceEventType> *)arg;
+    events->push_back(event);
+}
+
+TEST_F(ClusterTestObj, trace_hooks) {
+    std::vector<redis::cluster::Cluster::TraceEventType> reloads;
+    redis::cluster::Cluster::TraceHooksType hooks;
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.on_topology_reload = count_trace_event;
+    hooks.arg = &reloads;
+
+    std::vector<std::string> cmd;
+    cmd.push_back("get");
+    cmd.push_back("foo");
+
+    /* nothing listens on port 1, loading slots fails */
+
+    ASSERT_TRUE(cluster_->setup("127.0.0.1:1",true) == 0);
+    cluster_->set_trace_hooks(&hooks);
+    ASSERT_FALSE(cluster_->run(cmd));
+    ASSERT_EQ(reloads.size(), 1);
+    ASSERT_EQ(reloads[0].loaded_slots, 0);
+    ASSERT_TRUE(reloads[0].node == NULL);
+    ASSERT_EQ(reloads[0].slot, -1);
+
+    cluster_->set_trace_hooks(NULL);
+    ASSERT_FALSE(cluster_->run(cmd));
+    ASSERT_EQ(reloads.size(), 1);
+}
+TEST_F(ClusterTestObj, slow_log) {
+    std::vector<redis::cluster::Cluster::SlowLogEntryType> entries;
+    std::vector<std::string> cmd;
+    cmd.push_back("get");
+    cmd.push_back(std::string(100, 'k'));
+
+    ASSERT_TRUE(cluster_->setup("127.0.0.1:1",true) == 0);
+    cluster_->slow_log(entries);
+    ASSERT_TRUE(entries.empty());
+
+    /* every request is slower than 1us, the ring keeps the last 4 */
+
+    cluster_->set_slow_log(1, 4);
+    for(int i = 0; i < 6; i++) {
+        ASSERT_FALSE(cluster_->run(cmd));
+    }
+    cluster_->slow_log(entries);
+    ASSERT_EQ(entries.size(), 4);
+    ASSERT_EQ(entries[0].id, 5);
+    ASSERT_EQ(entries[3].id, 2);
+    ASSERT_EQ(entries[0].slot, cluster_->test_key_hash(cmd[1]) % redis::cluster::Cluster::HASH_SLOTS);
+    ASSERT_NE(entries[0].err, redis::cluster::Cluster::E_OK);
+    ASSERT_GE(entries[0].total_us, 1);
+    ASSERT_STREQ(entries[0].command, ("get " + std::string(32, 'k') + "...").c_str());
+
+    cluster_->slow_log(entries, 1);
+    ASSERT_EQ(entries.size(), 1);
+    ASSERT_TRUE(cluster_->slow_log_dump().find("command: get kkk") != std::string::npos);
+
+    cluster_->set_slow_log(0);
+    ASSERT_FALSE(cluster_->run(cmd));
+    cluster_->slow_log(entries);
+    ASSERT_TRUE(entries.empty());
+}
+class MockClusterTestObj : public ::testing::Test {
+public:
+    MockClusterTestObj() {
+        cluster_ = NULL;
+    }
+
+    virtual void SetUp() {
+        ASSERT_EQ(mock_.start(3), 0);
+        cluster_ = new redis::cluster::Cluster(1);
+        ASSERT_EQ(cluster_->setup(mock_.startup().c_str(), false), 0);
+    }
+    virtual void TearDown() {
+        if( cluster_ ) {
+            delete cluster_;
+        }
+        mock_.stop();
+    }
+
+    /* run and return the reply as text, "(nil)", "(error) ..." or "(fail) ..." */
+    std::string run(const char *cmd, const std::string &key, const char *value = NULL) {
+        std::vector<std::string> commands;
+        commands.push_back(cmd);
+        commands.push_back(key);
+        if( value )
+            commands.push_back(value);
+        redisReply *reply = cluster_->run(commands);
+        if( !reply )
+            return "(fail) " + cluster_->strerr();
+
+        std::string out;
+        if( reply->type==REDIS_REPLY_NIL )
+            out = "(nil)";
+        else if( reply->type==REDIS_REPLY_ERROR )
+            out = std::string("(error) ") + reply->str;
+        else
+            out = std::string(reply->str, reply->len);
+        freeReplyObject(reply);
+        return out;
+    }
+
+    MockCluster mock_;
+    redis::cluster::Cluster *cluster_;
+};
+
+TEST_F(MockClusterTestObj, set_get) {
+    for(int i = 0; i < 100; i++) {
+        char key[32], value[32];
+        snprintf(key, sizeof(key), "key_%d", i);
+        snprintf(value, sizeof(value), "value_%d", i);
+        ASSERT_EQ(run("SET", key, value), "OK");
+    }
+    for(int i = 0; i < 100; i++) {
+        char key[32], value[32];
+        snprintf(key, sizeof(key), "key_%d", i);
+        snprintf(value, sizeof(value), "value_%d", i);
+        ASSERT_EQ(run("GET", key), value);
+        std::string stored;
+        ASSERT_TRUE(mock_.get(key, stored));
+        ASSERT_EQ(stored, value);
+    }
+    ASSERT_EQ(run("GET", "missing"), "(nil)");
+    ASSERT_GT(mock_.requests(0), 0);
+    ASSERT_GT(mock_.requests(1), 0);
+    ASSERT_GT(mock_.requests(2), 0);
+}
+
+TEST_F(MockClusterTestObj, migration) {
+    int slot = MockCluster::key_slot("{user}");
+    int from = mock_.owner(slot);
+    int to = (from + 1) % 3;
+    redis::cluster::Cluster::MetricsType m;
+
+    ASSERT_EQ(run("SET", "{user}a", "1"), "OK");
+
+    /* while migrating, missing keys are asked at the target */
+
+    mock_.begin_migration(slot, to);
+    ASSERT_EQ(run("GET", "{user}a"), "1");
+    ASSERT_EQ(run("GET", "{user}b"), "(nil)");
+    ASSERT_EQ(run("SET", "{user}b", "2"), "OK");
+    ASSERT_EQ(run("GET", "{user}b"), "2");
+    cluster_->metrics(m);
+    ASSERT_EQ(m.ask, 3);
+    ASSERT_EQ(m.moved, 0);
+
+    /* after migration, the old owner redirects with MOVED once */
+
+    mock_.end_migration(slot);
+    ASSERT_EQ(mock_.owner(slot), to);
+    ASSERT_EQ(run("GET", "{user}a"), "1");
+    ASSERT_EQ(run("GET", "{user}b"), "2");
+    cluster_->metrics(m);
+    ASSERT_EQ(m.moved, 1);
+}
+
+TEST_F(MockClusterTestObj, failover) {
+    ASSERT_EQ(run("SET", "foo", "bar"), "OK");
+    int from = mock_.owner(MockCluster::key_slot("foo"));
+
+    mock_.failover(from, (from + 1) % 3);
+    mock_.set_down(from, true);
+    ASSERT_EQ(run("GET", "foo"), "bar");
+    ASSERT_GT(cluster_->ttls(), 1);
+}
+
+TEST_F(MockClusterTestObj, scripted) {
+    ASSERT_EQ(run("SET", "foo", "bar"), "OK");
+    int node = mock_.owner(MockCluster::key_slot("foo"));
+
+    /* dropped pooled connections are retried */
+
+    mock_.drop_connections(node);
+    ASSERT_EQ(run("GET", "foo"), "bar");
+
+    mock_.inject_reply(node, "-BUSY script running\r\n");
+    ASSERT_EQ(run("GET", "foo"), "(error) BUSY script running");
+    ASSERT_EQ(run("GET", "foo"), "bar");
+
+    /* delays show up in the node's round trip latency */
+
+    mock_.set_delay(node, 20000);
+    ASSERT_EQ(run("GET", "foo"), "bar");
+    mock_.set_delay(node, 0);
+
+    std::vector<redis::cluster::Cluster::NodeLatencyType> lat;
+    cluster_->node_latency(lat);
+    bool found = false;
+    for(size_t i = 0; i < lat.size(); i++) {
+        if( lat[i].node->port()==(unsigned int)mock_.port(node) ) {
+            ASSERT_GE(lat[i].rtt.p999, 20000);
+            found = true;
+        }
+    }
+    ASSERT_TRUE(found);
+}
+
+TEST_F(MockClusterTestObj, reply_bytes) {
+    redis::cluster::Cluster::MetricsType before, after;
+    int node = mock_.owner(MockCluster::key_slot("counter"));
+    std::vector<std::string> commands;
+    commands.push_back("INCR");
+    commands.push_back("counter");
+
+    /* the most negative integer has no positive counterpart */
+    mock_.inject_reply(node, ":-9223372036854775808\r\n");
+    cluster_->metrics(before);
+    redisReply *reply = cluster_->run(commands);
+    ASSERT_TRUE(reply != NULL);
+    ASSERT_EQ(reply->type, REDIS_REPLY_INTEGER);
+    ASSERT_EQ(reply->integer, LLONG_MIN);
+    freeReplyObject(reply);
+    cluster_->metrics(after);
+    ASSERT_EQ(after.bytes_in - before.bytes_in, strlen(":-9223372036854775808\r\n"));
+
+    mock_.inject_reply(node, ":42\r\n");
+    cluster_->metrics(before);
+    reply = cluster_->run(commands);
+    ASSERT_TRUE(reply != NULL);
+    ASSERT_EQ(reply->integer, 42);
+    freeReplyObject(reply);
+    cluster_->metrics(after);
+    ASSERT_EQ(after.bytes_in - before.bytes_in, 5);
+}
+
+TEST_F(MockClusterTestObj, capture) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/unittest_capture.%d", (int)getpid());
+
+    /* every record is written out at once, a second start must not truncate them */
+    ASSERT_EQ(cluster_->start_capture(path, 1), 0);
+    ASSERT_EQ(run("SET", "foo", "bar"), "OK");
+    ASSERT_LT(cluster_->start_capture(path), 0);
+    ASSERT_EQ(run("GET", "foo"), "bar");
+    ASSERT_EQ(run("GET", std::string("bin\0ary", 7)), "(nil)");
+    cluster_->stop_capture();
+    ASSERT_EQ(run("GET", "foo"), "bar");
+
+    FILE *in = fopen(path, "r");
+    ASSERT_TRUE(in != NULL);
+    std::vector<redis::cluster::Cluster::CaptureRecordType> recs;
+    redis::cluster::Cluster::CaptureRecordType rec;
+    bool header_read = false;
+    while( redis::cluster::Cluster::read_capture(in, rec, header_read)>0 ) {
+        recs.push_back(rec);
+    }
+    ASSERT_EQ(redis::cluster::Cluster::read_capture(in, rec, header_read), 0);
+    fclose(in);
+
+    /* a pipe is not seekable, the header is still read once */
+    std::string cmd = std::string("cat ") + path;
+    FILE *pipe = popen(cmd.c_str(), "r");
+    ASSERT_TRUE(pipe != NULL);
+    header_read = false;
+    size_t piped = 0;
+    while( redis::cluster::Cluster::read_capture(pipe, rec, header_read)>0 ) {
+        piped++;
+    }
+    ASSERT_EQ(redis::cluster::Cluster::read_capture(pipe, rec, header_read), 0);
+    pclose(pipe);
+    ASSERT_EQ(piped, 3);
+    unlink(path);
+
+    ASSERT_EQ(recs.size(), 3);
+    ASSERT_EQ(recs[0].commands.size(), 3);
+    ASSERT_EQ(recs[0].commands[2], "bar");
+    ASSERT_EQ(recs[0].reply_size, 5);       // +OK\r\n
+    ASSERT_EQ(recs[1].reply_size, 9);       // $3\r\nbar\r\n
+    ASSERT_EQ(recs[2].commands[1], std::string("bin\0ary", 7));
+    ASSERT_EQ(recs[0].thread, recs[2].thread);
+    ASSERT_LE(recs[0].timestamp_us, recs[1].timestamp_us);
+    ASSERT_EQ(recs[1].err, redis::cluster::Cluster::E_OK);
+}
+
+TEST_F(MockClusterTestObj, topology_file) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/unittest_topology.%d", (int)getpid());
+    unlink(path);
+    ASSERT_EQ(run("SET", "foo", "bar"), "OK");
+
+    /* no file yet, loaded from the network and saved */
+
+    redis::cluster::Cluster *cold = new redis::cluster::Cluster(1);
+    cold->set_topology_file(path);
+    ASSERT_EQ(cold->setup(mock_.startup().c_str(), false), 0);
+    ASSERT_EQ(access(path, R_OK), 0);
+    delete cold;
+
+    /* warm start: routes by the file, even with an unreachable startup node */
+
+    redis::cluster::Cluster *warm = new redis::cluster::Cluster(1);
+    warm->set_topology_file(path);
+    ASSERT_EQ(warm->setup("127.0.0.1:1", false), 0);
+    redis::cluster::Node *node = warm->test_slot_node("foo");
+    ASSERT_TRUE(node != NULL);
+    ASSERT_EQ(node->port(), (unsigned int)mock_.port(mock_.owner(MockCluster::key_slot("foo"))));
+
+    std::vector<std::string> commands;
+    commands.push_back("GET");
+    commands.push_back("foo");
+    redisReply *reply = warm->run(commands);
+    ASSERT_TRUE(reply != NULL);
+    ASSERT_EQ(std::string(reply->str, reply->len), "bar");
+    freeReplyObject(reply);
+    delete warm;
+
+    /* a damaged file is ignored */
+
+    FILE *f = fopen(path, "r+");
+    ASSERT_TRUE(f != NULL);
+    fputs("garbage", f);
+    fclose(f);
+    redis::cluster::Cluster *bad = new redis::cluster::Cluster(1);
+    bad->set_topology_file(path);
+    ASSERT_EQ(bad->setup("127.0.0.1:1", false), 0);
+    ASSERT_TRUE(bad->test_slot_node("foo") == NULL);
+    delete bad;
+    unlink(path);
+}
+
+TEST_F(MockClusterTestObj, shared_topology) {
+    char name[64];
+    snprintf(name, sizeof(name), "/unittest_shared.%d", (int)getpid());
+    shm_unlink(name);
+    int slot = MockCluster::key_slot("foo");
+    ASSERT_EQ(run("SET", "foo", "bar"), "OK");
+
+    /* the first process loads and publishes, the second adopts without the network */
+
+    redis::cluster::Cluster *first = new redis::cluster::Cluster(1);
+    ASSERT_EQ(first->set_shared_topology(name), 0);
+    ASSERT_EQ(first->setup(mock_.startup().c_str(), false), 0);
+
+    redis::cluster::Cluster *second = new redis::cluster::Cluster(1);
+    ASSERT_EQ(second->set_shared_topology(name), 0);
+    ASSERT_EQ(second->setup("127.0.0.1:1", false), 0);
+    ASSERT_TRUE(second->test_slot_node("foo") != NULL);
+    ASSERT_EQ(second->test_slot_node("foo")->port(), (unsigned int)mock_.port(mock_.owner(slot)));
+
+    /* a MOVED learned by one is followed by the other without a redirection */
+
+    int to = (mock_.owner(slot) + 1) % 3;
+    mock_.begin_migration(slot, to);
+    mock_.end_migration(slot);
+
+    std::vector<std::string> commands;
+    commands.push_back("GET");
+    commands.push_back("foo");
+    redisReply *reply = first->run(commands);
+    ASSERT_TRUE(reply != NULL);
+    freeReplyObject(reply);
+    redis::cluster::Cluster::MetricsType m;
+    first->metrics(m);
+    ASSERT_EQ(m.moved, 1);
+
+    reply = second->run(commands);
+    ASSERT_TRUE(reply != NULL);
+    ASSERT_EQ(std::string(reply->str, reply->len), "bar");
+    freeReplyObject(reply);
+    second->metrics(m);
+    ASSERT_EQ(m.moved, 0);
+    ASSERT_EQ(second->test_slot_node("foo")->port(), (unsigned int)mock_.port(to));
+
+    delete first;
+    delete second;
+    shm_unlink(name);
+}
+
+TEST_F(MockClusterTestObj, shared_topology_dead_writer) {
+    char name[64];
+    snprintf(name, sizeof(name), "/unittest_shared_dead.%d", (int)getpid());
+    shm_unlink(name);
+    ASSERT_EQ(run("SET", "foo", "bar"), "OK");
+
+    redis::cluster::Cluster *first = new redis::cluster::Cluster(1);
+    ASSERT_EQ(first->set_shared_topology(name), 0);
+    ASSERT_EQ(first->setup(mock_.startup().c_str(), false), 0);
+
+    /* a writer dies holding the lock, in the middle of a change */
+
+    pid_t pid = fork();
+    ASSERT_GE(pid, 0);
+    if( pid==0 ) {
+        redis::cluster::Cluster *writer = new redis::cluster::Cluster(1);
+        if( writer->set_shared_topology(name)==0 ) {
+            writer->test_hold_shared_lock();
+        }
+        _exit(0);
+    }
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+
+    /* nobody hangs: the torn map is not adopted, it is reloaded and published again */
+
+    redis::cluster::Cluster *second = new redis::cluster::Cluster(1);
+    ASSERT_EQ(second->set_shared_topology(name), 0);
+    ASSERT_EQ(second->setup(mock_.startup().c_str(), false), 0);
+
+    std::vector<std::string> commands;
+    commands.push_back("GET");
+    commands.push_back("foo");
+    redisReply *reply = first->run(commands);
+    ASSERT_TRUE(reply != NULL);
+    ASSERT_EQ(std::string(reply->str, reply->len), "bar");
+    freeReplyObject(reply);
+    reply = second->run(commands);
+    ASSERT_TRUE(reply != NULL);
+    ASSERT_EQ(std::string(reply->str, reply->len), "bar");
+    freeReplyObject(reply);
+
+    redis::cluster::Cluster *third = new redis::cluster::Cluster(1);
+    ASSERT_EQ(third->set_shared_topology(name), 0);
+    ASSERT_EQ(third->setup("127.0.0.1:1", false), 0);
+    ASSERT_TRUE(third->test_slot_node("foo") != NULL);
+
+    delete first;
+    delete second;
+    delete third;
+    shm_unlink(name);
+}
+
+TEST_F(MockClusterTestObj, unix_socket) {
+    if( mock_.unix_socket(0).empty() ) {
+        return;
+    }
+
+    /* node 0 by an explicit mapping, the others as local nodes to a missing path, falling back to tcp */
+
+    redis::cluster::Cluster *cluster = new redis::cluster::Cluster(1);
+    cluster->add_unix_socket("127.0.0.1", mock_.port(0), mock_.unix_socket(0));
+    ASSERT_EQ(cluster->set_local_unix_socket("/nonexistent/redis-%d.sock"), 0);
+    ASSERT_EQ(cluster->setup(mock_.startup().c_str(), false), 0);
+
+    std::vector<std::string> commands;
+    commands.push_back("SET");
+    commands.push_back("");
+    commands.push_back("v");
+    for(int i = 0; i < 30; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key_%d", i);
+        commands[1] = key;
+        redisReply *reply = cluster->run(commands);
+        ASSERT_TRUE(reply != NULL);
+        freeReplyObject(reply);
+    }
+    ASSERT_GT(mock_.unix_connections(0), 0);
+    ASSERT_EQ(mock_.unix_connections(1), 0);
+    ASSERT_GT(mock_.requests(1), 0);
+
+    redis::cluster::Cluster::NodePoolType nodes = cluster->get_startup_nodes();
+    for(redis::cluster::Cluster::NodePoolType::iterator it = nodes.begin(); it != nodes.end(); it++) {
+        char path[64];
+        snprintf(path, sizeof(path), "/nonexistent/redis-%u.sock", (*it)->port());
+        if( (*it)->port()==(unsigned int)mock_.port(0) ) {
+            ASSERT_EQ((*it)->unix_socket(), mock_.unix_socket(0));
+        } else {
+            ASSERT_EQ((*it)->unix_socket(), path);
+        }
+    }
+    delete cluster;
+}
+
+TEST_F(MockClusterTestObj, conn_options) {
+    redis::cluster::Node::ConnOptionsType options;
+    memset(&options, 0, sizeof(options));
+    options.keepalive_s = 30;
+    options.rcvbuf = 256 * 1024;
+    options.quickack = true;
+    snprintf(options.source_addr, sizeof(options.source_addr), "127.0.0.1");
+    options.reader_maxbuf = (size_t)-1;
+
+    redis::cluster::Cluster *cluster = new redis::cluster::Cluster(1);
+    cluster->set_conn_options(options);
+    ASSERT_EQ(cluster->setup(mock_.startup().c_str(), false), 0);
+    std::vector<std::string> commands;
+    commands.push_back("SET");
+    commands.push_back("foo");
+    commands.push_back("bar");
+    redisReply *reply = cluster->run(commands);
+    ASSERT_TRUE(reply != NULL);
+    freeReplyObject(reply);
+
+    redis::cluster::Node *node = cluster->test_slot_node("foo");
+    ASSERT_TRUE(node != NULL);
+    ASSERT_EQ(node->conn_options().keepalive_s, 30);
+    redisContext *conn = (redisContext *)node->get_conn();
+    ASSERT_TRUE(conn != NULL);
+
+    int value = 0;
+    socklen_t len = sizeof(value);
+    ASSERT_EQ(getsockopt(conn->fd, SOL_SOCKET, SO_KEEPALIVE, &value, &len), 0);
+    ASSERT_EQ(value, 1);
+    ASSERT_EQ(getsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &value, &len), 0);
+    ASSERT_EQ(value, 1);
+    ASSERT_EQ(getsockopt(conn->fd, SOL_SOCKET, SO_RCVBUF, &value, &len), 0);
+    ASSERT_GE(value, 256 * 1024);
+    ASSERT_EQ(conn->reader->maxbuf, 0);
+    node->put_conn(conn);
+    delete cluster;
+
+    /* a source address of another family can't be bound */
+
+    snprintf(options.source_addr, sizeof(options.source_addr), "::1");
+    redis::cluster::Node bad("127.0.0.1", mock_.port(0), 1);
+    bad.set_conn_options(options);
+    ASSERT_TRUE(bad.get_conn() == NULL);
+}
+
+TEST_F(MockClusterTestObj, io_backend) {
+    redis::cluster::Cluster *cluster = new redis::cluster::Cluster(1);
+    ASSERT_EQ(cluster->setup(mock_.startup().c_str(), false), 0);
+    ASSERT_EQ(cluster->io_backend(), redis::cluster::Cluster::IO_BLOCKING);
+
+    int ret = cluster->set_io_backend(redis::cluster::Cluster::IO_URING);
+#ifndef HAVE_LIBURING
+    ASSERT_LT(ret, 0);
+#endif
+    ASSERT_EQ(cluster->io_backend(), ret==0? redis::cluster::Cluster::IO_URING: redis::cluster::Cluster::IO_BLOCKING);
+
+    /* larger than one receive, so a reply takes several reads */
+    std::string value(200 * 1024, 'v');
+    for(int i = 0; i < 10; i++) {
+        std::vector<std::string> commands;
+        commands.push_back("SET");
+        commands.push_back("key" + std::to_string(i));
+        commands.push_back(i % 2? value: "small");
+        redisReply *reply = cluster->run(commands);
+        ASSERT_TRUE(reply != NULL);
+        ASSERT_EQ(reply->type, REDIS_REPLY_STATUS);
+        freeReplyObject(reply);
+
+        commands.pop_back();
+        commands[0] = "GET";
+        reply = cluster->run(commands);
+        ASSERT_TRUE(reply != NULL);
+        ASSERT_EQ(reply->type, REDIS_REPLY_STRING);
+        ASSERT_EQ(std::string(reply->str, reply->len), i % 2? value: "small");
+        freeReplyObject(reply);
+    }
+
+    ASSERT_EQ(cluster->set_io_backend(redis::cluster::Cluster::IO_BLOCKING), 0);
+    ASSERT_EQ(cluster->io_backend(), redis::cluster::Cluster::IO_BLOCKING);
+    delete cluster;
+}
+
+TEST_F(MockClusterTestObj, get_into) {
+    std::string big(300 * 1024, 'b');
+    std::vector<std::string> commands;
+    commands.push_back("SET");
+    commands.push_back("big");
+    commands.push_back(big);
+    redisReply *reply = cluster_->run(commands);
+    ASSERT_TRUE(reply != NULL);
+    freeReplyObject(reply);
+    ASSERT_EQ(run("SET", "small", "value"), "OK");
+
+    std::vector<char> buf(big.length());
+    size_t len = 0;
+    ASSERT_EQ(cluster_->get_into("big", &buf[0], buf.size(), len), 1);
+    ASSERT_EQ(len, big.length());
+    ASSERT_TRUE(std::string(&buf[0], len)==big);
+    ASSERT_EQ(cluster_->get_into("missing", &buf[0], buf.size(), len), 0);
+
+    /* too small, the connection stays usable */
+    ASSERT_EQ(cluster_->get_into("big", &buf[0], 1024, len), -2);
+    ASSERT_EQ(len, big.length());
+    ASSERT_EQ(cluster_->get_into("small", &buf[0], buf.size(), len), 1);
+    ASSERT_EQ(std::string(&buf[0], len), "value");
+
+    /* error reply */
+    mock_.inject_reply(mock_.owner(MockCluster::key_slot("small")), "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+    ASSERT_EQ(cluster_->get_into("small", &buf[0], buf.size(), len), -1);
+    ASSERT_EQ(cluster_->err(), redis::cluster::Cluster::E_OTHERS);
+
+    /* asked at the target while migrating, redirected after */
+    int slot = MockCluster::key_slot("{user}");
+    mock_.begin_migration(slot, (mock_.owner(slot) + 1) % 3);
+    ASSERT_EQ(run("SET", "{user}b", "2"), "OK");
+    ASSERT_EQ(cluster_->get_into("{user}b", &buf[0], buf.size(), len), 1);
+    ASSERT_EQ(std::string(&buf[0], len), "2");
+    mock_.end_migration(slot);
+
+    slot = MockCluster::key_slot("small");
+    mock_.begin_migration(slot, (mock_.owner(slot) + 1) % 3);
+    mock_.end_migration(slot);
+    ASSERT_EQ(cluster_->get_into("small", &buf[0], buf.size(), len), 1);
+    ASSERT_EQ(std::string(&buf[0], len), "value");
+
+    /* pipelined, across every node */
+    std::vector<std::string> keys;
+    for(int i = 0; i < 50; i++) {
+        char key[32], value[32];
+        snprintf(key, sizeof(key), "key_%d", i);
+        snprintf(value, sizeof(value), "value_%d", i);
+        ASSERT_EQ(run("SET", key, value), "OK");
+        keys.push_back(key);
+    }
+    keys.push_back("missing");
+    keys.push_back("big");
+    slot = MockCluster::key_slot("key_7");
+    mock_.begin_migration(slot, (mock_.owner(slot) + 1) % 3);
+    mock_.end_migration(slot);
+
+    std::vector<std::vector<char> > bufs(keys.size(), std::vector<char>(64));
+    std::vector<redis::cluster::Cluster::GetIntoType> values(keys.size());
+    for(size_t i = 0; i < keys.size(); i++) {
+        values[i].buf = &bufs[i][0];
+        values[i].cap = bufs[i].size();
+    }
+    ASSERT_EQ(cluster_->get_into(keys, values), 0);
+    for(int i = 0; i < 50; i++) {
+        char value[32];
+        snprintf(value, sizeof(value), "value_%d", i);
+        ASSERT_EQ(values[i].ret, 1);
+        ASSERT_EQ(std::string(values[i].buf, values[i].len), value);
+    }
+    ASSERT_EQ(values[50].ret, 0);
+    ASSERT_EQ(values[51].ret, -2);
+    ASSERT_EQ(values[51].len, big.length());
+}
+
+TEST_F(MockClusterTestObj, get_into_batch_error) {
+    std::vector<std::string> keys;
+    for(int i = 0; i < 20; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key_%d", i);
+        ASSERT_EQ(run("SET", key, "v"), "OK");
+        keys.push_back(key);
+    }
+
+    /* the first key fails in the pipeline, a key of another node goes the single path after */
+    int node = mock_.owner(MockCluster::key_slot(keys[0]));
+    size_t other = 1;
+    while( mock_.owner(MockCluster::key_slot(keys[other]))==node ) {
+        other++;
+    }
+    int slot = MockCluster::key_slot(keys[other]);
+    mock_.begin_migration(slot, (mock_.owner(slot) + 1) % 3);
+    mock_.end_migration(slot);
+    mock_.inject_reply(node, "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n");
+
+    std::vector<std::vector<char> > bufs(keys.size(), std::vector<char>(64));
+    std::vector<redis::cluster::Cluster::GetIntoType> values(keys.size());
+    for(size_t i = 0; i < keys.size(); i++) {
+        values[i].buf = &bufs[i][0];
+        values[i].cap = bufs[i].size();
+    }
+    ASSERT_EQ(cluster_->get_into(keys, values), 1);
+    ASSERT_EQ(values[0].ret, -1);
+    ASSERT_EQ(values[other].ret, 1);
+    ASSERT_EQ(cluster_->err(), redis::cluster::Cluster::E_OTHERS);
+    ASSERT_TRUE(cluster_->strerr().find("WRONGTYPE") != std::string::npos);
+
+    redis::cluster::Cluster::MetricsType m;
+    cluster_->metrics(m);
+    ASSERT_EQ(m.errors[redis::cluster::Cluster::E_OTHERS], 1);
+
+    /* a later call that succeeds resets it */
+    ASSERT_EQ(cluster_->get_into(keys, values), 0);
+    ASSERT_EQ(cluster_->err(), redis::cluster::Cluster::E_OK);
+}
+
+TEST_F(MockClusterTestObj, get_into_trace) {
+    std::vector<redis::cluster::Cluster::TraceEventType> events;
+    redis::cluster::Cluster::TraceHooksType hooks;
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.before_send = count_trace_event;
+    hooks.after_reply = count_trace_event;
+    hooks.arg = &events;
+    cluster_->set_trace_hooks(&hooks);
+    ASSERT_EQ(run("SET", "foo", "bar"), "OK");
+    events.clear();
+
+    char buf[64];
+    size_t len = 0;
+    ASSERT_EQ(cluster_->get_into("foo", buf, sizeof(buf), len), 1);
+    ASSERT_EQ(events.size(), 2);
+    ASSERT_EQ(events[0].elapsed_us, 0);
+    ASSERT_EQ(std::string(events[1].command, events[1].command_len), "GET");
+    ASSERT_EQ(events[1].slot, cluster_->test_key_hash("foo") % redis::cluster::Cluster::HASH_SLOTS);
+    ASSERT_EQ(events[1].attempt, 1);
+    ASSERT_EQ(events[1].err, redis::cluster::Cluster::E_OK);
+    ASSERT_TRUE(events[1].node == events[0].node);
+
+    /* one round trip per node */
+    std::vector<std::string> keys;
+    std::set<int> owners;
+    for(int i = 0; i < 20; i++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key_%d", i);
+        keys.push_back(key);
+        owners.insert(mock_.owner(MockCluster::key_slot(key)));
+    }
+    std::vector<std::vector<char> > bufs(keys.size(), std::vector<char>(64));
+    std::vector<redis::cluster::Cluster::GetIntoType> values(keys.size());
+    for(size_t i = 0; i < keys.size(); i++) {
+        values[i].buf = &bufs[i][0];
+        values[i].cap = bufs[i].size();
+    }
+    events.clear();
+    ASSERT_EQ(cluster_->get_into(keys, values), 0);
+    ASSERT_EQ(events.size(), owners.size() * 2);
+    for(size_t i = 0; i < events.size(); i++) {
+        ASSERT_EQ(events[i].slot, -1);
+        ASSERT_EQ(events[i].err, redis::cluster::Cluster::E_OK);
+    }
+    cluster_->set_trace_hooks(NULL);
+
+    std::vector<redis::cluster::Cluster::CommandLatencyType> lat;
+    cluster_->command_latency(lat);
+    uint64_t gets = 0;
+    for(size_t i = 0; i < lat.size(); i++) {
+        if( lat[i].command=="GET" ) {
+            gets = lat[i].total.count;
+        }
+    }
+    ASSERT_EQ(gets, 2);
+}
+
+typedef struct {
+    size_t      len;
+    int         restarts;       // times asked from offset 0
+    size_t      abort_at;
+} StreamSourceType;
+
+static ssize_t stream_source(char *buf, size_t cap, size_t offset, void *arg) {
+    StreamSourceType *src = (StreamSourceType *)arg;
+    if( offset==0 ) {
+        src->restarts++;
+    }
+    if( offset>=src->abort_at ) {
+        return -1;
+    }
+    size_t n = std::min(cap, (size_t)1000);  // shorter than asked
+    for(size_t i = 0; i < n; i++) {
+        buf[i] = 'a' + (offset + i) % 26;
+    }
+    return n;
+}
+
+typedef struct {
+    std::string value;
+    size_t      max_chunk;
+    size_t      stop_at;
+} StreamSinkType;
+
+static bool stream_sink(const char *chunk, size_t len, size_t offset, void *arg) {
+    StreamSinkType *dst = (StreamSinkType *)arg;
+    if( offset!=dst->value.length() || offset>=dst->stop_at ) {
+        return false;
+    }
+    dst->value.append(chunk, len);
+    dst->max_chunk = std::max(dst->max_chunk, len);
+    return true;
+}
+
+/* the command of an event is only valid in the hook */
+static void trace_command(const redis::cluster::Cluster::TraceEventType &event, void *arg) {
+    ((std::vector<std::string> *)arg)->push_back(std::string(event.command, event.command_len));
+}
+
+TEST_F(MockClusterTestObj, stream_trace) {
+    std::vector<std::string> events;
+    redis::cluster::Cluster::TraceHooksType hooks;
+    memset(&hooks, 0, sizeof(hooks));
+    hooks.before_send = trace_command;
+    hooks.after_reply = trace_command;
+    hooks.arg = &events;
+    cluster_->set_trace_hooks(&hooks);
+    cluster_->set_slow_log(1, 8);
+
+    StreamSourceType src;
+    src.len = 100 * 1024;
+    src.restarts = 0;
+    src.abort_at = (size_t)-1;
+    std::vector<std::string> commands;
+    commands.push_back("set");
+    commands.push_back("big");
+    ASSERT_EQ(cluster_->write_stream(commands, src.len, stream_source, &src), 0);
+    ASSERT_EQ(events.size(), 2);
+    ASSERT_EQ(events[0], "SET");
+    ASSERT_EQ(events[1], "SET");
+
+    commands[0] = "get";
+    StreamSinkType dst;
+    dst.max_chunk = 0;
+    dst.stop_at = (size_t)-1;
+    ASSERT_EQ(cluster_->read_stream(commands, stream_sink, &dst), 1);
+    ASSERT_EQ(events.size(), 4);
+    ASSERT_EQ(events[3], "GET");
+    cluster_->set_trace_hooks(NULL);
+
+    /* the value is not part of the logged command */
+    std::vector<redis::cluster::Cluster::SlowLogEntryType> entries;
+    cluster_->slow_log(entries);
+    ASSERT_EQ(entries.size(), 2);
+    ASSERT_STREQ(entries[0].command, "get big");
+    ASSERT_STREQ(entries[1].command, "set big");
+    ASSERT_EQ(entries[0].err, redis::cluster::Cluster::E_OK);
+    ASSERT_GE(entries[0].rtt_us, 1);
+
+    std::vector<redis::cluster::Cluster::CommandLatencyType> lat;
+    cluster_->command_latency(lat);
+    size_t found = 0;
+    for(size_t i = 0; i < lat.size(); i++) {
+        if( lat[i].command=="GET" || lat[i].command=="SET" ) {
+            ASSERT_EQ(lat[i].total.count, 1);
+            found++;
+        }
+    }
+    ASSERT_EQ(found, 2);
+}
+
+TEST_F(MockClusterTestObj, stream) {
+    StreamSourceType src;
+    src.len = 2 * 1024 * 1024 + 7;
+    src.restarts = 0;
+    src.abort_at = (size_t)-1;
+    std::vector<std::string> commands;
+    commands.push_back("SET");
+    commands.push_back("big");
+    ASSERT_EQ(cluster_->write_stream(commands, src.len, stream_source, &src, 4096), 0);
+    ASSERT_EQ(src.restarts, 1);
+
+    std::string expected(src.len, ' ');
+    for(size_t i = 0; i < src.len; i++) {
+        expected[i] = 'a' + i % 26;
+    }
+    std::string stored;
+    ASSERT_TRUE(mock_.get("big", stored));
+    ASSERT_TRUE(stored==expected);
+
+    commands[0] = "GET";
+    StreamSinkType dst;
+    dst.max_chunk = 0;
+    dst.stop_at = (size_t)-1;
+    ASSERT_EQ(cluster_->read_stream(commands, stream_sink, &dst, 8192), 1);
+    ASSERT_TRUE(dst.value==expected);
+    ASSERT_EQ(dst.max_chunk, 8192);
+
+    commands[1] = "missing";
+    ASSERT_EQ(cluster_->read_stream(commands, stream_sink, &dst, 8192), 0);
+
+    /* a stopped sink or an aborted source drops the connection, not the cluster */
+    commands[1] = "big";
+    dst.value.clear();
+    dst.stop_at = 100000;
+    ASSERT_EQ(cluster_->read_stream(commands, stream_sink, &dst, 8192), -1);
+    ASSERT_LE(dst.value.length(), 100000 + 8192);
+    commands[0] = "SET";
+    src.abort_at = 50000;
+    ASSERT_EQ(cluster_->write_stream(commands, src.len, stream_source, &src), -1);
+    ASSERT_EQ(cluster_->ttls(), 1);
+    ASSERT_EQ(run("GET", "missing"), "(nil)");
+
+    /* the source starts over when redirected */
+    int slot = MockCluster::key_slot("big");
+    mock_.begin_migration(slot, (mock_.owner(slot) + 1) % 3);
+    mock_.end_migration(slot);
+    src.restarts = 0;
+    src.abort_at = (size_t)-1;
+    ASSERT_EQ(cluster_->write_stream(commands, src.len, stream_source, &src), 0);
+    ASSERT_EQ(src.restarts, 2);
+    commands[0] = "GET";
+    dst.value.clear();
+    dst.stop_at = (size_t)-1;
+    ASSERT_EQ(cluster_->read_stream(commands, stream_sink, &dst), 1);
+    ASSERT_TRUE(dst.value==expected);
+}
+
+typedef struct {
+    redis::cluster::Cluster *cluster;
+    pthread_barrier_t       *barrier;
+    std::string              value;
+} CoalesceArgType;
+
+static void *coalesce_get(void *arg) {
+    CoalesceArgType *a = (CoalesceArgType *)arg;
+    std::vector<std::string> commands;
+    commands.push_back("GET");
+    commands.push_back("shared");
+    pthread_barrier_wait(a->barrier);
+    redisReply *reply = a->cluster->run(commands);
+    if( reply ) {
+        a->value.assign(reply->str? reply->str: "", reply->len);
+        freeReplyObject(reply);
+    }
+    return NULL;
+}
+
+TEST_F(MockClusterTestObj, coalescing) {
+    const int THREADS = 8;
+    ASSERT_EQ(run("SET", "shared", "value"), "OK");
+    cluster_->set_coalescing(true);
+
+    /* the reply is slow enough for every thread to join the first request */
+    int node = mock_.owner(MockCluster::key_slot("shared"));
+    mock_.set_delay(node, 200 * 1000);
+    uint64_t before = mock_.requests(node);
+
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, THREADS);
+    std::vector<CoalesceArgType> args(THREADS);
+    std::vector<pthread_t> tids(THREADS);
+    for(int i = 0; i < THREADS; i++) {
+        args[i].cluster = cluster_;
+        args[i].barrier = &barrier;
+        ASSERT_EQ(pthread_create(&tids[i], NULL, coalesce_get, &args[i]), 0);
+    }
+    for(int i = 0; i < THREADS; i++) {
+        pthread_join(tids[i], NULL);
+        ASSERT_EQ(args[i].value, "value");
+    }
+    pthread_barrier_destroy(&barrier);
+    ASSERT_EQ(mock_.requests(node) - before, 1);
+
+    /* coalescing alone never hedges */
+    redis::cluster::Cluster::HedgeStatType hs = cluster_->hedge_stat();
+    ASSERT_EQ(hs.reads, 0);
+    ASSERT_EQ(hs.hedged, 0);
+    mock_.set_delay(node, 0);
+}
+
+
+static void collect_message(const std::string &channel, const std::string &message, void *arg) {
+    ((std::vector<std::string> *)arg)->push_back(channel + "=" + message);
+}
+
+/* a channel of a slot owned by node, named by hash tag */
+static std::string channel_of(MockCluster &mock, int node) {
+    for(int i = 0;; i++) {
+        std::string channel = "{c" + std::to_string(i) + "}ch";
+        if( mock.owner(MockCluster::key_slot(channel))==node ) {
+            return channel;
+        }
+    }
+}
+
+/* SPUBLISH again until sub is subscribed at the owner and dispatched it */
+static bool deliver(redis::cluster::Cluster *cluster, redis::cluster::ShardedSubscriber *sub,
+                    const std::string &channel, const std::string &message, std::vector<std::string> &got) {
+    std::string want = channel + "=" + message;
+    for(int i = 0; i < 100; i++) {
+        std::vector<std::string> commands;
+        commands.push_back("SPUBLISH");
+        commands.push_back(channel);
+        commands.push_back(message);
+        redisReply *reply = cluster->run(commands);
+        if( reply ) {
+            freeReplyObject(reply);
+        }
+        for(int j = 0; j < 5; j++) {
+            if( sub->poll(20)<0 ) {
+                return false;
+            }
+            if( std::find(got.begin(), got.end(), want)!=got.end() ) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+TEST_F(MockClusterTestObj, sharded_subscriber) {
+    std::vector<std::string> got;
+    redis::cluster::ShardedSubscriber *sub = new redis::cluster::ShardedSubscriber(cluster_, collect_message, &got);
+    std::string ch0 = channel_of(mock_, 0);
+    std::string ch1 = channel_of(mock_, 1);
+
+    /* one connection per owning node */
+
+    ASSERT_EQ(sub->subscribe(ch0), 0);
+    ASSERT_EQ(sub->subscribe(ch1), 0);
+    ASSERT_EQ(sub->channels(), 2u);
+    ASSERT_EQ(sub->connections(), 2u);
+    ASSERT_TRUE(deliver(cluster_, sub, ch0, "m1", got));
+    ASSERT_TRUE(deliver(cluster_, sub, ch1, "m2", got));
+
+    /* a cluster whose map is stale, for the MOVED of SSUBSCRIBE below */
+
+    redis::cluster::Cluster *stale = new redis::cluster::Cluster(1);
+    ASSERT_EQ(stale->setup(mock_.startup().c_str(), false), 0);
+
+    /* the slot of ch0 moves: the old owner unsubscribes it, it is subscribed at the new one */
+
+    int slot0 = MockCluster::key_slot(ch0);
+    mock_.begin_migration(slot0, 2);
+    mock_.end_migration(slot0);
+    ASSERT_TRUE(deliver(cluster_, sub, ch0, "m3", got));
+
+    std::vector<std::string> stale_got;
+    redis::cluster::ShardedSubscriber *stale_sub = new redis::cluster::ShardedSubscriber(stale, collect_message, &stale_got);
+    ASSERT_EQ(stale_sub->subscribe(ch0), 0);
+    ASSERT_TRUE(deliver(cluster_, stale_sub, ch0, "m4", stale_got));
+    ASSERT_EQ(stale->test_slot_node(ch0)->port(), (unsigned int)mock_.port(2));
+    delete stale_sub;
+    delete stale;
+
+    /* the owner of ch1 is lost, its slots served by another */
+
+    mock_.failover(1, 2);
+    mock_.set_down(1, true);
+    ASSERT_TRUE(deliver(cluster_, sub, ch1, "m5", got));
+    ASSERT_TRUE(deliver(cluster_, sub, ch0, "m6", got));
+
+    ASSERT_EQ(sub->unsubscribe(ch0), 0);
+    ASSERT_EQ(sub->unsubscribe(ch1), 0);
+    ASSERT_EQ(sub->channels(), 0u);
+    ASSERT_EQ(sub->connections(), 0u);
+    delete sub;
+}
+
+/* sum of the field ("commands:", ...) over the lines of a stat_dump() */
+static uint64_t stat_dump_sum(const std::string &dump, const std::string &field) {
+    uint64_t sum = 0;
+    for(size_t pos = dump.find(field); pos!=std::string::npos; pos = dump.find(field, pos + 1)) {
+        sum += strtoull(dump.c_str() + pos + field.length(), NULL, 10);
+    }
+    return sum;
+}
+
+TEST_F(MockClusterTestObj, bulk_loader) {
+    /* slot a is migrating (ASK), slot b moved already (MOVED), the map of cluster_ is stale for b */
+
+    int slot_a = MockCluster::key_slot("{a}");
+    int slot_b = MockCluster::key_slot("{b}");
+    int to_a = (mock_.owner(slot_a) + 1) % 3;
+    int to_b = (mock_.owner(slot_b) + 1) % 3;
+    mock_.begin_migration(slot_a, to_a);
+    mock_.begin_migration(slot_b, to_b);
+    mock_.end_migration(slot_b);
+
+    /* a small window on two connections, refilled many times */
+
+    const int N = 3000;
+    redis::cluster::BulkLoader *loader = new redis::cluster::BulkLoader(cluster_, 2, 16, N);
+    for(int i = 0; i < N - 1; i++) {
+        std::string key = i % 10==0? "{a}" + std::to_string(i): i % 10==1? "{b}" + std::to_string(i): "k" + std::to_string(i);
+        ASSERT_EQ(loader->set(key, "v" + std::to_string(i)), 0);
+    }
+    ASSERT_EQ(loader->pending(), (size_t)N - 1);
+    ASSERT_EQ(loader->set("k" + std::to_string(N - 1), "v" + std::to_string(N - 1)), 0);     // flushed by itself at N
+    ASSERT_EQ(loader->pending(), 0u);
+    ASSERT_EQ(loader->flush(), 0);
+
+    std::string dump = loader->stat_dump();
+    ASSERT_EQ(stat_dump_sum(dump, "commands: "), (uint64_t)N) << dump;
+    ASSERT_EQ(stat_dump_sum(dump, "errors: "), 0u) << dump;
+    ASSERT_EQ(stat_dump_sum(dump, "redirects: "), (uint64_t)N / 10 * 2) << dump;
+
+    std::string value;
+    ASSERT_TRUE(mock_.get("{a}10", value));
+    ASSERT_EQ(value, "v10");
+    ASSERT_TRUE(mock_.get("{b}11", value));
+    ASSERT_EQ(value, "v11");
+    ASSERT_TRUE(mock_.get("k2999", value));
+    ASSERT_EQ(value, "v2999");
+
+    /* the MOVED learned by the job threads is in the slots cache */
+    ASSERT_EQ(cluster_->test_slot_node("{b}")->port(), (unsigned int)mock_.port(to_b));
+    delete loader;
+
+    /* the same through io_uring, where available */
+
+    if( cluster_->set_io_backend(redis::cluster::Cluster::IO_URING)==0 ) {
+        loader = new redis::cluster::BulkLoader(cluster_, 2, 16, N);
+        for(int i = 0; i < N / 2; i++) {
+            ASSERT_EQ(loader->set("u" + std::to_string(i), "v"), 0);
+        }
+        ASSERT_EQ(loader->flush(), 0);
+        ASSERT_EQ(stat_dump_sum(loader->stat_dump(), "commands: "), (uint64_t)N / 2);
+        ASSERT_TRUE(mock_.get("u1499", value));
+        delete loader;
+    }
+}
+
+/* GET through cluster, the value or "(fail)", ms is set to the time it took */
+static std::string timed_get(redis::cluster::Cluster *cluster, const std::string &key, int &ms) {
+    std::vector<std::string> commands;
+    commands.push_back("GET");
+    commands.push_back(key);
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    redisReply *reply = cluster->run(commands);
+    gettimeofday(&end, NULL);
+    ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000;
+    if( !reply ) {
+        return "(fail)";
+    }
+    std::string value = reply->type==REDIS_REPLY_STRING? std::string(reply->str, reply->len): "(nil)";
+    freeReplyObject(reply);
+    return value;
+}
+
+TEST(CaseHedging, test_readonly_pooled_conn) {
+    MockCluster mock;
+    ASSERT_EQ(mock.start(1, 1), 0);
+
+    /* pooled before the node was known as a replica, e.g. as a startup node */
+    redis::cluster::Node node("127.0.0.1", mock.port(mock.replica(0, 0)), 1);
+    redisContext *c = (redisContext *)node.get_conn();
+    ASSERT_TRUE(c != NULL);
+    node.put_conn(c);
+
+    node.set_readonly(true);
+    redisContext *c2 = (redisContext *)node.get_conn();
+    ASSERT_TRUE(c2 == c);
+    redisReply *reply = (redisReply *)redisCommand(c2, "GET foo");
+    ASSERT_TRUE(reply != NULL);
+    ASSERT_EQ(reply->type, REDIS_REPLY_NIL);
+    freeReplyObject(reply);
+    node.put_conn(c2);
+
+    /* READONLY is sent once per connection */
+    ASSERT_TRUE(node.get_conn() == c);
+    ASSERT_EQ(mock.requests(mock.replica(0, 0)), 2u);
+    node.put_conn(c);
+}
+
+TEST(CaseHedging, test_hedged_reads) {
+    MockCluster mock;
+    ASSERT_EQ(mock.start(1, 1), 0);
+    int replica = mock.replica(0, 0);
+
+    redis::cluster::Cluster *cluster = new redis::cluster::Cluster(1);
+    ASSERT_EQ(cluster->setup(mock.startup().c_str(), false), 0);
+    std::vector<std::string> commands;
+    commands.push_back("SET");
+    commands.push_back("foo");
+    commands.push_back("bar");
+    redisReply *reply = cluster->run(commands);
+    ASSERT_TRUE(reply != NULL);
+    freeReplyObject(reply);
+    commands[1] = "foo2";
+    commands[2] = "baz";
+    reply = cluster->run(commands);
+    ASSERT_TRUE(reply != NULL);
+    freeReplyObject(reply);
+
+    redis::cluster::Cluster::HedgePolicyType policy;
+    policy.enabled = true;
+    policy.percentile = 0.9;
+    policy.min_delay_us = 1000;
+    policy.max_delay_us = 20000;
+    policy.max_ratio = 1.0;
+    cluster->set_hedge_policy(policy);
+
+    /* a primary replying within the hedge delay is not raced */
+
+    int ms;
+    mock.set_delay(0, 2000);
+    ASSERT_EQ(timed_get(cluster, "foo", ms), "bar");
+    ASSERT_EQ(cluster->hedge_stat().hedged, 0u);
+    ASSERT_EQ(mock.requests(replica), 0u);
+
+    /* a slow one is, after the hedge delay, and the replica wins */
+
+    mock.set_delay(0, 300000);
+    ASSERT_EQ(timed_get(cluster, "foo", ms), "bar");
+    ASSERT_GE(ms, 20);
+    ASSERT_LT(ms, 250);
+    redis::cluster::Cluster::HedgeStatType stat = cluster->hedge_stat();
+    ASSERT_EQ(stat.hedged, 1u);
+    ASSERT_EQ(stat.replica_wins, 1u);
+    ASSERT_GT(mock.requests(replica), 0u);
+
+    /* the primary's connection lost the race and was dropped, its late reply is not read for the next request */
+
+    mock.set_delay(0, 0);
+    ASSERT_EQ(timed_get(cluster, "foo2", ms), "baz");
+    ASSERT_EQ(timed_get(cluster, "foo", ms), "bar");
+    delete cluster;
+
+    /* at most max_ratio of the reads are hedged */
+
+    cluster = new redis::cluster::Cluster(1);
+    ASSERT_EQ(cluster->setup(mock.startup().c_str(), false), 0);
+    policy.max_delay_us = 2000;
+    policy.max_ratio = 0.25;
+    cluster->set_hedge_policy(policy);
+    mock.set_delay(0, 20000);
+    for(int i = 0; i < 8; i++) {
+        ASSERT_EQ(timed_get(cluster, "foo", ms), "bar");
+    }
+    stat = cluster->hedge_stat();
+    ASSERT_EQ(stat.reads, 8u);
+    ASSERT_EQ(stat.hedged, 2u);
+    ASSERT_EQ(stat.throttled, 6u);
+    delete cluster;
+    mock.stop();
+}
 
 int main(int argc, char *argv[]) {
     ::testing::InitGoogleTest(&argc, argv);